@@ -1,6 +1,9 @@
 #pragma once
 
 #include "bsp.h"
+#include "bsp_compiled.h"
+#include "bsp_render.h"
+#include "util_framescheduler.h"
 
 using HTEXTURE = unsigned long long;
 #define TEXTURE_CUBEMAP_POSITIVE_X (0)
@@ -10,6 +13,15 @@ using HTEXTURE = unsigned long long;
 #define TEXTURE_CUBEMAP_POSITIVE_Z (TEXTURE_CUBEMAP_NEGATIVE_Y + 1)
 #define TEXTURE_CUBEMAP_NEGATIVE_Z (TEXTURE_CUBEMAP_POSITIVE_Z + 1)
 
+// Work a backend sent to the GPU
+struct draw_counters {
+    // Draw API calls and the draws they issued; a multi-draw is one call
+    long long nCalls;
+    long long nDraws;
+    // Vertex, index and uniform data and draw parameters
+    long long nUploadBytes;
+};
+
 class IGraphicsEngine {
 public:
     virtual void Initialize(int nScreenWidth, int nScreenHeight, bool bFullscreen) = 0;
@@ -17,8 +29,13 @@ public:
 
     virtual void ClearScreen() = 0;
     virtual void SwapScreen() = 0;
-    virtual void DrawPolygonSet(PolygonContainer const* pPolySet) = 0;
-    virtual void DrawBSPTree(bsp_node const* pTree) = 0;
+    // The windings index into pVertices
+    virtual void DrawPolygonSet(vector4 const* pVertices, PolygonContainer::winding const* pWindings, int nPolygons) = 0;
+    virtual void DrawBSPTree(bsp_compiled const* pTree) = 0;
+    // Frustum culling counts of the last DrawBSPTree
+    virtual void GetCullStats(bsp_cull_stats* pStats) = 0;
+    // Totals since the engine was created
+    virtual void GetDrawCounters(draw_counters* pCounters) = 0;
 
     virtual void SetCameraPosition(vector4 const* pPos) = 0;
     virtual void SetCameraRotation(vector4 const* pRot) = 0;
@@ -26,6 +43,11 @@ public:
     virtual void GetCameraRotation(vector4* pRot) = 0;
 
     virtual float GetFrameTime() = 0;
+    virtual void SetFramePacing(const frame_pacing_params* pParams) = 0;
+    // Starts timing frames from now; called right before the first frame,
+    // so that loading doesn't show up as a long frame
+    virtual void ResetFrameTiming() = 0;
+    virtual void GetFrameTelemetry(frame_telemetry* pTelemetry) = 0;
 
     virtual void RenderWireframe(bool bEnable) = 0;
 
@@ -0,0 +1,514 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include "bsp.h"
+#include "bsp_compiled.h"
+#include "bsp_trace.h"
+#include "headless_core.h"
+#include "soft_core.h"
+#include "poly_part.h"
+#include "mapgen.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+typedef bool (*PFNSPLIT)(Polygon* pFront, Polygon* pBack, const Polygon& poly, const float plane[4]);
+
+static unsigned g_uRandom = 1;
+
+static float RandomFloat(float flMin, float flMax) {
+    // xorshift32
+    g_uRandom ^= g_uRandom << 13;
+    g_uRandom ^= g_uRandom >> 17;
+    g_uRandom ^= g_uRandom << 5;
+    return flMin + (flMax - flMin) * (g_uRandom & 0xFFFFFF) / (float)0xFFFFFF;
+}
+
+static vector4 RandomDirection() {
+    vector4 ret;
+    do {
+        ret = vector4(RandomFloat(-1, 1), RandomFloat(-1, 1), RandomFloat(-1, 1));
+    } while (ret.length_sq() < 0.01f);
+    return normalize(ret);
+}
+
+static double Now() {
+    return std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+}
+
+// Peak resident set size of the process in bytes
+static size_t PeakMemory() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+    return pmc.PeakWorkingSetSize;
+#else
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#if defined(__APPLE__)
+    return (size_t)ru.ru_maxrss;
+#else
+    return (size_t)ru.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+static void PrintResult(const char* pszName, double flNs, const char* pszFormat = NULL, ...) {
+    printf("%-32s %10.1f ns/op", pszName, flNs);
+    if (pszFormat) {
+        va_list va;
+        va_start(va, pszFormat);
+        printf("  ");
+        vprintf(pszFormat, va);
+        va_end(va);
+    }
+    printf("\n");
+}
+
+// Regular polygon with nVertices vertices in a random orientation
+static Polygon RandomPolygon(int nVertices, vector4* pCenter, vector4* pU) {
+    Polygon ret;
+    auto N = RandomDirection();
+    auto U = normalize(cross(N, fabsf(N[0]) < 0.9f ? vector4(1, 0, 0) : vector4(0, 1, 0)));
+    auto V = cross(N, U);
+    vector4 center(RandomFloat(-100, 100), RandomFloat(-100, 100), RandomFloat(-100, 100));
+    float flRadius = RandomFloat(1, 10);
+
+    for (int iVtx = 0; iVtx < nVertices; iVtx++) {
+        float flAngle = 2 * 3.1415926f * iVtx / nVertices;
+        ret += center + (flRadius * cosf(flAngle)) * U + (flRadius * sinf(flAngle)) * V;
+    }
+    if (pCenter) {
+        *pCenter = center;
+    }
+    if (pU) {
+        *pU = U;
+    }
+    return ret;
+}
+
+static void BenchWhichSide(int nCases, int nRounds) {
+    std::vector<Plane> planes(nCases);
+    std::vector<vector4> equations(nCases);
+    std::vector<vector4> points(nCases);
+    int nFront = 0;
+    double t0;
+
+    for (int i = 0; i < nCases; i++) {
+        vector4 N;
+        float D;
+        planes[i] = Plane(
+            vector4(RandomFloat(-10, 10), RandomFloat(-10, 10), RandomFloat(-10, 10)),
+            vector4(RandomFloat(-10, 10), RandomFloat(-10, 10), RandomFloat(-10, 10)),
+            vector4(RandomFloat(-10, 10), RandomFloat(-10, 10), RandomFloat(-10, 10)));
+        PlaneEquation(&N, &D, planes[i]);
+        equations[i] = vector4(N[0], N[1], N[2], D);
+        points[i] = vector4(RandomFloat(-10, 10), RandomFloat(-10, 10), RandomFloat(-10, 10));
+    }
+
+    t0 = Now();
+    for (int iRound = 0; iRound < nRounds; iRound++) {
+        for (int i = 0; i < nCases; i++) {
+            nFront += WhichSide(planes[i], points[i]) == SIDE_FRONT;
+        }
+    }
+    PrintResult("WhichSide (Plane)", (Now() - t0) / ((double)nRounds * nCases), "%d in front", nFront);
+
+    nFront = 0;
+    t0 = Now();
+    for (int iRound = 0; iRound < nRounds; iRound++) {
+        for (int i = 0; i < nCases; i++) {
+            nFront += WhichSide(equations[i].v, points[i]) == SIDE_FRONT;
+        }
+    }
+    PrintResult("WhichSide (equation)", (Now() - t0) / ((double)nRounds * nCases), "%d in front", nFront);
+}
+
+static void BenchFromLines(int nCases, int nRounds) {
+    std::vector<LineContainer> soups(nCases);
+    int nVertices = 0;
+    double t0;
+
+    // The edges of wall quads, the kind of soup SplitPolygonLines makes
+    for (auto& lc : soups) {
+        vector4 P0(RandomFloat(-100, 100), 0, RandomFloat(-100, 100));
+        vector4 dir = RandomDirection();
+        dir[1] = 0;
+        auto P1 = P0 + RandomFloat(1, 10) * normalize(dir);
+        vector4 aCorners[4] = {
+            P0 + vector4(0, 1, 0), P0 + vector4(0, -1, 0),
+            P1 + vector4(0, -1, 0), P1 + vector4(0, 1, 0),
+        };
+        for (int i = 0; i < 4; i++) {
+            lc += aCorners[i];
+            lc += aCorners[(i + 1) % 4];
+        }
+    }
+
+    t0 = Now();
+    for (int iRound = 0; iRound < nRounds; iRound++) {
+        for (auto& lc : soups) {
+            nVertices += FromLines(lc).Count();
+        }
+    }
+    PrintResult("FromLines (quads)", (Now() - t0) / ((double)nRounds * nCases), "%d vertices", nVertices);
+}
+
+static void BenchFanTriangulate(int nCases, int nRounds) {
+    std::vector<Polygon> polys(nCases);
+    int nTriangles = 0;
+    double t0;
+
+    for (auto& poly : polys) {
+        poly = RandomPolygon(3 + (int)RandomFloat(0, 9.99f), NULL, NULL);
+    }
+
+    t0 = Now();
+    for (int iRound = 0; iRound < nRounds; iRound++) {
+        for (auto& poly : polys) {
+            nTriangles += FanTriangulate(poly).Count();
+        }
+    }
+    PrintResult("FanTriangulate (3-12 gons)", (Now() - t0) / ((double)nRounds * nCases), "%d triangles", nTriangles);
+}
+
+struct split_case {
+    Polygon poly;
+    float aflPlane[4];
+};
+
+// Wall quads like the ones From2D makes, each cut by a vertical plane
+// crossing it somewhere along its length
+static void MakeWallSplitCases(std::vector<split_case>* pCases, int nCases) {
+    pCases->resize(nCases);
+    for (auto& c : *pCases) {
+        vector4 dir = RandomDirection();
+        dir[1] = 0;
+        dir = normalize(dir);
+        float flLength = RandomFloat(1, 10);
+        vector4 P0(RandomFloat(-100, 100), 0, RandomFloat(-100, 100));
+        auto P1 = P0 + flLength * dir;
+        auto S = RandomDirection();
+        S[1] = 0;
+        S = normalize(S);
+
+        c.poly = Polygon();
+        c.poly += P0 + vector4(0, 1, 0);
+        c.poly += P0 + vector4(0, -1, 0);
+        c.poly += P1 + vector4(0, -1, 0);
+        c.poly += P1 + vector4(0, 1, 0);
+        c.aflPlane[0] = S[0];
+        c.aflPlane[1] = S[1];
+        c.aflPlane[2] = S[2];
+        c.aflPlane[3] = -dot(S, P0 + (RandomFloat(0.1f, 0.9f) * flLength) * dir);
+    }
+}
+
+// Regular polygons with 3 to 12 vertices in random orientations, each cut
+// by a random plane near its center
+static void MakePolygonSplitCases(std::vector<split_case>* pCases, int nCases) {
+    pCases->resize(nCases);
+    for (auto& c : *pCases) {
+        vector4 center, U;
+        auto S = RandomDirection();
+
+        c.poly = RandomPolygon(3 + (int)RandomFloat(0, 9.99f), &center, &U);
+        c.aflPlane[0] = S[0];
+        c.aflPlane[1] = S[1];
+        c.aflPlane[2] = S[2];
+        c.aflPlane[3] = -dot(S, center + RandomFloat(-0.5f, 0.5f) * U);
+    }
+}
+
+// Returns the time of one split in nanoseconds
+static double BenchSplit(PFNSPLIT pfnSplit, const std::vector<split_case>& cases, int nRounds, int* pSplits, int* pVertices) {
+    Polygon front, back;
+    int nSplits = 0, nVertices = 0;
+
+    double t0 = Now();
+    for (int iRound = 0; iRound < nRounds; iRound++) {
+        for (auto& c : cases) {
+            if (pfnSplit(&front, &back, c.poly, c.aflPlane)) {
+                nSplits++;
+                nVertices += front.Count() + back.Count();
+            }
+        }
+    }
+
+    *pSplits = nSplits;
+    *pVertices = nVertices;
+    return (Now() - t0) / ((double)nRounds * cases.size());
+}
+
+static void BenchSplits(int nCases, int nRounds) {
+    std::vector<split_case> cases;
+    int nSplits, nVertices;
+    double flNs, flNsLines;
+
+    MakeWallSplitCases(&cases, nCases);
+    flNs = BenchSplit(SplitPolygon2, cases, nRounds, &nSplits, &nVertices);
+    PrintResult("SplitPolygon2 (walls)", flNs, "%d splits, %d vertices", nSplits, nVertices);
+    flNsLines = BenchSplit(SplitPolygonLines, cases, nRounds, &nSplits, &nVertices);
+    PrintResult("SplitPolygonLines (walls)", flNsLines, "%d splits, %d vertices", nSplits, nVertices);
+    printf("%-32s %10.2fx\n", "speedup", flNsLines / flNs);
+
+    // SplitPolygonLines can't rebuild most of these, so there is nothing
+    // to compare against
+    MakePolygonSplitCases(&cases, nCases);
+    flNs = BenchSplit(SplitPolygon2, cases, nRounds, &nSplits, &nVertices);
+    PrintResult("SplitPolygon2 (3-12 gons)", flNs, "%d splits, %d vertices", nSplits, nVertices);
+}
+
+// Builds maps of nMinWalls, 4 * nMinWalls, ... walls up to nMaxWalls
+static void BenchBuild(const mapgen_params* pMapParams, int nMinWalls, int nMaxWalls, int nThreads) {
+    PolygonContainer pc;
+    bsp_tree tree;
+    bsp_build_params params;
+    bsp_build_stats stats;
+    mapgen_params mapParams = *pMapParams;
+
+    DefaultBSPBuildParams(&params);
+    params.nThreads = nThreads;
+
+    printf("%s map, seed %u, %s angles\n",
+        MapLayoutName(mapParams.layout), mapParams.uSeed, mapParams.bAxial ? "axial" : "arbitrary");
+    printf("%-10s %10s %12s %10s %10s %8s %8s %10s %10s\n",
+        "walls", "ms", "polys/s", "output", "splits", "depth", "avg", "tree KB", "peak KB");
+    for (int nWalls = nMinWalls; nWalls <= nMaxWalls; nWalls *= 4) {
+        mapParams.nWalls = nWalls;
+        pc.Clear();
+        GenerateMap(&pc, &mapParams);
+
+        double t0 = Now();
+        BuildBSPTree(&tree, pc, &params, &stats);
+        double flNs = Now() - t0;
+
+        printf("%-10d %10.2f %12.0f %10d %10d %8d %8.2f %10zu %10zu\n",
+            nWalls, flNs / 1e6, nWalls / (flNs / 1e9),
+            stats.nOutputPolygons, stats.nSplits, stats.nMaxDepth, stats.flAvgDepth,
+            stats.nNodeBytes / 1024, PeakMemory() / 1024);
+    }
+}
+
+// Traces segments of up to 20 units in random directions from random
+// points of the map, as line of sight and hitscan checks would
+static void BenchTrace(const mapgen_params* pMapParams, int nWalls, int nCases, int nRounds, int nThreads) {
+    PolygonContainer pc;
+    bsp_tree tree;
+    bsp_compiled compiled;
+    bsp_build_params params;
+    mapgen_params mapParams = *pMapParams;
+    std::vector<bsp_segment> segments(nCases);
+    std::vector<bsp_trace> results(nCases);
+    int nHits = 0;
+    double t0, flNs;
+
+    mapParams.nWalls = nWalls;
+    GenerateMap(&pc, &mapParams);
+    DefaultBSPBuildParams(&params);
+    BuildBSPTree(&tree, pc, &params, NULL);
+    CompileBSPTree(&compiled, &tree);
+
+    auto& root = compiled.pNodes[0];
+    for (auto& segment : segments) {
+        segment.vStart = vector4(
+            RandomFloat(root.aflMins[0], root.aflMaxs[0]),
+            RandomFloat(root.aflMins[1], root.aflMaxs[1]),
+            RandomFloat(root.aflMins[2], root.aflMaxs[2]), 1);
+        segment.vEnd = segment.vStart + RandomFloat(0, 20) * RandomDirection();
+    }
+
+    t0 = Now();
+    for (int iRound = 0; iRound < nRounds; iRound++) {
+        for (int i = 0; i < nCases; i++) {
+            nHits += TraceSegment(&results[i], &compiled, segments[i].vStart, segments[i].vEnd);
+        }
+    }
+    flNs = (Now() - t0) / ((double)nRounds * nCases);
+    PrintResult("TraceSegment", flNs, "%.0f rays/s, %d hits, %d walls", 1e9 / flNs, nHits, nWalls);
+
+    if (nThreads != 1) {
+        CTaskPool pool(nThreads);
+        nHits = 0;
+        t0 = Now();
+        for (int iRound = 0; iRound < nRounds; iRound++) {
+            TraceSegments(results.data(), &compiled, segments.data(), nCases, &pool);
+        }
+        flNs = (Now() - t0) / ((double)nRounds * nCases);
+        for (auto& result : results) {
+            nHits += result.iPolygon >= 0;
+        }
+        PrintResult("TraceSegments (batch)", flNs, "%.0f rays/s, %d hits, %d threads", 1e9 / flNs, nHits * nRounds, pool.ThreadCount());
+    }
+
+    for (int iShape = 0; iShape < 2; iShape++) {
+        bsp_hull hull;
+        if (iShape == 0) {
+            MakeBoxHull(&hull, vector4(0.25f, 0.5f, 0.25f));
+        } else {
+            MakeSphereHull(&hull, 0.25f);
+        }
+        nHits = 0;
+        t0 = Now();
+        for (int iRound = 0; iRound < nRounds; iRound++) {
+            for (int i = 0; i < nCases; i++) {
+                nHits += TraceHull(&results[i], &compiled, &hull, segments[i].vStart, segments[i].vEnd);
+            }
+        }
+        flNs = (Now() - t0) / ((double)nRounds * nCases);
+        PrintResult(iShape == 0 ? "TraceHull (box)" : "TraceHull (sphere)", flNs, "%.0f sweeps/s, %d hits", 1e9 / flNs, nHits);
+    }
+}
+
+// Builds the tree the render benchmarks draw
+static void BuildBenchLevel(bsp_compiled* pCompiled, const mapgen_params* pMapParams, int nWalls) {
+    PolygonContainer pc;
+    bsp_tree tree;
+    bsp_build_params params;
+    mapgen_params mapParams = *pMapParams;
+
+    mapParams.nWalls = nWalls;
+    GenerateMap(&pc, &mapParams);
+    DefaultBSPBuildParams(&params);
+    BuildBSPTree(&tree, pc, &params, NULL);
+    CompileBSPTree(pCompiled, &tree);
+}
+
+// Puts the camera on frame iFrame of nFrames on a circle around the middle
+// of the map, looking along the circle
+static void SetBenchCamera(CHeadlessCore* pCore, const bsp_compiled* pCompiled, int iFrame, int nFrames) {
+    auto& root = pCompiled->pNodes[0];
+    float flRadius = 0.25f * (root.aflMaxs[0] - root.aflMins[0]);
+    float flAngle = 2 * 3.1415926f * iFrame / nFrames;
+    vector4 vEye(
+        0.5f * (root.aflMins[0] + root.aflMaxs[0]) + flRadius * cosf(flAngle), 0,
+        0.5f * (root.aflMins[2] + root.aflMaxs[2]) + flRadius * sinf(flAngle));
+    vector4 vPos = -1 * vEye, vRot(0, -flAngle, 0);
+    pCore->SetCameraPosition(&vPos);
+    pCore->SetCameraRotation(&vRot);
+}
+
+// Draws the tree through the headless backend from nFrames points of a
+// circle around the middle of the map
+static void BenchRender(const mapgen_params* pMapParams, int nWalls, int nFrames) {
+    bsp_compiled compiled;
+    CHeadlessCore core;
+
+    BuildBenchLevel(&compiled, pMapParams, nWalls);
+    core.SetFrameLimit(nFrames);
+    core.Initialize(800, 600, false);
+    // The first draw uploads the mesh
+    core.DrawBSPTree(&compiled);
+    core.SwapScreen();
+    core.ClearRecords();
+    for (int iFrame = 0; iFrame < nFrames; iFrame++) {
+        SetBenchCamera(&core, &compiled, iFrame, nFrames);
+        core.ClearScreen();
+        core.DrawBSPTree(&compiled);
+        core.SwapScreen();
+    }
+
+    auto& totals = core.Totals(eDrawCallBSPTree);
+    PrintResult("DrawBSPTree (headless)", totals.flCpuMs * 1e6 / nFrames, "%.0f vertices, %.1f draws, %.0f bytes per frame, %d walls",
+        totals.nVertices / (double)nFrames, totals.nDraws / (double)nFrames, totals.nUploadBytes / (double)nFrames, nWalls);
+}
+
+// Draws the tree and the skybox with the software rasterizer at the given
+// resolutions; BSP_SOFT_THREADS sets the raster threads
+static void BenchSoftRender(const mapgen_params* pMapParams, int nWalls, int nFrames) {
+    const int anResolutions[][2] = { { 800, 600 }, { 1920, 1080 } };
+    char const* aSkybox[6] = {
+        "data/textures/ely_sunset/sunset_rt.tga",
+        "data/textures/ely_sunset/sunset_lf.tga",
+        "data/textures/ely_sunset/sunset_up.tga",
+        "data/textures/ely_sunset/sunset_dn.tga",
+        "data/textures/ely_sunset/sunset_bk.tga",
+        "data/textures/ely_sunset/sunset_ft.tga",
+    };
+    bsp_compiled compiled;
+
+    BuildBenchLevel(&compiled, pMapParams, nWalls);
+    for (auto& resolution : anResolutions) {
+        CSoftwareCore core;
+        HTEXTURE hSkybox;
+        double flCpuMs = 0, flRasterMs = 0;
+        long long nTriangles = 0;
+        char szName[64];
+
+        core.SetFrameLimit(nFrames);
+        core.Initialize(resolution[0], resolution[1], false);
+        // A missing skybox is drawn black, which costs the same
+        core.LoadCubemapTexture(&hSkybox, aSkybox);
+        core.DrawBSPTree(&compiled);
+        core.SwapScreen();
+        core.ClearRecords();
+        for (int iFrame = 0; iFrame < nFrames; iFrame++) {
+            SetBenchCamera(&core, &compiled, iFrame, nFrames);
+            core.ClearScreen();
+            core.DrawBSPTree(&compiled);
+            core.DrawSkybox(hSkybox);
+            nTriangles += core.Raster().TriangleCount();
+            core.SwapScreen();
+            flRasterMs += core.LastRasterMs();
+        }
+
+        flCpuMs = core.Totals(eDrawCallBSPTree).flCpuMs + core.Totals(eDrawCallPolygonSet).flCpuMs + flRasterMs;
+        snprintf(szName, sizeof(szName), "CSoftwareCore %dx%d", resolution[0], resolution[1]);
+        PrintResult(szName, flCpuMs * 1e6 / nFrames, "%.1f fps, %.3f ms raster, %.0f triangles per frame, %d walls",
+            1000.0 * nFrames / flCpuMs, flRasterMs / nFrames, nTriangles / (double)nFrames, nWalls);
+        core.ClearRecords();
+    }
+}
+
+int main(int argc, char** argv) {
+    int nCases = 10000;
+    int nRounds = 20;
+    int nMaxWalls = 16384;
+    int nThreads = 1;
+    mapgen_params mapParams;
+
+    DefaultMapGenParams(&mapParams);
+    mapParams.layout = eMapLayoutScatter;
+
+    for (int iArg = 1; iArg < argc; iArg++) {
+        if (strcmp(argv[iArg], "-n") == 0 && iArg + 1 < argc) {
+            nCases = atoi(argv[++iArg]);
+        } else if (strcmp(argv[iArg], "-r") == 0 && iArg + 1 < argc) {
+            nRounds = atoi(argv[++iArg]);
+        } else if (strcmp(argv[iArg], "-w") == 0 && iArg + 1 < argc) {
+            nMaxWalls = atoi(argv[++iArg]);
+        } else if (strcmp(argv[iArg], "-t") == 0 && iArg + 1 < argc) {
+            nThreads = atoi(argv[++iArg]);
+        } else if (strcmp(argv[iArg], "-l") == 0 && iArg + 1 < argc) {
+            mapParams.layout = MapLayoutFromName(argv[++iArg]);
+            if (mapParams.layout == eMapLayoutMax) {
+                fprintf(stderr, "unknown layout '%s'\n", argv[iArg]);
+                return 1;
+            }
+        } else if (strcmp(argv[iArg], "-a") == 0) {
+            mapParams.bAxial = false;
+        } else {
+            fprintf(stderr, "usage: %s [-n cases] [-r rounds] [-w max walls] [-t build and trace threads] [-l map layout] [-a]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    BenchWhichSide(nCases, nRounds);
+    BenchSplits(nCases, nRounds);
+    BenchFromLines(nCases, nRounds);
+    BenchFanTriangulate(nCases, nRounds);
+    BenchTrace(&mapParams, 4096, nCases, nRounds, nThreads);
+    BenchRender(&mapParams, 4096, 50 * nRounds);
+    BenchSoftRender(&mapParams, 4096, 5 * nRounds);
+    BenchBuild(&mapParams, 256, nMaxWalls, nThreads);
+
+    return 0;
+}
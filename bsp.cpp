@@ -1,7 +1,11 @@
 #include <assert.h>
+#include <algorithm>
+#include <chrono>
 #include "bsp.h"
 #include "util_vector.h"
 #include "poly_part.h"
+#include "util_taskpool.h"
+#include "bsp_planes.h"
 
 int WhichSide(const Plane& plane, const vector4& point) {
     auto normal = cross(plane[2] - plane[0], plane[1] - plane[0]);
@@ -17,6 +21,18 @@ int WhichSide(const Plane& plane, const vector4& point) {
     }
 }
 
+int WhichSide(const float aflPlane[4], const vector4& point) {
+    auto D = aflPlane[0] * point[0] + aflPlane[1] * point[1] + aflPlane[2] * point[2] + aflPlane[3];
+
+    if (D > 0) {
+        return SIDE_FRONT;
+    } else if (D < 0) {
+        return SIDE_BACK;
+    } else {
+        return SIDE_ON;
+    }
+}
+
 bool PlaneLineIntersection(vector4* res, const Line& line, const Plane& plane) {
     bool ret = false;
 
@@ -217,71 +233,706 @@ PolygonContainer FanTriangulate(const Polygon& poly) {
     return ret;
 }
 
-static bsp_node* BuildBSPTree(bsp_node* pNode) {
+#define CLASSIFY_EPSILON (0.001f)
+
+void PlaneEquation(vector4* pN, float* pD, const Plane& plane) {
+    auto N = normalize(normal(plane));
+    *pN = N;
+    *pD = -dot(N, plane[0]);
+}
+
+static int SideFromMask(unsigned uMask) {
+    switch (uMask) {
+    case POLYSIDE_FRONT: return SIDE_FRONT;
+    case POLYSIDE_BACK: return SIDE_BACK;
+    case POLYSIDE_SPANNING: return SIDE_SPANNING;
+    default: return SIDE_ON;
+    }
+}
+
+// Classifies the polygons [iBegin, iEnd) of a container against the plane
+// hPlane whose equation is eq and returns their POLYSIDE_* masks, which
+// are valid until the next call on the same thread. Polygons lying on the
+// same plane aren't tested.
+static const unsigned char* ClassifyPolygons(const PolygonContainer& pc, int iBegin, int iEnd, HPLANE hPlane, const vector4& eq) {
+    static thread_local std::vector<unsigned char> aMasks;
+
+    if ((int)aMasks.size() < iEnd - iBegin) {
+        aMasks.resize(iEnd - iBegin);
+    }
+    ClassifyPolygons(aMasks.data(), pc.VertexData(), pc.Windings() + iBegin, iEnd - iBegin, eq, CLASSIFY_EPSILON);
+
+    for (int iPoly = iBegin; iPoly < iEnd; iPoly++) {
+        if (PLANE_INDEX(pc.PlaneHandle(iPoly)) == PLANE_INDEX(hPlane)) {
+            aMasks[iPoly - iBegin] = 0;
+        }
+    }
+
+    return aMasks.data();
+}
+
+// Classifies a winding against a normalized plane equation
+static int ClassifyWinding(const vector4* pVertices, int nVertices, const vector4& eq) {
+    PolygonContainer::winding w = { 0, nVertices, PLANE_NONE };
+    unsigned char uMask;
+    ClassifyPolygons(&uMask, pVertices, &w, 1, eq, CLASSIFY_EPSILON);
+    return SideFromMask(uMask);
+}
+
+int ClassifyPolygon(const Polygon& poly, const Plane& plane) {
+    vector4 aVertices[POLYGON_MAX_POINTS];
+    vector4 N;
+    float D;
+    PlaneEquation(&N, &D, plane);
+    N[3] = D;
+    for (int iVtx = 0; iVtx < poly.Count(); iVtx++) {
+        aVertices[iVtx] = poly[iVtx];
+    }
+    return ClassifyWinding(aVertices, poly.Count(), N);
+}
+
+// Mixes a seed with a salt; used to derive the seed of a child node from
+// its parent's so that the choice of splitters doesn't depend on the order
+// in which the nodes are built
+static unsigned HashSeed(unsigned uSeed, unsigned uSalt) {
+    unsigned h = uSeed ^ (uSalt * 0x9E3779B9u);
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static unsigned NextRandom(unsigned* pState) {
+    // xorshift32
+    unsigned x = *pState;
+    if (x == 0) {
+        x = 0x6D2B79F5u;
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *pState = x;
+    return x;
+}
+
+void DefaultBSPBuildParams(bsp_build_params* pParams) {
+    assert(pParams);
+
+    pParams->flSplitWeight = 8.0f;
+    pParams->flBalanceWeight = 1.0f;
+    pParams->flCoplanarWeight = 0.5f;
+    pParams->nMaxCandidates = 32;
+    pParams->uSeed = 0;
+    pParams->pfnSelectSplitter = SelectSplitterCost;
+    pParams->nThreads = 1;
+    pParams->nParallelGrain = 256;
+    pParams->bLeafTree = false;
+    pParams->nMaxDepth = 0;
+}
+
+int SelectSplitterFirst(const PolygonContainer&, const CPlaneTable*, const bsp_build_params*, unsigned) {
+    return 0;
+}
+
+int SelectSplitterCost(const PolygonContainer& pc, const CPlaneTable* pPlanes, const bsp_build_params* pParams, unsigned uSeed) {
+    int ret = 0;
+    int nCandidates = pc.Count();
+    bool bSample = false;
+    float flBestCost = 0;
+    unsigned uRandom = uSeed;
+
+    assert(pParams);
+    assert(pc.Count() > 0);
+
+    if (pParams->nMaxCandidates > 0 && pc.Count() > pParams->nMaxCandidates) {
+        nCandidates = pParams->nMaxCandidates;
+        bSample = true;
+    }
+
+    for (int iCandidate = 0; iCandidate < nCandidates; iCandidate++) {
+        int iPoly = bSample ? (int)(NextRandom(&uRandom) % pc.Count()) : iCandidate;
+        int nFront = 0, nBack = 0, nSplit = 0, nCoplanar = 0;
+        float flCost;
+        auto hPlane = pc.PlaneHandle(iPoly);
+        auto eq = pPlanes->Equation(hPlane);
+        auto pMasks = ClassifyPolygons(pc, 0, pc.Count(), hPlane, eq);
+
+        for (int iOther = 0; iOther < pc.Count(); iOther++) {
+            if (iOther != iPoly) {
+                switch (pMasks[iOther]) {
+                case POLYSIDE_FRONT: nFront++; break;
+                case POLYSIDE_BACK: nBack++; break;
+                case POLYSIDE_SPANNING: nSplit++; nFront++; nBack++; break;
+                default: nCoplanar++; break;
+                }
+            }
+        }
+
+        flCost =
+            pParams->flSplitWeight * nSplit +
+            pParams->flBalanceWeight * abs(nFront - nBack) -
+            pParams->flCoplanarWeight * nCoplanar;
+
+        if (iCandidate == 0 || flCost < flBestCost) {
+            flBestCost = flCost;
+            ret = iPoly;
+        }
+    }
+
+    return ret;
+}
+
+struct bsp_build_context {
+    const bsp_build_params* pParams;
+    bsp_tree* pTree;
+    CTaskPool* pPool;
+    std::atomic<int> nSplits;
+    std::atomic<int> nNodes;
+    std::atomic<int> nEmptyLeaves;
+    std::atomic<int> nSolidLeaves;
+    std::atomic<int> nOutputPolygons;
+    std::atomic<int> nDroppedPolygons;
+    std::atomic<int> nMaxDepth;
+    std::atomic<long long> nDepthSum;
+    std::atomic<int> anBalance[BSP_BALANCE_BUCKETS];
+    std::atomic<int> anCoplanar[BSP_COPLANAR_BUCKETS];
+    std::atomic<int> nMaxCoplanar;
+};
+
+// Raises an atomic maximum to n
+static void AtomicMax(std::atomic<int>* pMax, int n) {
+    int nMax = pMax->load();
+    while (n > nMax && !pMax->compare_exchange_weak(nMax, n));
+}
+
+// Adds a node to the balance and coplanar histograms
+static void CountNodeShape(bsp_build_context* pCtx, int nFront, int nBack, int nCoplanar) {
+    int nBelow = nFront + nBack;
+    if (nBelow > 0) {
+        int nSmaller = nFront < nBack ? nFront : nBack;
+        int iBucket = nSmaller * 2 * BSP_BALANCE_BUCKETS / nBelow;
+        pCtx->anBalance[iBucket < BSP_BALANCE_BUCKETS ? iBucket : BSP_BALANCE_BUCKETS - 1]++;
+    }
+
+    int iBucket = 0;
+    while ((1 << iBucket) < nCoplanar && iBucket < BSP_COPLANAR_BUCKETS - 1) {
+        iBucket++;
+    }
+    pCtx->anCoplanar[iBucket]++;
+    AtomicMax(&pCtx->nMaxCoplanar, nCoplanar);
+}
+
+static int CurrentThread(const bsp_build_context* pCtx) {
+    return pCtx->pPool ? pCtx->pPool->CurrentThread() : 0;
+}
+
+// Sorts the polygons in [iBegin, iEnd) into the front, back and coplanar
+// lists, in input order
+static int PartitionPolygons(
+    PolygonContainer* pcFront, PolygonContainer* pcBack, PolygonContainer* pcOn,
+    const PolygonContainer& pc, int iBegin, int iEnd, int iSplitter,
+    HPLANE hPlane, const vector4& eq) {
+    int nSplits = 0;
+    auto pMasks = ClassifyPolygons(pc, iBegin, iEnd, hPlane, eq);
+
+    for (int iPoly = iBegin; iPoly < iEnd; iPoly++) {
+        if (iPoly == iSplitter) {
+            continue;
+        }
+        switch (pMasks[iPoly - iBegin]) {
+        case POLYSIDE_SPANNING:
+            // Only these need clipping
+            // The pieces stay on the plane of the original
+            if (SplitWinding(pcFront, pcBack, pc.Vertices(iPoly), pc.VertexCount(iPoly), pc.PlaneHandle(iPoly), eq.v)) {
+                nSplits++;
+            } else {
+                // Barely crosses the plane; SplitPolygon2 didn't cut it
+                pcFront->Append(pc, iPoly);
+            }
+            break;
+        case POLYSIDE_FRONT:
+            pcFront->Append(pc, iPoly);
+            break;
+        case POLYSIDE_BACK:
+            pcBack->Append(pc, iPoly);
+            break;
+        default:
+            pcOn->Append(pc, iPoly);
+            break;
+        }
+    }
+
+    return nSplits;
+}
+
+// Data-parallel version of PartitionPolygons for large nodes. Every chunk
+// is partitioned into its own lists which are then concatenated in chunk
+// order, so the result is the same as the serial partition's.
+static int PartitionPolygonsParallel(
+    bsp_build_context* pCtx,
+    PolygonContainer* pcFront, PolygonContainer* pcBack, PolygonContainer* pcOn,
+    const PolygonContainer& pc, int iSplitter,
+    HPLANE hPlane, const vector4& eq) {
+    struct chunk {
+        PolygonContainer *pcFront, *pcBack, *pcOn;
+        int nSplits;
+    };
+    CTaskPool::task_group group;
+    int nSplits = 0;
+    int nChunkSize = pCtx->pParams->nParallelGrain;
+    int nChunks = (pc.Count() + nChunkSize - 1) / nChunkSize;
+    int iThread = CurrentThread(pCtx);
+    auto pTree = pCtx->pTree;
+    std::vector<chunk> aChunks(nChunks);
+
+    for (int iChunk = 0; iChunk < nChunks; iChunk++) {
+        auto pChunk = &aChunks[iChunk];
+        int iBegin = iChunk * nChunkSize;
+        int iEnd = (iBegin + nChunkSize < pc.Count()) ? iBegin + nChunkSize : pc.Count();
+        pChunk->pcFront = pTree->AcquireScratch(iThread);
+        pChunk->pcBack = pTree->AcquireScratch(iThread);
+        pChunk->pcOn = pTree->AcquireScratch(iThread);
+        pCtx->pPool->Run(&group, [=, &pc, &eq]() {
+            pChunk->nSplits = PartitionPolygons(
+                pChunk->pcFront, pChunk->pcBack, pChunk->pcOn,
+                pc, iBegin, iEnd, iSplitter, hPlane, eq);
+        });
+    }
+    pCtx->pPool->Wait(&group);
+
+    for (auto& chunk : aChunks) {
+        pcFront->Append(*chunk.pcFront);
+        pcBack->Append(*chunk.pcBack);
+        pcOn->Append(*chunk.pcOn);
+        nSplits += chunk.nSplits;
+        pTree->ReleaseScratch(iThread, chunk.pcFront);
+        pTree->ReleaseScratch(iThread, chunk.pcBack);
+        pTree->ReleaseScratch(iThread, chunk.pcOn);
+    }
+
+    return nSplits;
+}
+
+// A subtree waiting to be built; pc is a scratch list that goes back to
+// the pool once the node is made
+struct build_item {
+    PolygonContainer* pc;
+    // Where the root of the subtree goes
+    bsp_node** ppOut;
+    int iDepth;
+    unsigned uSeed;
+    int contents;
+};
+
+// Makes the node of one subtree and returns the lists of its children in
+// *ppcFront and *ppcBack, or NULL if the node has no children to build.
+// If the polygons are empty or beyond the depth limit, the result is NULL,
+// or in leaf trees a leaf with the contents of the item.
+static bsp_node* BuildNode(bsp_build_context* pCtx, const build_item& item, PolygonContainer** ppcFront, PolygonContainer** ppcBack) {
     bsp_node* pRet = NULL;
+    auto pParams = pCtx->pParams;
+    auto& pc = *item.pc;
+
+    *ppcFront = NULL;
+    *ppcBack = NULL;
+
+    if (pc.Count() > 0 && pParams->nMaxDepth > 0 && item.iDepth > pParams->nMaxDepth) {
+        pCtx->nDroppedPolygons += pc.Count();
+    } else if (pc.Count() > 0) {
+        PolygonContainer *pcFront, *pcBack, *pcOn;
+        int nSplits;
+        auto pTree = pCtx->pTree;
+        int iThread = CurrentThread(pCtx);
+        auto iSplitter = pParams->pfnSelectSplitter(pc, &pTree->planes, pParams, item.uSeed);
+        auto hPlane = pc.PlaneHandle(iSplitter);
+        auto eq = pTree->planes.Equation(hPlane);
+        pRet = pTree->NodeArena(iThread)->New<bsp_node>();
+        pRet->hPlane = hPlane;
+
+        pcFront = pTree->AcquireScratch(iThread);
+        pcBack = pTree->AcquireScratch(iThread);
+        pcOn = pTree->AcquireScratch(iThread);
+        pcOn->Append(pc, iSplitter);
+
+        if (pCtx->pPool && pc.Count() >= 2 * pParams->nParallelGrain) {
+            nSplits = PartitionPolygonsParallel(pCtx, pcFront, pcBack, pcOn, pc, iSplitter, hPlane, eq);
+        } else {
+            nSplits = PartitionPolygons(pcFront, pcBack, pcOn, pc, 0, pc.Count(), iSplitter, hPlane, eq);
+        }
 
-    if (pNode) {
-        bsp_node* tmp = new bsp_node;
-        PolygonContainer*pcFront, *pcBack;
-        auto& polyRoot = pNode->list[0];
-        auto planeRoot = PlaneFromPolygon(polyRoot);
-        pRet = new bsp_node;
-        pRet->list += polyRoot;
-
-
-        pcFront = new PolygonContainer;
-        pcBack = new PolygonContainer;
-
-        for (int iPoly = 1; iPoly < pNode->list.Count(); iPoly++) {
-            Polygon *polyFront, *polyBack;
-            polyFront = new Polygon;
-            polyBack = new Polygon;
-            auto& splitted = pNode->list[iPoly];
-            if (SplitPolygon2(polyFront, polyBack, splitted, planeRoot)) {
-                (*pcFront) += *polyFront;
-                (*pcBack) += *polyBack;
+        pRet->iFirstPolygon = pTree->AddPolygons(*pcOn);
+        pRet->nPolygons = pcOn->Count();
+        pTree->ReleaseScratch(iThread, pcOn);
+
+        pCtx->nSplits += nSplits;
+        pCtx->nNodes++;
+        pCtx->nOutputPolygons += pRet->nPolygons;
+        pCtx->nDepthSum += item.iDepth;
+        AtomicMax(&pCtx->nMaxDepth, item.iDepth);
+        CountNodeShape(pCtx, pcFront->Count(), pcBack->Count(), pRet->nPolygons);
+
+        *ppcFront = pcFront;
+        *ppcBack = pcBack;
+    }
+
+    if (!pRet && pParams->bLeafTree) {
+        pRet = pCtx->pTree->NodeArena(CurrentThread(pCtx))->New<bsp_node>();
+        pRet->contents = item.contents;
+        if (item.contents == BSP_CONTENTS_SOLID) {
+            pCtx->nSolidLeaves++;
+        } else {
+            pCtx->nEmptyLeaves++;
+        }
+    }
+
+    return pRet;
+}
+
+// Builds the subtree of an item depth-first, front first, from an explicit
+// stack so that deep trees can't overflow the call stack. Front subtrees
+// that are large enough are handed to the pool.
+static void BuildSubtrees(bsp_build_context* pCtx, const build_item& root) {
+    // Shared by every build on the thread; a build that runs while this one
+    // waits for the pool only uses the part above iBase
+    static thread_local std::vector<build_item> aStack;
+    CTaskPool::task_group group;
+    size_t iBase = aStack.size();
+    auto pParams = pCtx->pParams;
+
+    aStack.push_back(root);
+    while (aStack.size() > iBase) {
+        PolygonContainer *pcFront, *pcBack;
+        auto item = aStack.back();
+        aStack.pop_back();
+
+        auto pNode = BuildNode(pCtx, item, &pcFront, &pcBack);
+        *item.ppOut = pNode;
+        pCtx->pTree->ReleaseScratch(CurrentThread(pCtx), item.pc);
+
+        if (pcFront) {
+            build_item front = { pcFront, &pNode->front, item.iDepth + 1, HashSeed(item.uSeed, 1), BSP_CONTENTS_EMPTY };
+            build_item back = { pcBack, &pNode->back, item.iDepth + 1, HashSeed(item.uSeed, 2), BSP_CONTENTS_SOLID };
+            aStack.push_back(back);
+            if (pCtx->pPool && pcFront->Count() >= pParams->nParallelGrain && pcBack->Count() > 0) {
+                // Hand the front subtree to the pool and build the back one here
+                pCtx->pPool->Run(&group, [=]() {
+                    BuildSubtrees(pCtx, front);
+                });
             } else {
-                auto side = WhichSide(planeRoot, pNode->list[iPoly][0]);
-                switch (side) {
-                case SIDE_FRONT:
-                    (*pcFront) += pNode->list[iPoly];
-                    break;
-                case SIDE_BACK:
-                    (*pcBack) += pNode->list[iPoly];
-                    break;
-                case SIDE_ON:
-                    pRet->list += pNode->list[iPoly];
-                    break;
+                aStack.push_back(front);
+            }
+        }
+    }
+
+    if (pCtx->pPool) {
+        pCtx->pPool->Wait(&group);
+    }
+}
+
+// Numbers the leaves depth-first, front first
+static void NumberLeaves(bsp_tree* pTree) {
+    std::vector<bsp_node*> aStack;
+
+    aStack.push_back(pTree->root);
+    while (aStack.size() > 0) {
+        auto pNode = aStack.back();
+        aStack.pop_back();
+        if (pNode && pNode->IsLeaf()) {
+            pNode->iLeaf = (int)pTree->leaves.size();
+            pTree->leaves.push_back(pNode);
+        } else if (pNode) {
+            aStack.push_back(pNode->back);
+            aStack.push_back(pNode->front);
+        }
+    }
+}
+
+struct leaf_face {
+    int iLeaf;
+    int iPolygon;
+};
+
+// Piece of a face on its way down the tree; the winding is the iPiece-th
+// polygon of the piece list
+struct face_piece {
+    const bsp_node* pNode;
+    int iPiece;
+};
+
+// Filters polygon iPoly down the subtree of pNode and records the empty
+// leaves its pieces end up in, front pieces first. eqFace is the plane of
+// the polygon.
+static void FilterFace(
+    std::vector<leaf_face>* pFaces, std::vector<face_piece>* pStack, PolygonContainer* pPieces,
+    const bsp_tree* pTree, const bsp_node* pNode, int iPoly, const vector4& eqFace) {
+    pPieces->Clear();
+    pPieces->Append(pTree->polygons, iPoly);
+    pStack->push_back({ pNode, 0 });
+    while (pStack->size() > 0) {
+        auto piece = pStack->back();
+        pStack->pop_back();
+        pNode = piece.pNode;
+
+        if (pNode->IsLeaf()) {
+            if (pNode->contents == BSP_CONTENTS_EMPTY) {
+                pFaces->push_back({ pNode->iLeaf, iPoly });
+            }
+        } else {
+            auto eq = pTree->planes.Equation(pNode->hPlane);
+            int nVertices = pPieces->VertexCount(piece.iPiece);
+            switch (ClassifyWinding(pPieces->Vertices(piece.iPiece), nVertices, eq)) {
+            case SIDE_FRONT:
+                pStack->push_back({ pNode->front, piece.iPiece });
+                break;
+            case SIDE_BACK:
+                pStack->push_back({ pNode->back, piece.iPiece });
+                break;
+            case SIDE_SPANNING:
+                if (SplitWinding(pPieces, pPieces, pPieces->Vertices(piece.iPiece), nVertices, PLANE_NONE, eq.v)) {
+                    int iFront = pPieces->Count() - 2;
+                    pStack->push_back({ pNode->back, iFront + 1 });
+                    pStack->push_back({ pNode->front, iFront });
+                } else {
+                    pStack->push_back({ pNode->front, piece.iPiece });
                 }
+                break;
+            default:
+                // Goes to the side the polygon faces
+                if (eq[0] * eqFace[0] + eq[1] * eqFace[1] + eq[2] * eqFace[2] > 0) {
+                    pStack->push_back({ pNode->front, piece.iPiece });
+                } else {
+                    pStack->push_back({ pNode->back, piece.iPiece });
+                }
+                break;
+            }
+        }
+    }
+}
 
+// Filters the polygons of every node, in depth-first order, front first
+static void CollectLeafFaces(std::vector<leaf_face>* pFaces, const bsp_tree* pTree) {
+    std::vector<const bsp_node*> aStack;
+    std::vector<face_piece> aPieces;
+    PolygonContainer pcPieces;
+
+    aStack.push_back(pTree->root);
+    while (aStack.size() > 0) {
+        auto pNode = aStack.back();
+        aStack.pop_back();
+        if (pNode && !pNode->IsLeaf()) {
+            for (int i = 0; i < pNode->nPolygons; i++) {
+                int iPoly = pNode->iFirstPolygon + i;
+                auto hFace = pTree->polygons.PlaneHandle(iPoly);
+                auto eqFace = pTree->planes.Equation(hFace);
+                // The polygon is seen from the side of the node's plane that it
+                // faces
+                auto pChild = (PLANE_FLIPPED(hFace) == PLANE_FLIPPED(pNode->hPlane)) ? pNode->front : pNode->back;
+                FilterFace(pFaces, &aPieces, &pcPieces, pTree, pChild, iPoly, eqFace);
             }
-            delete polyFront; delete polyBack;
+            aStack.push_back(pNode->back);
+            aStack.push_back(pNode->front);
         }
+    }
+}
 
-        if (pcFront->Count() > 0) {
-            tmp->list = *pcFront;
-            pRet->front = BuildBSPTree(tmp);
+// Numbers the leaves and fills the face lists of the empty ones
+static void FinishLeaves(bsp_tree* pTree) {
+    std::vector<leaf_face> aFaces;
+
+    NumberLeaves(pTree);
+    CollectLeafFaces(&aFaces, pTree);
+    std::stable_sort(aFaces.begin(), aFaces.end(), [](const leaf_face& lhs, const leaf_face& rhs) {
+        return lhs.iLeaf < rhs.iLeaf;
+    });
+
+    pTree->leafFaces.resize(aFaces.size());
+    for (size_t i = 0; i < aFaces.size(); i++) {
+        auto pLeaf = pTree->leaves[aFaces[i].iLeaf];
+        if (pLeaf->nLeafFaces == 0) {
+            pLeaf->iFirstLeafFace = (int)i;
         }
-        if (pcBack->Count() > 0) {
-            tmp->list = *pcBack;
-            pRet->back = BuildBSPTree(tmp);
+        pLeaf->nLeafFaces++;
+        pTree->leafFaces[i] = aFaces[i].iPolygon;
+    }
+}
+
+bool BuildBSPTree(bsp_tree* pTree, const PolygonContainer& pc, const bsp_build_params* pParams, bsp_build_stats* pStats) {
+    bsp_build_params params;
+    bsp_build_stats stats = {};
+    bsp_build_context ctx;
+    CTaskPool* pPool = NULL;
+
+    if (pParams) {
+        params = *pParams;
+    } else {
+        DefaultBSPBuildParams(&params);
+    }
+    if (!params.pfnSelectSplitter) {
+        params.pfnSelectSplitter = SelectSplitterCost;
+    }
+    if (params.nParallelGrain < 1) {
+        params.nParallelGrain = 1;
+    }
+
+    if (params.nThreads != 1) {
+        pPool = new CTaskPool(params.nThreads);
+        if (pPool->ThreadCount() == 1) {
+            delete pPool;
+            pPool = NULL;
         }
-        delete tmp;
-        delete pcFront; delete pcBack;
     }
 
-    return pRet;
+    assert(pTree);
+    pTree->Clear();
+    pTree->ReserveThreads(pPool ? pPool->ThreadCount() : 1);
+
+    ctx.pParams = &params;
+    ctx.pTree = pTree;
+    ctx.pPool = pPool;
+    ctx.nSplits = 0;
+    ctx.nNodes = 0;
+    ctx.nEmptyLeaves = 0;
+    ctx.nSolidLeaves = 0;
+    ctx.nOutputPolygons = 0;
+    ctx.nDroppedPolygons = 0;
+    ctx.nMaxDepth = 0;
+    ctx.nDepthSum = 0;
+    for (auto& n : ctx.anBalance) {
+        n = 0;
+    }
+    for (auto& n : ctx.anCoplanar) {
+        n = 0;
+    }
+    ctx.nMaxCoplanar = 0;
+
+    auto t0 = std::chrono::high_resolution_clock::now();
+
+    // Look up the plane of every polygon up front, so the planes are
+    // numbered in input order whatever the number of threads is
+    auto pcInput = pTree->AcquireScratch(0);
+    for (int iPoly = 0; iPoly < pc.Count(); iPoly++) {
+        pcInput->Append(pc, iPoly);
+        pcInput->SetPlaneHandle(iPoly, pTree->planes.FindOrAdd(pc.GetPlane(iPoly)));
+    }
+
+    build_item root = { pcInput, &pTree->root, 1, HashSeed(params.uSeed, 0), BSP_CONTENTS_EMPTY };
+    auto t1 = std::chrono::high_resolution_clock::now();
+    BuildSubtrees(&ctx, root);
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    delete pPool;
+
+    if (params.bLeafTree) {
+        FinishLeaves(pTree);
+    }
+    auto t3 = std::chrono::high_resolution_clock::now();
+
+    stats.nInputPolygons = pc.Count();
+    stats.nOutputPolygons = ctx.nOutputPolygons;
+    stats.nSplits = ctx.nSplits;
+    stats.nDroppedPolygons = ctx.nDroppedPolygons;
+    stats.nNodes = ctx.nNodes;
+    stats.nEmptyLeaves = ctx.nEmptyLeaves;
+    stats.nSolidLeaves = ctx.nSolidLeaves;
+    stats.nLeafFaces = (int)pTree->leafFaces.size();
+    stats.nMaxDepth = ctx.nMaxDepth;
+    stats.nNodeBytes = pTree->BytesUsed();
+    if (stats.nNodes > 0) {
+        stats.flAvgDepth = (float)(ctx.nDepthSum / (double)stats.nNodes);
+    }
+    for (int i = 0; i < BSP_BALANCE_BUCKETS; i++) {
+        stats.anBalance[i] = ctx.anBalance[i];
+    }
+    for (int i = 0; i < BSP_COPLANAR_BUCKETS; i++) {
+        stats.anCoplanar[i] = ctx.anCoplanar[i];
+    }
+    stats.nMaxCoplanar = ctx.nMaxCoplanar;
+    stats.flPlanesMs = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    stats.flNodesMs = std::chrono::duration<double, std::milli>(t2 - t1).count();
+    stats.flLeavesMs = std::chrono::duration<double, std::milli>(t3 - t2).count();
+
+    if (pStats) {
+        *pStats = stats;
+    }
+
+    return stats.nDroppedPolygons == 0;
 }
 
-bsp_node* BuildBSPTree(const PolygonContainer& pc) {
-    bsp_node* ret = NULL;
+void PrintBSPBuildReport(FILE* hFile, const bsp_build_params* pParams, const bsp_build_stats* pStats) {
+    assert(hFile);
 
-    bsp_node* pRoot = new bsp_node;
-    pRoot->list = pc;
+    if (pParams) {
+        fprintf(hFile, "BSP splitter: %s, weights split=%.2f balance=%.2f coplanar=%.2f, candidates=%d, seed=%u\n",
+            pParams->pfnSelectSplitter == SelectSplitterFirst ? "first" : "cost",
+            pParams->flSplitWeight, pParams->flBalanceWeight, pParams->flCoplanarWeight,
+            pParams->nMaxCandidates, pParams->uSeed);
+        fprintf(hFile, "BSP build: %d thread(s), parallel grain %d, max depth %d\n",
+            pParams->nThreads, pParams->nParallelGrain, pParams->nMaxDepth);
+    }
+    if (pStats) {
+        fprintf(hFile, "BSP tree: %d nodes, %d -> %d polygons (%d splits), depth max %d avg %.2f, %zu bytes\n",
+            pStats->nNodes, pStats->nInputPolygons, pStats->nOutputPolygons, pStats->nSplits,
+            pStats->nMaxDepth, pStats->flAvgDepth, pStats->nNodeBytes);
+        if (pStats->nDroppedPolygons > 0) {
+            fprintf(hFile, "BSP depth limit reached: %d polygons left out, the tree is incomplete\n", pStats->nDroppedPolygons);
+        }
+        if (pStats->nEmptyLeaves + pStats->nSolidLeaves > 0) {
+            fprintf(hFile, "BSP leaves: %d empty, %d solid, %d leaf faces\n",
+                pStats->nEmptyLeaves, pStats->nSolidLeaves, pStats->nLeafFaces);
+        }
+    }
+}
+
+void PrintBSPStats(FILE* hFile, const bsp_build_stats* pStats) {
+    int nLow;
 
-    ret = BuildBSPTree(pRoot);
+    assert(hFile && pStats);
 
-    delete pRoot;
+    fprintf(hFile, "BSP stats: %d nodes, depth max %d avg %.2f, %d -> %d polygons (%.2fx), %zu bytes\n",
+        pStats->nNodes, pStats->nMaxDepth, pStats->flAvgDepth, pStats->nInputPolygons, pStats->nOutputPolygons,
+        pStats->nInputPolygons > 0 ? pStats->nOutputPolygons / (double)pStats->nInputPolygons : 0.0,
+        pStats->nNodeBytes);
+
+    fprintf(hFile, "BSP balance, share of the smaller side:");
+    for (int i = 0; i < BSP_BALANCE_BUCKETS; i++) {
+        fprintf(hFile, " %d-%d%%: %d", i * 50 / BSP_BALANCE_BUCKETS, (i + 1) * 50 / BSP_BALANCE_BUCKETS, pStats->anBalance[i]);
+    }
+    fprintf(hFile, "\n");
+
+    fprintf(hFile, "BSP coplanar polygons per node:");
+    for (int i = 0; i < BSP_COPLANAR_BUCKETS; i++) {
+        nLow = (i > 0) ? (1 << (i - 1)) + 1 : 1;
+        if (i == BSP_COPLANAR_BUCKETS - 1) {
+            fprintf(hFile, " >%d: %d", nLow - 1, pStats->anCoplanar[i]);
+        } else if (nLow == (1 << i)) {
+            fprintf(hFile, " %d: %d", nLow, pStats->anCoplanar[i]);
+        } else {
+            fprintf(hFile, " %d-%d: %d", nLow, 1 << i, pStats->anCoplanar[i]);
+        }
+    }
+    fprintf(hFile, ", max %d\n", pStats->nMaxCoplanar);
+
+    fprintf(hFile, "BSP build time: planes %.2f ms, nodes %.2f ms, leaves %.2f ms\n",
+        pStats->flPlanesMs, pStats->flNodesMs, pStats->flLeavesMs);
+}
+
+const bsp_node* BSPPointInLeaf(const bsp_tree* pTree, const vector4& vPoint) {
+    const bsp_node* ret;
+
+    assert(pTree);
+
+    ret = pTree->root;
+    while (ret && !ret->IsLeaf()) {
+        auto eq = pTree->planes.Equation(ret->hPlane);
+        ret = (PlaneDistance(eq, vPoint) >= 0) ? ret->front : ret->back;
+    }
 
     return ret;
-}
\ No newline at end of file
+}
+
+int BSPPointContents(const bsp_tree* pTree, const vector4& vPoint) {
+    auto pLeaf = BSPPointInLeaf(pTree, vPoint);
+    return pLeaf ? pLeaf->contents : BSP_CONTENTS_EMPTY;
+}
@@ -2,26 +2,253 @@
 
 #include "util_vector.h"
 #include "util_geostruct.h"
+#include "util_arena.h"
+#include "bsp_planes.h"
+#include <stdio.h>
+#include <vector>
+#include <mutex>
 
+// Contents of the space in a leaf of a tree built with leaves
+#define BSP_CONTENTS_NODE (0)
+#define BSP_CONTENTS_EMPTY (-1)
+#define BSP_CONTENTS_SOLID (-2)
+
+// The polygons of a node are the range [iFirstPolygon, iFirstPolygon +
+// nPolygons) of the polygon store of the tree owning it; the first one is
+// the splitter, the rest are coplanar with it.
+// Leaves have no plane, polygons or children. Their faces are the range
+// [iFirstLeafFace, iFirstLeafFace + nLeafFaces) of bsp_tree::leafFaces.
 struct bsp_node {
 public:
-    PolygonContainer list;
+    HPLANE hPlane;
+    int iFirstPolygon;
+    int nPolygons;
     bsp_node* front;
     bsp_node* back;
+    // BSP_CONTENTS_NODE for nodes
+    int contents;
+    // Index of a leaf in bsp_tree::leaves
+    int iLeaf;
+    int iFirstLeafFace;
+    int nLeafFaces;
 
     bsp_node() :
-        front(NULL), back(NULL) {
+        hPlane(PLANE_NONE), iFirstPolygon(0), nPolygons(0), front(NULL), back(NULL),
+        contents(BSP_CONTENTS_NODE), iLeaf(-1), iFirstLeafFace(0), nLeafFaces(0) {
+    }
+
+    bool IsLeaf() const {
+        return contents != BSP_CONTENTS_NODE;
+    }
+};
+
+// Owns every node of a tree and the polygons they refer to. Nodes are
+// allocated from per-thread arenas and are freed all at once; the scratch
+// pools hold the polygon lists of the build and are kept between builds,
+// so rebuilding a tree of similar size doesn't allocate.
+struct bsp_tree {
+public:
+    bsp_node* root;
+    PolygonContainer polygons;
+    CPlaneTable planes;
+    // Leaves in depth-first order, front first; empty unless the tree was
+    // built with leaves
+    std::vector<bsp_node*> leaves;
+    // Indices into polygons of the faces seen from inside every leaf
+    std::vector<int> leafFaces;
+
+    bsp_tree() : root(NULL) {
+    }
+
+    ~bsp_tree() {
+        for (auto pArena : m_aNodeArenas) {
+            delete pArena;
+        }
+        for (auto& pool : m_aScratchPools) {
+            for (auto pc : pool) {
+                delete pc;
+            }
+        }
+    }
+
+    bsp_tree(const bsp_tree&) = delete;
+    bsp_tree& operator=(const bsp_tree&) = delete;
+
+    // Frees every node and polygon but keeps the memory for the next build
+    void Clear() {
+        for (auto pArena : m_aNodeArenas) {
+            pArena->Reset();
+        }
+        polygons.Clear();
+        planes.Clear();
+        leaves.clear();
+        leafFaces.clear();
+        root = NULL;
+    }
+
+    // Makes sure that there is a node arena and a scratch pool for every
+    // thread
+    void ReserveThreads(int nThreads) {
+        while ((int)m_aNodeArenas.size() < nThreads) {
+            m_aNodeArenas.push_back(new CArena);
+        }
+        if ((int)m_aScratchPools.size() < nThreads) {
+            m_aScratchPools.resize(nThreads);
+        }
+    }
+
+    CArena* NodeArena(int iThread) {
+        return m_aNodeArenas[iThread];
     }
+
+    // Returns an empty polygon list from the scratch pool of a thread
+    PolygonContainer* AcquireScratch(int iThread) {
+        PolygonContainer* ret;
+        auto& pool = m_aScratchPools[iThread];
+        if (pool.size() > 0) {
+            ret = pool.back();
+            pool.pop_back();
+        } else {
+            ret = new PolygonContainer;
+        }
+        return ret;
+    }
+
+    void ReleaseScratch(int iThread, PolygonContainer* pc) {
+        pc->Clear();
+        m_aScratchPools[iThread].push_back(pc);
+    }
+
+    // Appends a list of polygons to the store; may be called by multiple
+    // threads at once
+    int AddPolygons(const PolygonContainer& pc) {
+        std::lock_guard<std::mutex> l(m_lockPolygons);
+        int ret = polygons.Count();
+        polygons.Append(pc);
+        return ret;
+    }
+
+    size_t BytesUsed() const {
+        size_t ret = polygons.BytesUsed() + planes.BytesUsed() +
+            leaves.capacity() * sizeof(bsp_node*) + leafFaces.capacity() * sizeof(int);
+        for (auto pArena : m_aNodeArenas) {
+            ret += pArena->BytesUsed();
+        }
+        return ret;
+    }
+
+private:
+    std::vector<CArena*> m_aNodeArenas;
+    std::vector<std::vector<PolygonContainer*>> m_aScratchPools;
+    std::mutex m_lockPolygons;
 };
 
 #define SIDE_FRONT (1)
 #define SIDE_ON (0)
 #define SIDE_BACK (-1)
+#define SIDE_SPANNING (2)
+
+struct bsp_build_params;
+
+// Returns the index of the polygon in pc whose plane should split the node
+typedef int (*PFNSELECTSPLITTER)(const PolygonContainer& pc, const CPlaneTable* pPlanes, const bsp_build_params* pParams, unsigned uSeed);
+
+struct bsp_build_params {
+    // Cost of every polygon that the candidate plane would split
+    float flSplitWeight;
+    // Cost of the difference between the front and back polygon counts
+    float flBalanceWeight;
+    // Reward for every polygon that is coplanar with the candidate
+    float flCoplanarWeight;
+    // Nodes with more polygons than this are scored on a random sample
+    // of candidates; 0 means that every polygon is a candidate
+    int nMaxCandidates;
+    unsigned uSeed;
+    PFNSELECTSPLITTER pfnSelectSplitter;
+    // Number of threads building the tree; 1 builds serially, 0 uses
+    // every hardware thread. The tree doesn't depend on this.
+    int nThreads;
+    // Subtrees with fewer polygons than this are built on the current
+    // thread; nodes with at least twice as many are partitioned in chunks
+    // of this size in parallel
+    int nParallelGrain;
+    // Splits space down to convex leaves, like the trees of Quake, instead
+    // of ending the branches at the last polygon. The polygons must bound
+    // closed solids that don't overlap each other, with their front sides
+    // facing out; then space behind a polygon with nothing else behind it
+    // becomes a solid leaf, space in front of one an empty leaf.
+    bool bLeafTree;
+    // Nodes deeper than this aren't made; a build that would need them
+    // fails, counting the polygons it couldn't place. 0 means no limit.
+    int nMaxDepth;
+};
+
+// Buckets of bsp_build_stats::anBalance, each 5% wide
+#define BSP_BALANCE_BUCKETS (10)
+// Buckets of bsp_build_stats::anCoplanar: 1, 2, 3-4, 5-8, ..., more than 64
+#define BSP_COPLANAR_BUCKETS (8)
+
+struct bsp_build_stats {
+    int nInputPolygons;
+    int nOutputPolygons;
+    int nSplits;
+    // Polygons the depth limit left out of a failed build
+    int nDroppedPolygons;
+    int nNodes;
+    int nEmptyLeaves;
+    int nSolidLeaves;
+    int nLeafFaces;
+    int nMaxDepth;
+    float flAvgDepth;
+    size_t nNodeBytes;
+    // Nodes by the share of the polygons below them that went to the
+    // smaller side, from 0-5% to 45-50%; nodes with nothing below them
+    // aren't counted
+    int anBalance[BSP_BALANCE_BUCKETS];
+    // Nodes by the number of polygons on their plane
+    int anCoplanar[BSP_COPLANAR_BUCKETS];
+    int nMaxCoplanar;
+    // Time spent looking up the planes of the input, making the nodes and
+    // filling the leaves
+    double flPlanesMs;
+    double flNodesMs;
+    double flLeavesMs;
+};
 
 int WhichSide(const Plane& plane, const vector4& point);
+// aflPlane is a normalized plane equation (A, B, C, D)
+int WhichSide(const float aflPlane[4], const vector4& point);
+// Normalized equation of a plane; the front side is where dot(N, P) + D > 0
+void PlaneEquation(vector4* pN, float* pD, const Plane& plane);
 bool SplitPolygon2(Polygon* res0, Polygon* res1, const Polygon& splitted, const Plane& splitter);
+// splitter is a normalized plane equation (A, B, C, D)
+bool SplitPolygon2(Polygon* res0, Polygon* res1, const Polygon& splitted, const float splitter[4]);
+// Splits the winding like SplitPolygon2 and adds the pieces, on plane
+// hPlane, to pcFront and pcBack. The winding may have any number of
+// vertices and may be in one of the two containers.
+bool SplitWinding(
+    PolygonContainer* pcFront, PolygonContainer* pcBack,
+    const vector4* pVertices, int nVertices, HPLANE hPlane, const float splitter[4]);
 PolygonContainer FanTriangulate(const Polygon& poly);
-bsp_node* BuildBSPTree(const PolygonContainer& pc);
+int ClassifyPolygon(const Polygon& poly, const Plane& plane);
+
+void DefaultBSPBuildParams(bsp_build_params* pParams);
+int SelectSplitterFirst(const PolygonContainer& pc, const CPlaneTable* pPlanes, const bsp_build_params* pParams, unsigned uSeed);
+int SelectSplitterCost(const PolygonContainer& pc, const CPlaneTable* pPlanes, const bsp_build_params* pParams, unsigned uSeed);
+// Builds the tree of pc into pTree, freeing the tree that was in it.
+// Fails if the depth limit left polygons out, in which case pTree is
+// incomplete and must not be used.
+bool BuildBSPTree(bsp_tree* pTree, const PolygonContainer& pc, const bsp_build_params* pParams, bsp_build_stats* pStats);
+void PrintBSPBuildReport(FILE* hFile, const bsp_build_params* pParams, const bsp_build_stats* pStats);
+// Prints the histograms, split amplification, memory use and build
+// timings of bsp_build_stats
+void PrintBSPStats(FILE* hFile, const bsp_build_stats* pStats);
+// Returns the leaf containing a point, or NULL if the tree has no leaves.
+// Points on a plane belong to its front side.
+const bsp_node* BSPPointInLeaf(const bsp_tree* pTree, const vector4& vPoint);
+// Returns BSP_CONTENTS_EMPTY or BSP_CONTENTS_SOLID; everything is empty in
+// trees without leaves
+int BSPPointContents(const bsp_tree* pTree, const vector4& vPoint);
 bool SplitLine(Line* res0, Line* res1, vector4* xp, const Line& splitted, const Plane& splitter);
 Polygon FromLines(const LineContainer& lc);
 bool PlaneLineIntersection(vector4* res, const Line& line, const Plane& plane);
\ No newline at end of file
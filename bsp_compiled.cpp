@@ -0,0 +1,198 @@
+#include <assert.h>
+#include <float.h>
+#include "bsp_compiled.h"
+
+// Appends the triangle fan of the polygon
+static void TriangulateWinding(std::vector<uint32_t>* pIndices, const PolygonContainer::winding& w) {
+    for (int iVtx = 1; iVtx < w.nVertices - 1; iVtx++) {
+        pIndices->push_back(w.iFirstVertex);
+        pIndices->push_back(w.iFirstVertex + iVtx);
+        pIndices->push_back(w.iFirstVertex + iVtx + 1);
+    }
+}
+
+static void AddPointToBounds(bsp_cnode* pNode, const float* pflPoint) {
+    for (int i = 0; i < 3; i++) {
+        if (pflPoint[i] < pNode->aflMins[i]) pNode->aflMins[i] = pflPoint[i];
+        if (pflPoint[i] > pNode->aflMaxs[i]) pNode->aflMaxs[i] = pflPoint[i];
+    }
+}
+
+// Entry of the compile stack: a subtree to compile into child iChild of
+// node iParent, or once its children are done, node iParent itself
+struct compile_item {
+    const bsp_node* pNode;
+    int32_t iParent;
+    int iChild;
+    bool bFinish;
+};
+
+// Makes the node of pNode without its children and returns its index, or
+// the child index of a leaf or missing node
+static int32_t CompileNode(
+    std::vector<bsp_cnode>* pNodes, PolygonContainer* pPolygons, std::vector<uint32_t>* pIndices, int* piRemap,
+    const bsp_tree* pTree, const bsp_node* pNode) {
+    int32_t ret = BSP_NO_CHILD;
+
+    if (pNode && pNode->IsLeaf()) {
+        ret = BSP_LEAF_CHILD(pNode->iLeaf);
+    } else if (pNode) {
+        bsp_cnode node;
+
+        node.hPlane = pNode->hPlane;
+        node.children[0] = BSP_NO_CHILD;
+        node.children[1] = BSP_NO_CHILD;
+        node.iFirstPolygon = pPolygons->Count();
+        node.nPolygons = pNode->nPolygons;
+        node.iFirstIndex = (uint32_t)pIndices->size();
+        for (int i = 0; i < 3; i++) {
+            node.aflMins[i] = FLT_MAX;
+            node.aflMaxs[i] = -FLT_MAX;
+        }
+        for (int i = 0; i < pNode->nPolygons; i++) {
+            piRemap[pNode->iFirstPolygon + i] = pPolygons->Count();
+            pPolygons->Append(pTree->polygons, pNode->iFirstPolygon + i);
+            auto& w = pPolygons->Windings()[pPolygons->Count() - 1];
+            TriangulateWinding(pIndices, w);
+            for (int iVtx = 0; iVtx < w.nVertices; iVtx++) {
+                AddPointToBounds(&node, pPolygons->VertexData()[w.iFirstVertex + iVtx].v);
+            }
+        }
+        node.nIndices = (uint32_t)pIndices->size() - node.iFirstIndex;
+        node.iFirstLeaf = 0;
+        node.nLeaves = 0;
+
+        ret = (int32_t)pNodes->size();
+        pNodes->push_back(node);
+    }
+
+    return ret;
+}
+
+// Grows the bounds and the leaf range of a node by those of its children
+static void FinishNode(std::vector<bsp_cnode>* pNodes, int32_t iNode) {
+    auto& compiled = (*pNodes)[iNode];
+    for (int iChild = 0; iChild < 2; iChild++) {
+        uint32_t iFirstLeaf = 0, nLeaves = 0;
+        if (compiled.children[iChild] >= 0) {
+            auto& child = (*pNodes)[compiled.children[iChild]];
+            AddPointToBounds(&compiled, child.aflMins);
+            AddPointToBounds(&compiled, child.aflMaxs);
+            iFirstLeaf = child.iFirstLeaf;
+            nLeaves = child.nLeaves;
+        } else if (compiled.children[iChild] != BSP_NO_CHILD) {
+            iFirstLeaf = BSP_CHILD_LEAF(compiled.children[iChild]);
+            nLeaves = 1;
+        }
+        // Leaves are numbered in the same order, so the leaves of the
+        // subtrees follow each other
+        if (compiled.nLeaves == 0) {
+            compiled.iFirstLeaf = iFirstLeaf;
+        }
+        compiled.nLeaves += nLeaves;
+    }
+}
+
+// Compiles the nodes depth-first, front first, from an explicit stack.
+// piRemap receives the compiled index of every polygon of the tree.
+static void CompileNodes(
+    std::vector<bsp_cnode>* pNodes, PolygonContainer* pPolygons, std::vector<uint32_t>* pIndices, int* piRemap,
+    const bsp_tree* pTree) {
+    std::vector<compile_item> aStack;
+
+    aStack.push_back({ pTree->root, -1, 0, false });
+    while (aStack.size() > 0) {
+        auto item = aStack.back();
+        aStack.pop_back();
+        if (item.bFinish) {
+            FinishNode(pNodes, item.iParent);
+        } else {
+            auto iNode = CompileNode(pNodes, pPolygons, pIndices, piRemap, pTree, item.pNode);
+            if (item.iParent >= 0) {
+                (*pNodes)[item.iParent].children[item.iChild] = iNode;
+            }
+            if (iNode >= 0) {
+                aStack.push_back({ NULL, iNode, 0, true });
+                aStack.push_back({ item.pNode->back, iNode, 1, false });
+                aStack.push_back({ item.pNode->front, iNode, 0, false });
+            }
+        }
+    }
+}
+
+void CompileBSPTree(bsp_compiled* pOut, const bsp_tree* pTree) {
+    std::vector<int> aRemap(pTree ? pTree->polygons.Count() : 0);
+
+    assert(pOut);
+    assert(pTree);
+
+    pOut->m_file.Close();
+    pOut->m_aNodes.clear();
+    pOut->m_aPlanes.assign(pTree->planes.Data(), pTree->planes.Data() + pTree->planes.Count());
+    pOut->m_polygons.Clear();
+    pOut->m_polygons.Reserve(pTree->polygons.Count(), pTree->polygons.TotalVertexCount());
+    pOut->m_aIndices.clear();
+    pOut->m_aLeaves.clear();
+    pOut->m_aLeafFaces.clear();
+    pOut->m_aVisData.clear();
+
+    CompileNodes(&pOut->m_aNodes, &pOut->m_polygons, &pOut->m_aIndices, aRemap.data(), pTree);
+
+    for (auto pLeaf : pTree->leaves) {
+        bsp_cleaf leaf;
+        leaf.contents = pLeaf->contents;
+        leaf.iFirstFace = (uint32_t)pOut->m_aLeafFaces.size();
+        leaf.nFaces = pLeaf->nLeafFaces;
+        leaf.iVisOffset = -1;
+        for (int i = 0; i < pLeaf->nLeafFaces; i++) {
+            pOut->m_aLeafFaces.push_back(aRemap[pTree->leafFaces[pLeaf->iFirstLeafFace + i]]);
+        }
+        pOut->m_aLeaves.push_back(leaf);
+    }
+
+    pOut->pNodes = pOut->m_aNodes.data();
+    pOut->nNodes = (int)pOut->m_aNodes.size();
+    pOut->pPlanes = pOut->m_aPlanes.data();
+    pOut->nPlanes = (int)pOut->m_aPlanes.size();
+    pOut->pWindings = pOut->m_polygons.Windings();
+    pOut->nPolygons = pOut->m_polygons.Count();
+    pOut->pVertices = pOut->m_polygons.VertexData();
+    pOut->nVertices = pOut->m_polygons.TotalVertexCount();
+    pOut->pIndices = pOut->m_aIndices.data();
+    pOut->nIndices = (int)pOut->m_aIndices.size();
+    pOut->pLeaves = pOut->m_aLeaves.data();
+    pOut->nLeaves = (int)pOut->m_aLeaves.size();
+    pOut->pLeafFaces = pOut->m_aLeafFaces.data();
+    pOut->nLeafFaces = (int)pOut->m_aLeafFaces.size();
+    pOut->pVisData = NULL;
+    pOut->nVisData = 0;
+}
+
+int BSPPointInLeaf(const bsp_compiled* pTree, const vector4& vPoint) {
+    int ret = -1;
+    int32_t iNode;
+
+    assert(pTree);
+
+    if (pTree->nNodes > 0) {
+        iNode = 0;
+        while (iNode >= 0) {
+            auto pNode = &pTree->pNodes[iNode];
+            auto eq = pTree->PlaneEquation(pNode->hPlane);
+            iNode = pNode->children[(PlaneDistance(eq, vPoint) >= 0) ? 0 : 1];
+        }
+        if (iNode != BSP_NO_CHILD) {
+            ret = BSP_CHILD_LEAF(iNode);
+        }
+    } else if (pTree->nLeaves > 0) {
+        // The root itself is a leaf
+        ret = 0;
+    }
+
+    return ret;
+}
+
+int BSPPointContents(const bsp_compiled* pTree, const vector4& vPoint) {
+    int iLeaf = BSPPointInLeaf(pTree, vPoint);
+    return (iLeaf >= 0) ? pTree->pLeaves[iLeaf].contents : BSP_CONTENTS_EMPTY;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "bsp.h"
+#include "util_mmap.h"
+
+#define BSP_NO_CHILD (-1)
+// Children below BSP_NO_CHILD are leaves
+#define BSP_LEAF_CHILD(iLeaf) (-2 - (iLeaf))
+#define BSP_CHILD_LEAF(iChild) (-2 - (iChild))
+
+// Node of a compiled tree
+struct bsp_cnode {
+    // Plane of the node's polygons in bsp_compiled::pPlanes
+    HPLANE hPlane;
+    // Index of the front ([0]) and back ([1]) child, BSP_NO_CHILD or
+    // BSP_LEAF_CHILD of a leaf
+    int32_t children[2];
+    // Range of the node's polygons in bsp_compiled::pWindings
+    uint32_t iFirstPolygon;
+    uint32_t nPolygons;
+    // Range of the triangles of the node's polygons in bsp_compiled::pIndices
+    uint32_t iFirstIndex;
+    uint32_t nIndices;
+    // Bounding box of the polygons of the node and of all its descendants
+    float aflMins[3];
+    float aflMaxs[3];
+    // Range of the leaves below the node in bsp_compiled::pLeaves
+    uint32_t iFirstLeaf;
+    uint32_t nLeaves;
+};
+
+// Leaf of a compiled tree
+struct bsp_cleaf {
+    // BSP_CONTENTS_EMPTY or BSP_CONTENTS_SOLID
+    int32_t contents;
+    // Range of the leaf's faces in bsp_compiled::pLeafFaces
+    uint32_t iFirstFace;
+    uint32_t nFaces;
+    // Offset of the compressed visible set of the leaf in
+    // bsp_compiled::pVisData or -1 if it has none
+    int32_t iVisOffset;
+};
+
+// Linear, read-only form of a bsp_tree.
+// The nodes are stored in depth-first order in one array with the root
+// first, and the polygons of every node are packed in the same order.
+// The arrays are either owned by the object or point into a file mapped
+// by LoadCompiledBSP.
+struct bsp_compiled {
+public:
+    const bsp_cnode* pNodes;
+    int nNodes;
+    // Plane equations, see bsp_planes.h
+    const vector4* pPlanes;
+    int nPlanes;
+    const PolygonContainer::winding* pWindings;
+    int nPolygons;
+    const vector4* pVertices;
+    int nVertices;
+    // Triangle list of every polygon, indexing into pVertices
+    const uint32_t* pIndices;
+    int nIndices;
+    // Leaves of trees built with leaves, in depth-first order
+    const bsp_cleaf* pLeaves;
+    int nLeaves;
+    // Indices into pWindings
+    const uint32_t* pLeafFaces;
+    int nLeafFaces;
+    // Visible sets, see bsp_vis.h
+    const uint8_t* pVisData;
+    int nVisData;
+
+    bsp_compiled() :
+        pNodes(NULL), nNodes(0),
+        pPlanes(NULL), nPlanes(0),
+        pWindings(NULL), nPolygons(0),
+        pVertices(NULL), nVertices(0),
+        pIndices(NULL), nIndices(0),
+        pLeaves(NULL), nLeaves(0),
+        pLeafFaces(NULL), nLeafFaces(0),
+        pVisData(NULL), nVisData(0) {
+    }
+
+    bsp_compiled(const bsp_compiled&) = delete;
+    bsp_compiled& operator=(const bsp_compiled&) = delete;
+
+    vector4 PlaneEquation(HPLANE hPlane) const {
+        return PlaneEquationOf(pPlanes, hPlane);
+    }
+
+    Polygon GetPolygon(int iPoly) const {
+        Polygon ret;
+        auto& w = pWindings[iPoly];
+        assert(w.nVertices <= POLYGON_MAX_POINTS);
+        for (int iVtx = 0; iVtx < w.nVertices; iVtx++) {
+            ret += pVertices[w.iFirstVertex + iVtx];
+        }
+        return ret;
+    }
+
+private:
+    friend void CompileBSPTree(bsp_compiled* pOut, const bsp_tree* pTree);
+    friend bool LoadCompiledBSP(bsp_compiled* pOut, const char* pszPath, bool bVerify);
+    friend bool ComputeBSPVisibility(bsp_compiled* pTree, const struct bsp_vis_params* pParams, struct bsp_vis_stats* pStats);
+
+    std::vector<bsp_cnode> m_aNodes;
+    std::vector<vector4> m_aPlanes;
+    PolygonContainer m_polygons;
+    std::vector<uint32_t> m_aIndices;
+    std::vector<bsp_cleaf> m_aLeaves;
+    std::vector<uint32_t> m_aLeafFaces;
+    std::vector<uint8_t> m_aVisData;
+    CMappedFile m_file;
+};
+
+// Converts a tree into its compiled form
+void CompileBSPTree(bsp_compiled* pOut, const bsp_tree* pTree);
+// Returns the index of the leaf containing a point, or -1 if the tree has
+// no leaves. Points on a plane belong to its front side.
+int BSPPointInLeaf(const bsp_compiled* pTree, const vector4& vPoint);
+// Returns BSP_CONTENTS_EMPTY or BSP_CONTENTS_SOLID; everything is empty in
+// trees without leaves
+int BSPPointContents(const bsp_compiled* pTree, const vector4& vPoint);
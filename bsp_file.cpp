@@ -0,0 +1,264 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "bsp_file.h"
+
+#define BSPFILE_ALIGN (16)
+
+static const uint32_t* Crc32Table() {
+    static uint32_t s_aTable[256];
+    static bool s_bInit = [] {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            s_aTable[i] = c;
+        }
+        return true;
+    }();
+    (void)s_bInit;
+    return s_aTable;
+}
+
+// Running CRC-32; start with 0
+static uint32_t Crc32(uint32_t uCrc, const void* pData, size_t nSize) {
+    auto pTable = Crc32Table();
+    auto pBytes = (const unsigned char*)pData;
+    uCrc = ~uCrc;
+    for (size_t i = 0; i < nSize; i++) {
+        uCrc = pTable[(uCrc ^ pBytes[i]) & 0xFF] ^ (uCrc >> 8);
+    }
+    return ~uCrc;
+}
+
+bool SaveCompiledBSP(const char* pszPath, const bsp_compiled* pTree) {
+    bool ret = false;
+    bsp_file_header hdr = {};
+    const void* apData[BSPFILE_LUMP_MAX];
+    static const unsigned char s_aPadding[BSPFILE_ALIGN] = {};
+    uint64_t iOffset = (sizeof(hdr) + BSPFILE_ALIGN - 1) & ~(uint64_t)(BSPFILE_ALIGN - 1);
+
+    assert(pszPath && pTree);
+
+    apData[BSPFILE_LUMP_NODES] = pTree->pNodes;
+    hdr.aLumps[BSPFILE_LUMP_NODES].nSize = pTree->nNodes * sizeof(bsp_cnode);
+    apData[BSPFILE_LUMP_PLANES] = pTree->pPlanes;
+    hdr.aLumps[BSPFILE_LUMP_PLANES].nSize = pTree->nPlanes * sizeof(vector4);
+    apData[BSPFILE_LUMP_WINDINGS] = pTree->pWindings;
+    hdr.aLumps[BSPFILE_LUMP_WINDINGS].nSize = pTree->nPolygons * sizeof(PolygonContainer::winding);
+    apData[BSPFILE_LUMP_VERTICES] = pTree->pVertices;
+    hdr.aLumps[BSPFILE_LUMP_VERTICES].nSize = pTree->nVertices * sizeof(vector4);
+    apData[BSPFILE_LUMP_INDICES] = pTree->pIndices;
+    hdr.aLumps[BSPFILE_LUMP_INDICES].nSize = pTree->nIndices * sizeof(uint32_t);
+    apData[BSPFILE_LUMP_LEAVES] = pTree->pLeaves;
+    hdr.aLumps[BSPFILE_LUMP_LEAVES].nSize = pTree->nLeaves * sizeof(bsp_cleaf);
+    apData[BSPFILE_LUMP_LEAFFACES] = pTree->pLeafFaces;
+    hdr.aLumps[BSPFILE_LUMP_LEAFFACES].nSize = pTree->nLeafFaces * sizeof(uint32_t);
+    apData[BSPFILE_LUMP_VISIBILITY] = pTree->pVisData;
+    hdr.aLumps[BSPFILE_LUMP_VISIBILITY].nSize = pTree->nVisData;
+
+    for (int iLump = 0; iLump < BSPFILE_LUMP_MAX; iLump++) {
+        hdr.aLumps[iLump].iOffset = iOffset;
+        iOffset += (hdr.aLumps[iLump].nSize + BSPFILE_ALIGN - 1) & ~(uint64_t)(BSPFILE_ALIGN - 1);
+    }
+
+    memcpy(hdr.szMagic, "BSPC", 4);
+    hdr.uVersion = BSPFILE_VERSION;
+    hdr.nFileSize = iOffset;
+
+    FILE* hFile = fopen(pszPath, "wb");
+    if (hFile) {
+        uint64_t iPos = sizeof(hdr);
+        uint32_t uCrc = 0;
+
+        // The header is written again once the checksum is known
+        ret = fwrite(&hdr, sizeof(hdr), 1, hFile) == 1;
+        for (int iLump = 0; iLump < BSPFILE_LUMP_MAX && ret; iLump++) {
+            auto& lump = hdr.aLumps[iLump];
+            size_t nPadding = (size_t)(lump.iOffset - iPos);
+            ret = fwrite(s_aPadding, 1, nPadding, hFile) == nPadding;
+            uCrc = Crc32(uCrc, s_aPadding, nPadding);
+            if (ret && lump.nSize > 0) {
+                ret = fwrite(apData[iLump], 1, (size_t)lump.nSize, hFile) == lump.nSize;
+                uCrc = Crc32(uCrc, apData[iLump], (size_t)lump.nSize);
+            }
+            iPos = lump.iOffset + lump.nSize;
+        }
+        if (ret && iPos < hdr.nFileSize) {
+            size_t nPadding = (size_t)(hdr.nFileSize - iPos);
+            ret = fwrite(s_aPadding, 1, nPadding, hFile) == nPadding;
+            uCrc = Crc32(uCrc, s_aPadding, nPadding);
+        }
+        if (ret) {
+            hdr.uChecksum = uCrc;
+            ret = fseek(hFile, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, hFile) == 1;
+        }
+        ret = (fclose(hFile) == 0) && ret;
+    }
+
+    return ret;
+}
+
+// Checks that a lump is inside the file and holds whole elements
+static bool ValidLump(const bsp_file_lump& lump, uint64_t nFileSize, size_t nElementSize) {
+    return
+        lump.iOffset % BSPFILE_ALIGN == 0 &&
+        lump.iOffset <= nFileSize && lump.nSize <= nFileSize - lump.iOffset &&
+        lump.nSize % nElementSize == 0;
+}
+
+// Checks that [iFirst, iFirst + n) is inside an array of nCount elements
+static bool ValidRange(uint32_t iFirst, uint32_t n, int nCount) {
+    return iFirst <= (uint32_t)nCount && n <= (uint32_t)nCount - iFirst;
+}
+
+// Checks that every index in the arrays of a tree points into the array it
+// indexes, so that nothing that walks the tree reads outside of the file.
+// Children must come after their parents, like they do in depth-first
+// order, so that walks end.
+static bool ValidTree(const bsp_compiled* pTree) {
+    bool ret = true;
+
+    for (int iNode = 0; iNode < pTree->nNodes && ret; iNode++) {
+        auto& node = pTree->pNodes[iNode];
+        ret =
+            PLANE_INDEX(node.hPlane) < (HPLANE)pTree->nPlanes &&
+            ValidRange(node.iFirstPolygon, node.nPolygons, pTree->nPolygons) &&
+            ValidRange(node.iFirstIndex, node.nIndices, pTree->nIndices) &&
+            ValidRange(node.iFirstLeaf, node.nLeaves, pTree->nLeaves);
+        for (int iChild = 0; iChild < 2 && ret; iChild++) {
+            int32_t iIdx = node.children[iChild];
+            ret =
+                iIdx == BSP_NO_CHILD ||
+                (iIdx > iNode && iIdx < pTree->nNodes) ||
+                (iIdx < BSP_NO_CHILD && iIdx >= BSP_LEAF_CHILD(pTree->nLeaves - 1));
+        }
+    }
+    for (int iPoly = 0; iPoly < pTree->nPolygons && ret; iPoly++) {
+        auto& w = pTree->pWindings[iPoly];
+        ret =
+            w.iFirstVertex >= 0 && w.nVertices >= 3 &&
+            ValidRange((uint32_t)w.iFirstVertex, (uint32_t)w.nVertices, pTree->nVertices) &&
+            PLANE_INDEX(w.hPlane) < (HPLANE)pTree->nPlanes;
+    }
+    for (int iIndex = 0; iIndex < pTree->nIndices && ret; iIndex++) {
+        ret = pTree->pIndices[iIndex] < (uint32_t)pTree->nVertices;
+    }
+    for (int iLeaf = 0; iLeaf < pTree->nLeaves && ret; iLeaf++) {
+        auto& leaf = pTree->pLeaves[iLeaf];
+        ret =
+            (leaf.contents == BSP_CONTENTS_EMPTY || leaf.contents == BSP_CONTENTS_SOLID) &&
+            ValidRange(leaf.iFirstFace, leaf.nFaces, pTree->nLeafFaces) &&
+            leaf.iVisOffset >= -1 && leaf.iVisOffset < pTree->nVisData;
+    }
+    for (int iFace = 0; iFace < pTree->nLeafFaces && ret; iFace++) {
+        ret = pTree->pLeafFaces[iFace] < (uint32_t)pTree->nPolygons;
+    }
+
+    return ret;
+}
+
+bool IsCompiledBSPFile(const char* pszPath) {
+    bool ret = false;
+    char szMagic[4];
+    FILE* hFile;
+
+    assert(pszPath);
+
+    hFile = fopen(pszPath, "rb");
+    if (hFile) {
+        ret = fread(szMagic, sizeof(szMagic), 1, hFile) == 1 && memcmp(szMagic, "BSPC", 4) == 0;
+        fclose(hFile);
+    }
+
+    return ret;
+}
+
+bool LoadCompiledBSP(bsp_compiled* pOut, const char* pszPath, bool bVerify) {
+    bool ret = false;
+    static const size_t s_anElementSizes[BSPFILE_LUMP_MAX] = {
+        sizeof(bsp_cnode), sizeof(vector4), sizeof(PolygonContainer::winding), sizeof(vector4), sizeof(uint32_t),
+        sizeof(bsp_cleaf), sizeof(uint32_t), 1,
+    };
+
+    assert(pOut && pszPath);
+
+    if (pOut->m_file.Open(pszPath) && pOut->m_file.Size() >= sizeof(bsp_file_header)) {
+        auto pBase = (const unsigned char*)pOut->m_file.Data();
+        auto pHdr = (const bsp_file_header*)pBase;
+
+        ret =
+            memcmp(pHdr->szMagic, "BSPC", 4) == 0 &&
+            pHdr->uVersion == BSPFILE_VERSION &&
+            pHdr->nFileSize == pOut->m_file.Size();
+        for (int iLump = 0; iLump < BSPFILE_LUMP_MAX && ret; iLump++) {
+            ret = ValidLump(pHdr->aLumps[iLump], pHdr->nFileSize, s_anElementSizes[iLump]);
+        }
+        if (ret && bVerify) {
+            ret = Crc32(0, pBase + sizeof(bsp_file_header), (size_t)pHdr->nFileSize - sizeof(bsp_file_header)) == pHdr->uChecksum;
+        }
+
+        if (ret) {
+            auto& lumps = pHdr->aLumps;
+            pOut->m_aNodes.clear();
+            pOut->m_aPlanes.clear();
+            pOut->m_polygons.Clear();
+            pOut->m_aIndices.clear();
+            pOut->m_aLeaves.clear();
+            pOut->m_aLeafFaces.clear();
+            pOut->m_aVisData.clear();
+
+            pOut->pNodes = (const bsp_cnode*)(pBase + lumps[BSPFILE_LUMP_NODES].iOffset);
+            pOut->nNodes = (int)(lumps[BSPFILE_LUMP_NODES].nSize / sizeof(bsp_cnode));
+            pOut->pPlanes = (const vector4*)(pBase + lumps[BSPFILE_LUMP_PLANES].iOffset);
+            pOut->nPlanes = (int)(lumps[BSPFILE_LUMP_PLANES].nSize / sizeof(vector4));
+            pOut->pWindings = (const PolygonContainer::winding*)(pBase + lumps[BSPFILE_LUMP_WINDINGS].iOffset);
+            pOut->nPolygons = (int)(lumps[BSPFILE_LUMP_WINDINGS].nSize / sizeof(PolygonContainer::winding));
+            pOut->pVertices = (const vector4*)(pBase + lumps[BSPFILE_LUMP_VERTICES].iOffset);
+            pOut->nVertices = (int)(lumps[BSPFILE_LUMP_VERTICES].nSize / sizeof(vector4));
+            pOut->pIndices = (const uint32_t*)(pBase + lumps[BSPFILE_LUMP_INDICES].iOffset);
+            pOut->nIndices = (int)(lumps[BSPFILE_LUMP_INDICES].nSize / sizeof(uint32_t));
+            pOut->pLeaves = (const bsp_cleaf*)(pBase + lumps[BSPFILE_LUMP_LEAVES].iOffset);
+            pOut->nLeaves = (int)(lumps[BSPFILE_LUMP_LEAVES].nSize / sizeof(bsp_cleaf));
+            pOut->pLeafFaces = (const uint32_t*)(pBase + lumps[BSPFILE_LUMP_LEAFFACES].iOffset);
+            pOut->nLeafFaces = (int)(lumps[BSPFILE_LUMP_LEAFFACES].nSize / sizeof(uint32_t));
+            pOut->pVisData = pBase + lumps[BSPFILE_LUMP_VISIBILITY].iOffset;
+            pOut->nVisData = (int)lumps[BSPFILE_LUMP_VISIBILITY].nSize;
+
+            // The checksum only catches damage; the contents of a file that
+            // wasn't written by SaveCompiledBSP are checked here
+            ret = ValidTree(pOut);
+        }
+    }
+
+    if (!ret) {
+        // The old arrays may have been in the mapping that was just closed
+        pOut->m_file.Close();
+        pOut->m_aNodes.clear();
+        pOut->m_aPlanes.clear();
+        pOut->m_polygons.Clear();
+        pOut->m_aIndices.clear();
+        pOut->m_aLeaves.clear();
+        pOut->m_aLeafFaces.clear();
+        pOut->m_aVisData.clear();
+        pOut->pNodes = NULL;
+        pOut->nNodes = 0;
+        pOut->pPlanes = NULL;
+        pOut->nPlanes = 0;
+        pOut->pWindings = NULL;
+        pOut->nPolygons = 0;
+        pOut->pVertices = NULL;
+        pOut->nVertices = 0;
+        pOut->pIndices = NULL;
+        pOut->nIndices = 0;
+        pOut->pLeaves = NULL;
+        pOut->nLeaves = 0;
+        pOut->pLeafFaces = NULL;
+        pOut->nLeafFaces = 0;
+        pOut->pVisData = NULL;
+        pOut->nVisData = 0;
+    }
+
+    return ret;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include "bsp_compiled.h"
+
+// Compiled tree files hold the arrays of a bsp_compiled as lumps, every one
+// aligned to 16 bytes so they can be used in place once the file is mapped
+// into memory. Everything is in native byte order.
+#define BSPFILE_VERSION (4)
+
+enum {
+    BSPFILE_LUMP_NODES,
+    BSPFILE_LUMP_PLANES,
+    BSPFILE_LUMP_WINDINGS,
+    BSPFILE_LUMP_VERTICES,
+    BSPFILE_LUMP_INDICES,
+    BSPFILE_LUMP_LEAVES,
+    BSPFILE_LUMP_LEAFFACES,
+    BSPFILE_LUMP_VISIBILITY,
+
+    BSPFILE_LUMP_MAX
+};
+
+struct bsp_file_lump {
+    uint64_t iOffset;
+    uint64_t nSize;
+};
+
+struct bsp_file_header {
+    char szMagic[4];
+    uint32_t uVersion;
+    // CRC-32 of everything after the header
+    uint32_t uChecksum;
+    uint32_t uReserved;
+    uint64_t nFileSize;
+    bsp_file_lump aLumps[BSPFILE_LUMP_MAX];
+};
+
+bool SaveCompiledBSP(const char* pszPath, const bsp_compiled* pTree);
+// Maps a compiled tree file into memory; pOut will point into the mapping
+// until it's loaded or compiled again. Files whose arrays index outside
+// of each other are rejected either way; verifying the checksum as well
+// touches every page of the file.
+bool LoadCompiledBSP(bsp_compiled* pOut, const char* pszPath, bool bVerify = true);
+// Whether a file starts like a compiled tree file, to tell them from maps;
+// LoadCompiledBSP may still reject it
+bool IsCompiledBSPFile(const char* pszPath);
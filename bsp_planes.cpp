@@ -0,0 +1,60 @@
+#include <assert.h>
+#include <math.h>
+#include "bsp_planes.h"
+
+#define PLANE_HASH_SIZE (4096)
+#define PLANE_HASH_STEP (0.5f)
+
+CPlaneTable::CPlaneTable() : m_aHashHeads(PLANE_HASH_SIZE, -1) {
+}
+
+int CPlaneTable::HashBucket(float D) const {
+    return ((int)floorf(fabsf(D) / PLANE_HASH_STEP)) & (PLANE_HASH_SIZE - 1);
+}
+
+static bool PlaneEquals(const vector4& eq, const vector4& N, float D) {
+    return
+        fabsf(eq[0] - N[0]) < PLANE_NORMAL_EPSILON &&
+        fabsf(eq[1] - N[1]) < PLANE_NORMAL_EPSILON &&
+        fabsf(eq[2] - N[2]) < PLANE_NORMAL_EPSILON &&
+        fabsf(eq[3] - D) < PLANE_DIST_EPSILON;
+}
+
+HPLANE CPlaneTable::FindOrAdd(const vector4& N, float D) {
+    int iBucket = HashBucket(D);
+    vector4 NFlip(-N[0], -N[1], -N[2]);
+
+    // Neighbouring buckets too, D may be right at the edge of one
+    for (int iOff = -1; iOff <= 1; iOff++) {
+        int iHead = m_aHashHeads[(iBucket + iOff) & (PLANE_HASH_SIZE - 1)];
+        for (int iPlane = iHead; iPlane != -1; iPlane = m_aNext[iPlane]) {
+            auto& eq = m_aPlanes[iPlane];
+            if (PlaneEquals(eq, N, D)) {
+                return PLANE_HANDLE(iPlane, false);
+            }
+            if (PlaneEquals(eq, NFlip, -D)) {
+                return PLANE_HANDLE(iPlane, true);
+            }
+        }
+    }
+
+    int iPlane = (int)m_aPlanes.size();
+    m_aPlanes.push_back(vector4(N[0], N[1], N[2], D));
+    m_aNext.push_back(m_aHashHeads[iBucket]);
+    m_aHashHeads[iBucket] = iPlane;
+
+    return PLANE_HANDLE(iPlane, false);
+}
+
+HPLANE CPlaneTable::FindOrAdd(const Plane& plane) {
+    auto N = normalize(normal(plane));
+    return FindOrAdd(N, -dot(N, plane[0]));
+}
+
+void CPlaneTable::Clear() {
+    m_aPlanes.clear();
+    m_aNext.clear();
+    for (auto& iHead : m_aHashHeads) {
+        iHead = -1;
+    }
+}
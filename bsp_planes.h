@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+#include "util_geostruct.h"
+
+// Plane tables store normalized plane equations (A, B, C, D) where the
+// front side of the plane is where A*x + B*y + C*z + D > 0.
+// A plane and its opposite share one entry: the handle of a plane is its
+// index shifted left by one, with the low bit set if the plane faces
+// the other way than the stored equation.
+#define PLANE_HANDLE(iPlane, bFlip) ((HPLANE)(((iPlane) << 1) | ((bFlip) ? 1 : 0)))
+#define PLANE_INDEX(hPlane) ((hPlane) >> 1)
+#define PLANE_FLIPPED(hPlane) ((hPlane) & 1)
+
+// Planes closer than this are the same
+#define PLANE_NORMAL_EPSILON (0.00001f)
+#define PLANE_DIST_EPSILON (0.01f)
+
+inline vector4 PlaneEquationOf(const vector4* pPlanes, HPLANE hPlane) {
+    auto& eq = pPlanes[PLANE_INDEX(hPlane)];
+    if (PLANE_FLIPPED(hPlane)) {
+        return vector4(-eq[0], -eq[1], -eq[2], -eq[3]);
+    } else {
+        return eq;
+    }
+}
+
+inline float PlaneDistance(const vector4& eq, const vector4& P) {
+    return eq[0] * P[0] + eq[1] * P[1] + eq[2] * P[2] + eq[3];
+}
+
+class CPlaneTable {
+public:
+    CPlaneTable();
+
+    // Returns the handle of the plane, adding it to the table if there is
+    // no such plane in it yet. N must be normalized.
+    HPLANE FindOrAdd(const vector4& N, float D);
+    HPLANE FindOrAdd(const Plane& plane);
+
+    vector4 Equation(HPLANE hPlane) const {
+        return PlaneEquationOf(m_aPlanes.data(), hPlane);
+    }
+
+    int Count() const {
+        return (int)m_aPlanes.size();
+    }
+
+    const vector4* Data() const {
+        return m_aPlanes.data();
+    }
+
+    void Clear();
+
+    size_t BytesUsed() const {
+        return
+            m_aPlanes.capacity() * sizeof(vector4) +
+            m_aNext.capacity() * sizeof(int) +
+            m_aHashHeads.capacity() * sizeof(int);
+    }
+
+private:
+    int HashBucket(float D) const;
+
+    std::vector<vector4> m_aPlanes;
+    // Hashed on |D| so a plane and its opposite land in the same bucket
+    std::vector<int> m_aHashHeads;
+    std::vector<int> m_aNext;
+};
@@ -0,0 +1,248 @@
+#include <assert.h>
+#include "bsp_render.h"
+
+// Every plane of the frustum is still tested
+#define CULL_ALL_PLANES ((1 << BSP_FRUSTUM_PLANES) - 1)
+
+// State shared by one traversal
+struct draw_walk {
+    std::vector<bsp_draw_range>* pRanges;
+    const bsp_compiled* pTree;
+    vector4 vEye;
+    const bsp_frustum* pFrustum;
+    const bsp_pvs* pPVS;
+    bsp_cull_stats stats;
+};
+
+void BSPFrustumFromMatrix(bsp_frustum* pOut, const math::matrix4& matMVP) {
+    assert(pOut);
+
+    // A point is inside if -w <= x, y, z <= w in clip space; every bound is
+    // the fourth row of the matrix plus or minus one of the others
+    for (int iAxis = 0; iAxis < 3; iAxis++) {
+        for (int iSign = 0; iSign < 2; iSign++) {
+            float flSign = iSign ? -1.0f : 1.0f;
+            auto& plane = pOut->aPlanes[iAxis * 2 + iSign];
+            for (int iCol = 0; iCol < 4; iCol++) {
+                plane.v[iCol] = matMVP.idx(3, iCol) + flSign * matMVP.idx(iAxis, iCol);
+            }
+        }
+    }
+}
+
+// Tests the bounding box of a node against the planes in *pMask. Returns
+// false if the box is outside; otherwise removes the planes the box is
+// entirely in front of from the mask.
+static bool BoxInFrustum(const bsp_frustum* pFrustum, const bsp_cnode* pNode, unsigned* pMask) {
+    bool ret = true;
+
+    for (int iPlane = 0; iPlane < BSP_FRUSTUM_PLANES && ret; iPlane++) {
+        if (*pMask & (1 << iPlane)) {
+            auto& plane = pFrustum->aPlanes[iPlane];
+            float flNear = plane[3], flFar = plane[3];
+            // flFar is the distance of the corner furthest along the
+            // normal, flNear that of the opposite corner
+            for (int i = 0; i < 3; i++) {
+                if (plane[i] > 0) {
+                    flFar += plane[i] * pNode->aflMaxs[i];
+                    flNear += plane[i] * pNode->aflMins[i];
+                } else {
+                    flFar += plane[i] * pNode->aflMins[i];
+                    flNear += plane[i] * pNode->aflMaxs[i];
+                }
+            }
+            if (flFar < 0) {
+                ret = false;
+            } else if (flNear >= 0) {
+                *pMask &= ~(1u << iPlane);
+            }
+        }
+    }
+
+    return ret;
+}
+
+// Returns false if the subtree of the node can be skipped
+static bool VisitNode(draw_walk* pWalk, const bsp_cnode* pNode, unsigned* pMask) {
+    bool ret = true;
+
+    pWalk->stats.nVisited++;
+    if (pWalk->pPVS && !pWalk->pPVS->AnyVisible(pNode->iFirstLeaf, pNode->nLeaves)) {
+        pWalk->stats.nPVSCulled++;
+        ret = false;
+    } else if (*pMask) {
+        ret = BoxInFrustum(pWalk->pFrustum, pNode, pMask);
+        if (!ret) {
+            pWalk->stats.nCulled++;
+        } else if (!*pMask) {
+            pWalk->stats.nInside++;
+        }
+    }
+
+    return ret;
+}
+
+static void EmitRange(std::vector<bsp_draw_range>* pRanges, uint32_t iFirstIndex, uint32_t nIndices) {
+    if (nIndices > 0) {
+        if (pRanges->size() > 0 && pRanges->back().iFirstIndex + pRanges->back().nIndices == iFirstIndex) {
+            pRanges->back().nIndices += nIndices;
+        } else {
+            pRanges->push_back({ iFirstIndex, nIndices });
+        }
+    }
+}
+
+static void EmitNode(draw_walk* pWalk, const bsp_cnode* pNode) {
+    auto pPVS = pWalk->pPVS;
+
+    if (!pPVS || pPVS->iLeaf < 0) {
+        EmitRange(pWalk->pRanges, pNode->iFirstIndex, pNode->nIndices);
+    } else {
+        // The triangles of the polygons follow each other in the index list
+        uint32_t iIndex = pNode->iFirstIndex;
+        for (uint32_t i = 0; i < pNode->nPolygons; i++) {
+            uint32_t iPoly = pNode->iFirstPolygon + i;
+            uint32_t nIndices = (pWalk->pTree->pWindings[iPoly].nVertices - 2) * 3;
+            if (pPVS->PolygonVisible(iPoly)) {
+                EmitRange(pWalk->pRanges, iIndex, nIndices);
+            }
+            iIndex += nIndices;
+        }
+    }
+}
+
+// Steps of a traversal, kept on an explicit stack
+enum eWalkStep {
+    // Visit a subtree front to back, or back to front
+    eWalkFrontToBack,
+    eWalkBackToFront,
+    // Emit the polygons of a node whose subtree was already visited
+    eWalkEmit,
+};
+
+struct walk_item {
+    int32_t iNode;
+    unsigned uMask;
+    eWalkStep step;
+};
+
+// Pushes the steps of a visited node in reverse order, so that they're
+// popped as near child, node, far child. Nodes whose plane the eye is on
+// don't draw their polygons and always visit their children back to front.
+static void PushChildren(
+    std::vector<walk_item>* pStack, const draw_walk* pWalk, const bsp_cnode* pNode, int32_t iNode,
+    unsigned uMask, eWalkStep step) {
+    int iSide = WhichSide(pWalk->pTree->PlaneEquation(pNode->hPlane).v, pWalk->vEye);
+
+    if (iSide == SIDE_ON) {
+        if (step == eWalkFrontToBack) {
+            pStack->push_back({ pNode->children[0], uMask, eWalkBackToFront });
+            pStack->push_back({ pNode->children[1], uMask, eWalkBackToFront });
+        } else {
+            pStack->push_back({ pNode->children[1], uMask, eWalkBackToFront });
+            pStack->push_back({ pNode->children[0], uMask, eWalkBackToFront });
+        }
+    } else {
+        // Index of the child on the side of the eye
+        int iNear = (iSide == SIDE_FRONT) ? 0 : 1;
+        if (step == eWalkBackToFront) {
+            iNear = 1 - iNear;
+        }
+        pStack->push_back({ pNode->children[1 - iNear], uMask, step });
+        pStack->push_back({ iNode, 0, eWalkEmit });
+        pStack->push_back({ pNode->children[iNear], uMask, step });
+    }
+}
+
+// Walks the subtree of iNode in the given order. The stack is kept
+// between frames so that drawing doesn't allocate.
+static void Walk(draw_walk* pWalk, int32_t iNode, unsigned uMask, eWalkStep step) {
+    static thread_local std::vector<walk_item> aStack;
+
+    aStack.clear();
+    aStack.push_back({ iNode, uMask, step });
+    while (aStack.size() > 0) {
+        auto item = aStack.back();
+        aStack.pop_back();
+        if (item.iNode >= 0) {
+            auto pNode = &pWalk->pTree->pNodes[item.iNode];
+            if (item.step == eWalkEmit) {
+                EmitNode(pWalk, pNode);
+            } else if (VisitNode(pWalk, pNode, &item.uMask)) {
+                PushChildren(&aStack, pWalk, pNode, item.iNode, item.uMask, item.step);
+            }
+        }
+    }
+}
+
+static void BeginWalk(
+    draw_walk* pWalk, std::vector<bsp_draw_range>* pRanges, const bsp_compiled* pTree, const vector4& vEye,
+    const bsp_frustum* pFrustum, const bsp_pvs* pPVS) {
+    assert(pRanges && pTree);
+    pWalk->pRanges = pRanges;
+    pWalk->pTree = pTree;
+    pWalk->vEye = vEye;
+    pWalk->pFrustum = pFrustum;
+    pWalk->pPVS = pPVS;
+    pWalk->stats = { 0, 0, 0, 0 };
+}
+
+void BSPDrawRangesFrontToBack(
+    std::vector<bsp_draw_range>* pRanges, const bsp_compiled* pTree, const vector4& vEye,
+    const bsp_frustum* pFrustum, const bsp_pvs* pPVS, bsp_cull_stats* pStats) {
+    draw_walk walk;
+    BeginWalk(&walk, pRanges, pTree, vEye, pFrustum, pPVS);
+    if (pTree->nNodes > 0) {
+        Walk(&walk, 0, pFrustum ? CULL_ALL_PLANES : 0, eWalkFrontToBack);
+    }
+    if (pStats) {
+        *pStats = walk.stats;
+    }
+}
+
+void BSPDrawRangesBackToFront(
+    std::vector<bsp_draw_range>* pRanges, const bsp_compiled* pTree, const vector4& vEye,
+    const bsp_frustum* pFrustum, const bsp_pvs* pPVS, bsp_cull_stats* pStats) {
+    draw_walk walk;
+    BeginWalk(&walk, pRanges, pTree, vEye, pFrustum, pPVS);
+    if (pTree->nNodes > 0) {
+        Walk(&walk, 0, pFrustum ? CULL_ALL_PLANES : 0, eWalkBackToFront);
+    }
+    if (pStats) {
+        *pStats = walk.stats;
+    }
+}
+
+void BSPResetView(bsp_view* pView, const bsp_compiled* pTree) {
+    assert(pView && pTree);
+
+    // A range never covers less than a polygon, so drawing doesn't have to
+    // grow the range list
+    pView->aRanges.clear();
+    pView->aRanges.reserve(pTree->nPolygons);
+    pView->iCameraLeaf = -1;
+    BSPLeafPVS(&pView->pvs, pTree, -1);
+}
+
+void BSPDrawRangesOfView(
+    bsp_view* pView, const bsp_compiled* pTree, const vector4& vEye, const math::matrix4& matMVP,
+    bsp_cull_stats* pStats) {
+    bsp_frustum frustum;
+    int iLeaf;
+
+    assert(pView && pTree);
+
+    iLeaf = BSPPointInLeaf(pTree, vEye);
+    if (iLeaf >= 0 && pTree->pLeaves[iLeaf].contents != BSP_CONTENTS_EMPTY) {
+        // Inside a wall; draw everything
+        iLeaf = -1;
+    }
+    if (iLeaf != pView->iCameraLeaf) {
+        BSPLeafPVS(&pView->pvs, pTree, iLeaf);
+        pView->iCameraLeaf = iLeaf;
+    }
+
+    BSPFrustumFromMatrix(&frustum, matMVP);
+    pView->aRanges.clear();
+    BSPDrawRangesFrontToBack(&pView->aRanges, pTree, vEye, &frustum, &pView->pvs, pStats);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vector>
+#include "bsp_compiled.h"
+#include "bsp_vis.h"
+#include "util_matrix.h"
+
+#define BSP_FRUSTUM_PLANES (6)
+
+// Range of bsp_compiled::pIndices to draw
+struct bsp_draw_range {
+    uint32_t iFirstIndex;
+    uint32_t nIndices;
+};
+
+// Planes of a view frustum; points inside are in front of all of them
+struct bsp_frustum {
+    vector4 aPlanes[BSP_FRUSTUM_PLANES];
+};
+
+struct bsp_cull_stats {
+    // Nodes reached by the traversal
+    int nVisited;
+    // Nodes whose subtree was rejected by the frustum; included in nVisited
+    int nCulled;
+    // Nodes whose subtree was found to be entirely inside the frustum, so
+    // none of their descendants were tested
+    int nInside;
+    // Nodes whose subtree has no leaf in the visible set; included in
+    // nVisited
+    int nPVSCulled;
+};
+
+// Makes the frustum of a column-major model-view-projection matrix that
+// maps into the OpenGL clip volume
+void BSPFrustumFromMatrix(bsp_frustum* pOut, const math::matrix4& matMVP);
+
+// Appends the triangle ranges of every node of the tree to pRanges in the
+// order they should be drawn as seen from vEye. Ranges that follow each
+// other in the index list are merged into one.
+// If pFrustum is given, subtrees whose bounding box is outside of it are
+// skipped. If pPVS is given, so are subtrees without a leaf in the set, and
+// only the polygons of the set are drawn. pStats is optional and is
+// overwritten.
+void BSPDrawRangesFrontToBack(
+    std::vector<bsp_draw_range>* pRanges, const bsp_compiled* pTree, const vector4& vEye,
+    const bsp_frustum* pFrustum = NULL, const bsp_pvs* pPVS = NULL, bsp_cull_stats* pStats = NULL);
+void BSPDrawRangesBackToFront(
+    std::vector<bsp_draw_range>* pRanges, const bsp_compiled* pTree, const vector4& vEye,
+    const bsp_frustum* pFrustum = NULL, const bsp_pvs* pPVS = NULL, bsp_cull_stats* pStats = NULL);
+
+// What a renderer keeps between draws of a tree: the ranges of the last
+// draw and the visible set of the leaf the camera was last in
+struct bsp_view {
+    std::vector<bsp_draw_range> aRanges;
+    int iCameraLeaf;
+    bsp_pvs pvs;
+
+    bsp_view() : iCameraLeaf(-1) {
+    }
+};
+
+// Starts a view of pTree; to be called whenever another tree is drawn
+void BSPResetView(bsp_view* pView, const bsp_compiled* pTree);
+// Replaces pView->aRanges with the ranges to draw, front to back, from the
+// eye vEye through the frustum of matMVP, culled by the visible set of the
+// eye's leaf. The set is only looked up again when the eye changes
+// leaves; from inside a solid leaf everything is visible.
+void BSPDrawRangesOfView(
+    bsp_view* pView, const bsp_compiled* pTree, const vector4& vEye, const math::matrix4& matMVP,
+    bsp_cull_stats* pStats = NULL);
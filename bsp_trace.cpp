@@ -0,0 +1,682 @@
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <vector>
+#include "bsp_trace.h"
+
+// Points this close to the edge of a polygon still hit it
+#define TRACE_EPSILON (0.001f)
+// Number of traces in one task of a batch
+#define TRACE_GRAIN (256)
+// Hulls stop this far in front of the planes they touch
+#define HULL_DIST_EPSILON (0.001f)
+// Planes a slide move may hit before it gives up
+#define SLIDE_MAX_BUMPS (4)
+
+// State shared by one trace
+struct trace_walk {
+    const bsp_compiled* pTree;
+    vector4 vStart;
+    vector4 vDelta;
+    bsp_trace* pOut;
+};
+
+// State shared by one hull trace
+struct hull_walk {
+    const bsp_compiled* pTree;
+    const bsp_hull* pHull;
+    vector4 vStart;
+    vector4 vDelta;
+    // Fraction of the nearest contact found so far; nodes beyond it aren't
+    // visited
+    float flBest;
+    bsp_trace* pOut;
+    bool bHit;
+};
+
+// Whether a point on the plane of a convex polygon is inside of it
+static bool PointInPolygon(const bsp_compiled* pTree, uint32_t iPoly, const vector4& eq, const vector4& vPoint) {
+    auto& w = pTree->pWindings[iPoly];
+    auto pV = pTree->pVertices + w.iFirstVertex;
+    bool bPositive = false, bNegative = false;
+
+    // The point is inside if it is on the same side of every edge
+    for (int i = 0; i < w.nVertices && !(bPositive && bNegative); i++) {
+        auto& v0 = pV[i];
+        auto& v1 = pV[(i + 1) % w.nVertices];
+        vector4 vEdge(v1[0] - v0[0], v1[1] - v0[1], v1[2] - v0[2]);
+        vector4 vToPoint(vPoint[0] - v0[0], vPoint[1] - v0[1], vPoint[2] - v0[2]);
+        vector4 vCross = cross(vEdge, vToPoint);
+        float flSide = vCross[0] * eq[0] + vCross[1] * eq[1] + vCross[2] * eq[2];
+        float flTolerance = TRACE_EPSILON * sqrtf(vEdge[0] * vEdge[0] + vEdge[1] * vEdge[1] + vEdge[2] * vEdge[2]);
+        if (flSide > flTolerance) {
+            bPositive = true;
+        } else if (flSide < -flTolerance) {
+            bNegative = true;
+        }
+    }
+
+    return !(bPositive && bNegative);
+}
+
+// Tests the polygons of a node at the point where the segment crosses its
+// plane
+static bool HitNode(trace_walk* pWalk, const bsp_cnode* pNode, const vector4& eq, float flFraction, bool bFromBack) {
+    bool ret = false;
+    vector4 vPoint = pWalk->vStart + pWalk->vDelta * flFraction;
+
+    for (uint32_t i = 0; i < pNode->nPolygons && !ret; i++) {
+        if (PointInPolygon(pWalk->pTree, pNode->iFirstPolygon + i, eq, vPoint)) {
+            auto pOut = pWalk->pOut;
+            pOut->flFraction = flFraction;
+            pOut->vEndPoint = vPoint;
+            pOut->vNormal = bFromBack ? vector4(-eq[0], -eq[1], -eq[2]) : vector4(eq[0], eq[1], eq[2]);
+            pOut->iPolygon = (int)(pNode->iFirstPolygon + i);
+            ret = true;
+        }
+    }
+
+    return ret;
+}
+
+// Steps of a trace, kept on an explicit stack so that deep trees can't
+// overflow the call stack
+enum eTraceStep {
+    // Walk the part of the segment between flFraction1 and flFraction2
+    // through a subtree
+    eTraceVisit,
+    // Test the polygons of a node at flFraction1, hit from the front or
+    // the back
+    eTraceHitFront,
+    eTraceHitBack,
+};
+
+struct trace_item {
+    int32_t iNode;
+    float flFraction1;
+    float flFraction2;
+    eTraceStep step;
+};
+
+// Walks the segment through the tree nearest child first, so that the
+// first polygon hit is the nearest one
+static bool TraceNodes(trace_walk* pWalk) {
+    bool ret = false;
+    static thread_local std::vector<trace_item> aStack;
+
+    aStack.clear();
+    aStack.push_back({ 0, 0, 1, eTraceVisit });
+    while (aStack.size() > 0 && !ret) {
+        auto item = aStack.back();
+        aStack.pop_back();
+        if (item.iNode >= 0) {
+            auto pNode = &pWalk->pTree->pNodes[item.iNode];
+            auto eq = pWalk->pTree->PlaneEquation(pNode->hPlane);
+            if (item.step != eTraceVisit) {
+                ret = HitNode(pWalk, pNode, eq, item.flFraction1, item.step == eTraceHitBack);
+            } else {
+                // The distance is linear along the segment
+                float flDistStart = PlaneDistance(eq, pWalk->vStart);
+                float flDistDelta = PlaneDistance(eq, pWalk->vStart + pWalk->vDelta) - flDistStart;
+                float flDist1 = flDistStart + flDistDelta * item.flFraction1;
+                float flDist2 = flDistStart + flDistDelta * item.flFraction2;
+
+                if (flDist1 >= 0 && flDist2 >= 0) {
+                    aStack.push_back({ pNode->children[0], item.flFraction1, item.flFraction2, eTraceVisit });
+                } else if (flDist1 < 0 && flDist2 < 0) {
+                    aStack.push_back({ pNode->children[1], item.flFraction1, item.flFraction2, eTraceVisit });
+                } else {
+                    int iNear = (flDist1 >= 0) ? 0 : 1;
+                    float flMid = item.flFraction1 + (item.flFraction2 - item.flFraction1) * (flDist1 / (flDist1 - flDist2));
+
+                    // Popped as near child, node, far child
+                    aStack.push_back({ pNode->children[iNear ^ 1], flMid, item.flFraction2, eTraceVisit });
+                    aStack.push_back({ item.iNode, flMid, flMid, (iNear == 1) ? eTraceHitBack : eTraceHitFront });
+                    aStack.push_back({ pNode->children[iNear], item.flFraction1, flMid, eTraceVisit });
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+bool TraceSegment(bsp_trace* pOut, const bsp_compiled* pTree, const vector4& vStart, const vector4& vEnd) {
+    bool ret = false;
+    trace_walk walk;
+
+    assert(pOut && pTree);
+
+    pOut->flFraction = 1;
+    pOut->vEndPoint = vEnd;
+    pOut->vNormal = vector4();
+    pOut->iPolygon = -1;
+
+    if (pTree->nNodes > 0) {
+        walk.pTree = pTree;
+        walk.vStart = vStart;
+        walk.vDelta = vEnd - vStart;
+        walk.pOut = pOut;
+        ret = TraceNodes(&walk);
+    }
+
+    return ret;
+}
+
+bool TraceRay(bsp_trace* pOut, const bsp_compiled* pTree, const vector4& vOrigin, const vector4& vDir, float flMaxDistance) {
+    bool ret = false;
+    float flEnter = 0, flExit = flMaxDistance;
+
+    assert(pOut && pTree);
+    assert(flMaxDistance > 0);
+
+    pOut->flFraction = 1;
+    pOut->vEndPoint = vOrigin + vDir * flMaxDistance;
+    pOut->vNormal = vector4();
+    pOut->iPolygon = -1;
+
+    if (pTree->nNodes > 0) {
+        auto& root = pTree->pNodes[0];
+
+        // Cut the ray to the bounds of the tree
+        for (int i = 0; i < 3 && flEnter <= flExit; i++) {
+            float flMin = root.aflMins[i] - TRACE_EPSILON;
+            float flMax = root.aflMaxs[i] + TRACE_EPSILON;
+            if (vDir[i] != 0) {
+                float t0 = (flMin - vOrigin[i]) / vDir[i];
+                float t1 = (flMax - vOrigin[i]) / vDir[i];
+                if (t0 > t1) {
+                    float t = t0;
+                    t0 = t1;
+                    t1 = t;
+                }
+                if (t0 > flEnter) flEnter = t0;
+                if (t1 < flExit) flExit = t1;
+            } else if (vOrigin[i] < flMin || vOrigin[i] > flMax) {
+                flExit = -1;
+            }
+        }
+
+        if (flEnter <= flExit) {
+            ret = TraceSegment(pOut, pTree, vOrigin + vDir * flEnter, vOrigin + vDir * flExit);
+            if (ret) {
+                pOut->flFraction = (flEnter + (flExit - flEnter) * pOut->flFraction) / flMaxDistance;
+            } else {
+                pOut->flFraction = 1;
+                pOut->vEndPoint = vOrigin + vDir * flMaxDistance;
+            }
+        }
+    }
+
+    return ret;
+}
+
+// Runs fn(i) for i in [0, n), split among the threads of pPool if given
+template<typename F>
+static void RunBatch(CTaskPool* pPool, int n, F fn) {
+    if (pPool && n > TRACE_GRAIN) {
+        CTaskPool::task_group group;
+        for (int iBegin = 0; iBegin < n; iBegin += TRACE_GRAIN) {
+            int iEnd = (iBegin + TRACE_GRAIN < n) ? iBegin + TRACE_GRAIN : n;
+            pPool->Run(&group, [=]() {
+                for (int i = iBegin; i < iEnd; i++) {
+                    fn(i);
+                }
+            });
+        }
+        pPool->Wait(&group);
+    } else {
+        for (int i = 0; i < n; i++) {
+            fn(i);
+        }
+    }
+}
+
+void TraceSegments(
+    bsp_trace* pOut, const bsp_compiled* pTree, const bsp_segment* pSegments, int nSegments,
+    CTaskPool* pPool) {
+    assert(pOut && pTree);
+    assert(pSegments || nSegments == 0);
+
+    RunBatch(pPool, nSegments, [=](int i) {
+        TraceSegment(&pOut[i], pTree, pSegments[i].vStart, pSegments[i].vEnd);
+    });
+}
+
+void MakeBoxHull(bsp_hull* pOut, const vector4& vExtents) {
+    assert(pOut);
+    pOut->shape = eBSPHullBox;
+    pOut->vExtents = vector4(vExtents[0], vExtents[1], vExtents[2]);
+    pOut->flRadius = 0;
+}
+
+void MakeSphereHull(bsp_hull* pOut, float flRadius) {
+    assert(pOut);
+    pOut->shape = eBSPHullSphere;
+    pOut->vExtents = vector4(flRadius, flRadius, flRadius);
+    pOut->flRadius = flRadius;
+}
+
+// How far the hull reaches along a unit vector
+static float HullExtent(const bsp_hull* pHull, float x, float y, float z) {
+    float ret;
+
+    if (pHull->shape == eBSPHullSphere) {
+        ret = pHull->flRadius;
+    } else {
+        ret = fabsf(x) * pHull->vExtents[0] + fabsf(y) * pHull->vExtents[1] + fabsf(z) * pHull->vExtents[2];
+    }
+
+    return ret;
+}
+
+static float Dot3(const vector4& lhs, const vector4& rhs) {
+    return lhs[0] * rhs[0] + lhs[1] * rhs[1] + lhs[2] * rhs[2];
+}
+
+// Whether the box swept by the hull up to the nearest contact overlaps the
+// bounds of a node
+static bool HullTouchesBounds(const hull_walk* pWalk, const bsp_cnode* pNode) {
+    bool ret = true;
+    vector4 vEnd = pWalk->vStart + pWalk->vDelta * pWalk->flBest;
+
+    for (int i = 0; i < 3 && ret; i++) {
+        float flMin = (pWalk->vStart[i] < vEnd[i]) ? pWalk->vStart[i] : vEnd[i];
+        float flMax = (pWalk->vStart[i] < vEnd[i]) ? vEnd[i] : pWalk->vStart[i];
+        ret = flMax + pWalk->pHull->vExtents[i] >= pNode->aflMins[i] &&
+            flMin - pWalk->pHull->vExtents[i] <= pNode->aflMaxs[i];
+    }
+
+    return ret;
+}
+
+static void RecordHullHit(hull_walk* pWalk, uint32_t iPoly, float flFraction, const vector4& vNormal) {
+    auto pOut = pWalk->pOut;
+    pWalk->flBest = flFraction;
+    pWalk->bHit = true;
+    pOut->flFraction = flFraction;
+    pOut->vEndPoint = pWalk->vStart + pWalk->vDelta * flFraction;
+    pOut->vNormal = vNormal;
+    pOut->iPolygon = (int)iPoly;
+}
+
+// Clipping of the sweep of a point against a convex volume given as the
+// half-spaces N.P <= flDist
+struct hull_clip {
+    float flEnter;
+    float flEnterFraction;
+    float flExit;
+    float flShallow;
+    vector4 vEnterNormal;
+    vector4 vShallowNormal;
+    bool bStartOut;
+    bool bMiss;
+};
+
+static void ClipHullPlane(hull_clip* pClip, const hull_walk* pWalk, const vector4& N, float flDist) {
+    float d1 = Dot3(N, pWalk->vStart) - flDist;
+    float d2 = d1 + Dot3(N, pWalk->vDelta);
+
+    if (d1 > 0) {
+        pClip->bStartOut = true;
+        if (d2 >= 0) {
+            pClip->bMiss = true;
+        } else if (d1 / (d1 - d2) > pClip->flEnter) {
+            pClip->flEnter = d1 / (d1 - d2);
+            pClip->flEnterFraction = (d1 > HULL_DIST_EPSILON) ? (d1 - HULL_DIST_EPSILON) / (d1 - d2) : 0;
+            pClip->vEnterNormal = N;
+        }
+    } else {
+        if (d2 > 0 && d1 / (d1 - d2) < pClip->flExit) {
+            pClip->flExit = d1 / (d1 - d2);
+        }
+        if (d1 > pClip->flShallow) {
+            pClip->flShallow = d1;
+            pClip->vShallowNormal = N;
+        }
+    }
+}
+
+// Adds the half-space of the box swept over the polygon on the side N
+static void ClipHullSupport(hull_clip* pClip, const hull_walk* pWalk, const vector4* pV, int nVertices, const vector4& N) {
+    float flSupport = -FLT_MAX;
+    for (int i = 0; i < nVertices; i++) {
+        float flDist = Dot3(N, pV[i]);
+        if (flDist > flSupport) {
+            flSupport = flDist;
+        }
+    }
+    ClipHullPlane(pClip, pWalk, N, flSupport + HullExtent(pWalk->pHull, N[0], N[1], N[2]));
+}
+
+// Sweeps a box against a polygon. The box swept over the polygon is bounded
+// by the planes of the polygon, the planes of the box and the planes through
+// an edge of each, all moved out to touch it.
+static void HullPolygonBox(hull_walk* pWalk, uint32_t iPoly, const vector4& eq) {
+    auto& w = pWalk->pTree->pWindings[iPoly];
+    auto pV = pWalk->pTree->pVertices + w.iFirstVertex;
+    hull_clip clip;
+
+    clip.flEnter = -1;
+    clip.flEnterFraction = 0;
+    clip.flExit = 1;
+    clip.flShallow = -FLT_MAX;
+    clip.bStartOut = false;
+    clip.bMiss = false;
+
+    for (int iSign = 0; iSign < 2 && !clip.bMiss; iSign++) {
+        float flSign = iSign ? -1.0f : 1.0f;
+        ClipHullSupport(&clip, pWalk, pV, w.nVertices, vector4(flSign * eq[0], flSign * eq[1], flSign * eq[2]));
+        for (int iAxis = 0; iAxis < 3 && !clip.bMiss; iAxis++) {
+            vector4 N;
+            N.v[iAxis] = flSign;
+            ClipHullSupport(&clip, pWalk, pV, w.nVertices, N);
+        }
+    }
+    for (int i = 0; i < w.nVertices && !clip.bMiss; i++) {
+        auto& v0 = pV[i];
+        auto& v1 = pV[(i + 1) % w.nVertices];
+        vector4 vEdge(v1[0] - v0[0], v1[1] - v0[1], v1[2] - v0[2]);
+        for (int iAxis = 0; iAxis < 3 && !clip.bMiss; iAxis++) {
+            vector4 vAxis;
+            vAxis.v[iAxis] = 1;
+            vector4 N = cross(vEdge, vAxis);
+            float flLength = sqrtf(Dot3(N, N));
+            if (flLength > TRACE_EPSILON) {
+                N = N / flLength;
+                ClipHullSupport(&clip, pWalk, pV, w.nVertices, N);
+                ClipHullSupport(&clip, pWalk, pV, w.nVertices, N * -1.0f);
+            }
+        }
+    }
+
+    if (!clip.bMiss && !clip.bStartOut) {
+        // Starts inside; only stopped if moving in through the closest side
+        if (Dot3(pWalk->vDelta, clip.vShallowNormal) < 0) {
+            clip.flEnter = 0;
+            clip.flEnterFraction = 0;
+            clip.vEnterNormal = clip.vShallowNormal;
+        } else {
+            clip.bMiss = true;
+        }
+    }
+
+    if (!clip.bMiss && clip.flEnter <= clip.flExit && clip.flEnterFraction < pWalk->flBest) {
+        RecordHullHit(pWalk, iPoly, clip.flEnterFraction, clip.vEnterNormal);
+    }
+}
+
+static vector4 ClosestPointOnSegment(const vector4& vPoint, const vector4& v0, const vector4& v1) {
+    vector4 vEdge = v1 - v0;
+    float flLengthSq = Dot3(vEdge, vEdge);
+    float t = (flLengthSq > 0) ? Dot3(vPoint - v0, vEdge) / flLengthSq : 0;
+
+    if (t < 0) t = 0;
+    if (t > 1) t = 1;
+
+    return v0 + vEdge * t;
+}
+
+static vector4 ClosestPointOnPolygon(const bsp_compiled* pTree, uint32_t iPoly, const vector4& eq, const vector4& vPoint) {
+    vector4 ret = vPoint - vector4(eq[0], eq[1], eq[2]) * PlaneDistance(eq, vPoint);
+
+    if (!PointInPolygon(pTree, iPoly, eq, ret)) {
+        auto& w = pTree->pWindings[iPoly];
+        auto pV = pTree->pVertices + w.iFirstVertex;
+        float flBest = FLT_MAX;
+        vector4 vProjected = ret;
+        for (int i = 0; i < w.nVertices; i++) {
+            vector4 vClosest = ClosestPointOnSegment(vProjected, pV[i], pV[(i + 1) % w.nVertices]);
+            vector4 vOffset = vPoint - vClosest;
+            if (Dot3(vOffset, vOffset) < flBest) {
+                flBest = Dot3(vOffset, vOffset);
+                ret = vClosest;
+            }
+        }
+    }
+
+    return ret;
+}
+
+// Smallest root of a t^2 + 2 b t + c = 0 for a point approaching from
+// outside (c > 0, b < 0); returns false if there is none
+static bool FirstRoot(float* pT, float a, float b, float c) {
+    bool ret = false;
+    float flDisc = b * b - a * c;
+
+    if (a > 0 && c > 0 && b < 0 && flDisc >= 0) {
+        *pT = (-b - sqrtf(flDisc)) / a;
+        ret = true;
+    }
+
+    return ret;
+}
+
+// Sweeps a sphere against a polygon: against its face, the cylinders around
+// its edges and the spheres around its vertices
+static void HullPolygonSphere(hull_walk* pWalk, uint32_t iPoly, const vector4& eq) {
+    auto& w = pWalk->pTree->pWindings[iPoly];
+    auto pV = pWalk->pTree->pVertices + w.iFirstVertex;
+    float r = pWalk->pHull->flRadius;
+    auto& S = pWalk->vStart;
+    auto& D = pWalk->vDelta;
+    vector4 vClosest = ClosestPointOnPolygon(pWalk->pTree, iPoly, eq, S);
+    vector4 vOffset = S - vClosest;
+    float flContact = FLT_MAX;
+
+    if (Dot3(vOffset, vOffset) <= r * r) {
+        // Starts touching; only stopped if moving closer
+        if (Dot3(D, vOffset) < 0) {
+            float flLength = sqrtf(Dot3(vOffset, vOffset));
+            vector4 N = (flLength > TRACE_EPSILON) ? vOffset / flLength : vector4(eq[0], eq[1], eq[2]) * ((PlaneDistance(eq, S) >= 0) ? 1.0f : -1.0f);
+            if (0 < pWalk->flBest) {
+                RecordHullHit(pWalk, iPoly, 0, N);
+            }
+        }
+    } else {
+        float flDD = Dot3(D, D);
+        float flDist1 = PlaneDistance(eq, S);
+        float flSide = (flDist1 >= 0) ? 1.0f : -1.0f;
+        float flApproach = -flSide * Dot3(D, vector4(eq[0], eq[1], eq[2]));
+        float t;
+
+        // Face
+        if (flApproach > 0 && flSide * flDist1 > r) {
+            t = (flSide * flDist1 - r) / flApproach;
+            vector4 vTouch = S + D * t - vector4(eq[0], eq[1], eq[2]) * (flSide * r);
+            if (t <= 1 && PointInPolygon(pWalk->pTree, iPoly, eq, vTouch)) {
+                flContact = t;
+            }
+        }
+
+        for (int i = 0; i < w.nVertices; i++) {
+            auto& v0 = pV[i];
+            auto& v1 = pV[(i + 1) % w.nVertices];
+            vector4 m = S - v0;
+            vector4 E(v1[0] - v0[0], v1[1] - v0[1], v1[2] - v0[2]);
+            float flEE = Dot3(E, E), flMD = Dot3(m, D), flME = Dot3(m, E), flDE = Dot3(D, E);
+
+            // Vertex
+            if (FirstRoot(&t, flDD, flMD, Dot3(m, m) - r * r) && t < flContact) {
+                flContact = t;
+            }
+            // Edge, within the ends of the segment
+            if (FirstRoot(&t, flEE * flDD - flDE * flDE, flEE * flMD - flDE * flME, flEE * (Dot3(m, m) - r * r) - flME * flME) && t < flContact) {
+                float flAlong = (flME + t * flDE) / flEE;
+                if (flAlong >= 0 && flAlong <= 1) {
+                    flContact = t;
+                }
+            }
+        }
+
+        if (flContact <= 1) {
+            vector4 vCenter = S + D * flContact;
+            vector4 N = vCenter - ClosestPointOnPolygon(pWalk->pTree, iPoly, eq, vCenter);
+            float flLength = sqrtf(Dot3(N, N));
+            N = (flLength > TRACE_EPSILON) ? N / flLength : vector4(flSide * eq[0], flSide * eq[1], flSide * eq[2]);
+            // Back off along the normal
+            float flSpeed = -Dot3(D, N);
+            float flFraction = (flSpeed > HULL_DIST_EPSILON) ? flContact - HULL_DIST_EPSILON / flSpeed : flContact;
+            if (flFraction < 0) {
+                flFraction = 0;
+            }
+            if (flFraction < pWalk->flBest) {
+                RecordHullHit(pWalk, iPoly, flFraction, N);
+            }
+        }
+    }
+}
+
+// Tests the polygons of a node if the sweep comes close enough to its plane
+static void HullNodePolygons(hull_walk* pWalk, const bsp_cnode* pNode, const vector4& eq, float flExtent) {
+    float flDist1 = PlaneDistance(eq, pWalk->vStart);
+    float flDist2 = PlaneDistance(eq, pWalk->vStart + pWalk->vDelta * pWalk->flBest);
+
+    if (!(flDist1 > flExtent && flDist2 > flExtent) && !(flDist1 < -flExtent && flDist2 < -flExtent)) {
+        for (uint32_t i = 0; i < pNode->nPolygons; i++) {
+            if (pWalk->pHull->shape == eBSPHullSphere) {
+                HullPolygonSphere(pWalk, pNode->iFirstPolygon + i, eq);
+            } else {
+                HullPolygonBox(pWalk, pNode->iFirstPolygon + i, eq);
+            }
+        }
+    }
+}
+
+// Steps of a hull trace, kept on an explicit stack
+enum eHullStep {
+    // Visit a node if its bounds are touched
+    eHullVisit,
+    // Test the polygons of a node
+    eHullPolygons,
+    // Visit child iChild of a node if the sweep reaches its side of the
+    // plane; tested when popped, as the nearest contact may have moved
+    eHullChild,
+};
+
+struct hull_item {
+    int32_t iNode;
+    int iChild;
+    eHullStep step;
+};
+
+// Visits the nodes the hull may touch before the nearest contact found so
+// far, nearest child first
+static void HullNodes(hull_walk* pWalk) {
+    static thread_local std::vector<hull_item> aStack;
+
+    aStack.clear();
+    aStack.push_back({ 0, 0, eHullVisit });
+    while (aStack.size() > 0) {
+        auto item = aStack.back();
+        aStack.pop_back();
+        if (item.iNode >= 0) {
+            auto pNode = &pWalk->pTree->pNodes[item.iNode];
+            if (item.step == eHullVisit) {
+                if (HullTouchesBounds(pWalk, pNode)) {
+                    int iNear = (PlaneDistance(pWalk->pTree->PlaneEquation(pNode->hPlane), pWalk->vStart) >= 0) ? 0 : 1;
+                    aStack.push_back({ item.iNode, iNear ^ 1, eHullChild });
+                    aStack.push_back({ item.iNode, 0, eHullPolygons });
+                    aStack.push_back({ item.iNode, iNear, eHullChild });
+                }
+            } else {
+                auto eq = pWalk->pTree->PlaneEquation(pNode->hPlane);
+                float flExtent = HullExtent(pWalk->pHull, eq[0], eq[1], eq[2]);
+                if (item.step == eHullPolygons) {
+                    HullNodePolygons(pWalk, pNode, eq, flExtent);
+                } else {
+                    float flDist1 = PlaneDistance(eq, pWalk->vStart);
+                    float flDist2 = PlaneDistance(eq, pWalk->vStart + pWalk->vDelta * pWalk->flBest);
+                    bool bTouches = (item.iChild == 0) ?
+                        (flDist1 > -flExtent || flDist2 > -flExtent) :
+                        (flDist1 < flExtent || flDist2 < flExtent);
+                    if (bTouches) {
+                        aStack.push_back({ pNode->children[item.iChild], 0, eHullVisit });
+                    }
+                }
+            }
+        }
+    }
+}
+
+bool TraceHull(bsp_trace* pOut, const bsp_compiled* pTree, const bsp_hull* pHull, const vector4& vStart, const vector4& vEnd) {
+    hull_walk walk;
+
+    assert(pOut && pTree && pHull);
+
+    pOut->flFraction = 1;
+    pOut->vEndPoint = vEnd;
+    pOut->vNormal = vector4();
+    pOut->iPolygon = -1;
+
+    walk.pTree = pTree;
+    walk.pHull = pHull;
+    walk.vStart = vStart;
+    walk.vDelta = vEnd - vStart;
+    walk.flBest = 1;
+    walk.pOut = pOut;
+    walk.bHit = false;
+    if (pTree->nNodes > 0) {
+        HullNodes(&walk);
+    }
+
+    return walk.bHit;
+}
+
+void TraceHulls(bsp_trace* pOut, const bsp_compiled* pTree, const bsp_sweep* pSweeps, int nSweeps, CTaskPool* pPool) {
+    assert(pOut && pTree);
+    assert(pSweeps || nSweeps == 0);
+
+    RunBatch(pPool, nSweeps, [=](int i) {
+        TraceHull(&pOut[i], pTree, pSweeps[i].pHull, pSweeps[i].vStart, pSweeps[i].vEnd);
+    });
+}
+
+bool SlideMove(vector4* pEnd, const bsp_compiled* pTree, const bsp_hull* pHull, const vector4& vStart, const vector4& vDelta) {
+    bool ret = false;
+    vector4 vPos = vStart;
+    vector4 vMove(vDelta[0], vDelta[1], vDelta[2]);
+    vector4 aNormals[SLIDE_MAX_BUMPS];
+    bsp_trace trace;
+
+    assert(pEnd && pTree && pHull);
+
+    for (int iBump = 0; iBump < SLIDE_MAX_BUMPS && Dot3(vMove, vMove) > HULL_DIST_EPSILON * HULL_DIST_EPSILON; iBump++) {
+        if (!TraceHull(&trace, pTree, pHull, vPos, vPos + vMove)) {
+            vPos = vPos + vMove;
+            break;
+        }
+        ret = true;
+        vPos = trace.vEndPoint;
+        vMove = vMove * (1 - trace.flFraction);
+
+        // Slide along the plane; if that goes into a plane hit before,
+        // follow the crease between the two, and stop in a corner
+        auto& N = trace.vNormal;
+        vector4 vRemaining = vMove;
+        aNormals[iBump] = N;
+        vMove = vRemaining - N * Dot3(vRemaining, N);
+        for (int i = 0; i < iBump; i++) {
+            if (Dot3(vMove, aNormals[i]) < 0) {
+                vector4 vCrease = cross(aNormals[i], N);
+                float flLength = sqrtf(Dot3(vCrease, vCrease));
+                if (flLength > TRACE_EPSILON) {
+                    vCrease = vCrease / flLength;
+                    vMove = vCrease * Dot3(vCrease, vRemaining);
+                } else {
+                    vMove = vector4();
+                }
+                for (int j = 0; j < iBump; j++) {
+                    if (j != i && Dot3(vMove, aNormals[j]) < 0) {
+                        vMove = vector4();
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    *pEnd = vPos;
+
+    return ret;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "bsp_compiled.h"
+#include "util_taskpool.h"
+
+// Result of a trace
+struct bsp_trace {
+    // Part of the segment before the first hit; 1 if nothing was hit
+    float flFraction;
+    // Point of the hit, or the end of the segment
+    vector4 vEndPoint;
+    // Normal of the plane that was hit, facing the start of the segment
+    vector4 vNormal;
+    // Polygon of bsp_compiled that was hit; -1 if nothing was hit
+    int iPolygon;
+};
+
+struct bsp_segment {
+    vector4 vStart;
+    vector4 vEnd;
+};
+
+enum eBSPHull {
+    eBSPHullBox,
+    eBSPHullSphere,
+};
+
+// Shape swept by TraceHull, centered on the traced segment
+struct bsp_hull {
+    eBSPHull shape;
+    // Half sizes of an axis-aligned box
+    vector4 vExtents;
+    float flRadius;
+};
+
+struct bsp_sweep {
+    vector4 vStart;
+    vector4 vEnd;
+    const bsp_hull* pHull;
+};
+
+// Finds the first polygon the segment crosses. Both sides of the polygons
+// are solid. Returns true if something was hit.
+bool TraceSegment(bsp_trace* pOut, const bsp_compiled* pTree, const vector4& vStart, const vector4& vEnd);
+// Traces from vOrigin along vDir for at most flMaxDistance lengths of vDir;
+// flFraction of the result is relative to flMaxDistance. Only the part of
+// the ray inside the bounds of the tree is walked, so flMaxDistance may be
+// as large as needed.
+bool TraceRay(bsp_trace* pOut, const bsp_compiled* pTree, const vector4& vOrigin, const vector4& vDir, float flMaxDistance);
+
+// Traces nSegments segments into pOut. If pPool is given, the segments are
+// split among its threads; the tree is only read.
+void TraceSegments(
+    bsp_trace* pOut, const bsp_compiled* pTree, const bsp_segment* pSegments, int nSegments,
+    CTaskPool* pPool = NULL);
+
+void MakeBoxHull(bsp_hull* pOut, const vector4& vExtents);
+void MakeSphereHull(bsp_hull* pOut, float flRadius);
+
+// Sweeps a hull from vStart to vEnd and finds the first polygon it touches.
+// Boxes are traced as their center against every polygon grown by the box:
+// the planes of the polygon, of the box and through an edge of each, moved
+// out by the extent of the box along their normals. Spheres are traced
+// against the face, edges and vertices of the polygons. vEndPoint of the
+// result is where the center stops, a little before the contact, and
+// vNormal faces away from the contact. A hull that starts touching a
+// polygon is only stopped by it if it moves further in.
+bool TraceHull(bsp_trace* pOut, const bsp_compiled* pTree, const bsp_hull* pHull, const vector4& vStart, const vector4& vEnd);
+// Traces nSweeps sweeps into pOut; see TraceSegments
+void TraceHulls(bsp_trace* pOut, const bsp_compiled* pTree, const bsp_sweep* pSweeps, int nSweeps, CTaskPool* pPool = NULL);
+
+// Moves a hull by vDelta, sliding along the polygons it touches, and
+// stores where it stops in pEnd. Returns true if anything was touched.
+bool SlideMove(vector4* pEnd, const bsp_compiled* pTree, const bsp_hull* pHull, const vector4& vStart, const vector4& vDelta);
@@ -0,0 +1,743 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include "bsp_vis.h"
+#include "util_taskpool.h"
+
+#define VIS_EPSILON (0.001f)
+// Portals smaller than this are dropped
+#define VIS_MIN_PORTAL_AREA (0.0001f)
+// Clipping adds at most one point per plane; windings that would grow
+// beyond this are left unclipped, which only makes more leaves visible
+#define VIS_MAX_POINTS (32)
+// Space is cut off this far beyond the polygons of the tree
+#define VIS_WORLD_MARGIN (1.0f)
+// Number of portals in one task of the flow
+#define VIS_FLOW_GRAIN (8)
+// Number of portals flowed at once. Flows only use the results of earlier
+// waves, so the size of a wave trades pruning for parallelism; it doesn't
+// depend on the thread count, so neither does the result.
+#define VIS_FLOW_WAVE (64)
+
+struct vis_winding {
+    int nPoints;
+    vector4 aPoints[VIS_MAX_POINTS];
+};
+
+// One direction of a portal; the normal of its plane points into iLeafTo
+struct vis_portal {
+    int iLeafFrom;
+    int iLeafTo;
+    vector4 plane;
+    vis_winding w;
+};
+
+struct vis_graph {
+    const bsp_compiled* pTree;
+    std::vector<vis_portal> aPortals;
+    // Portals leading out of every leaf
+    std::vector<std::vector<int>> aLeafPortals;
+    int nWords;
+    // Leaves that might be seen through every portal and those that are
+    // seen through them, nWords each
+    std::vector<uint64_t> aMightSee;
+    std::vector<uint64_t> aVis;
+    // Portals whose flow finished in an earlier wave; their vis replaces
+    // their might-see in later flows
+    std::vector<uint8_t> aDone;
+};
+
+// State of one portal on the path of a flow
+struct vis_frame {
+    vis_winding source;
+    vis_winding pass;
+    bool bPass;
+    vector4 portalPlane;
+    std::vector<uint64_t> aMightSee;
+};
+
+static bool TestBit(const uint64_t* pBits, int i) {
+    return (pBits[i >> 6] >> (i & 63)) & 1;
+}
+
+static void SetBit(uint64_t* pBits, int i) {
+    pBits[i >> 6] |= (uint64_t)1 << (i & 63);
+}
+
+static vector4 FlipPlane(const vector4& eq) {
+    return vector4(-eq[0], -eq[1], -eq[2], -eq[3]);
+}
+
+// Keeps the part of a winding in front of a plane; returns false if
+// nothing is in front. pOut may be &in.
+static bool ClipWinding(vis_winding* pOut, const vis_winding& in, const vector4& eq) {
+    bool ret = false;
+    float aflDists[VIS_MAX_POINTS];
+    int aSides[VIS_MAX_POINTS];
+    int nFront = 0, nBack = 0;
+
+    for (int i = 0; i < in.nPoints; i++) {
+        aflDists[i] = PlaneDistance(eq, in.aPoints[i]);
+        if (aflDists[i] > VIS_EPSILON) {
+            aSides[i] = SIDE_FRONT;
+            nFront++;
+        } else if (aflDists[i] < -VIS_EPSILON) {
+            aSides[i] = SIDE_BACK;
+            nBack++;
+        } else {
+            aSides[i] = SIDE_ON;
+        }
+    }
+
+    if (nFront > 0 && nBack == 0) {
+        if (pOut != &in) {
+            *pOut = in;
+        }
+        ret = true;
+    } else if (nFront > 0) {
+        vis_winding out;
+        bool bOverflow = false;
+
+        out.nPoints = 0;
+        for (int i = 0; i < in.nPoints && !bOverflow; i++) {
+            int j = (i + 1) % in.nPoints;
+            if (aSides[i] != SIDE_BACK) {
+                bOverflow = out.nPoints == VIS_MAX_POINTS;
+                if (!bOverflow) {
+                    out.aPoints[out.nPoints++] = in.aPoints[i];
+                }
+            }
+            if (!bOverflow && aSides[i] != SIDE_ON && aSides[j] != SIDE_ON && aSides[i] != aSides[j]) {
+                bOverflow = out.nPoints == VIS_MAX_POINTS;
+                if (!bOverflow) {
+                    float t = aflDists[i] / (aflDists[i] - aflDists[j]);
+                    out.aPoints[out.nPoints++] = in.aPoints[i] + (in.aPoints[j] - in.aPoints[i]) * t;
+                }
+            }
+        }
+
+        if (!bOverflow) {
+            *pOut = out;
+        } else if (pOut != &in) {
+            *pOut = in;
+        }
+        ret = true;
+    }
+
+    return ret;
+}
+
+static float WindingArea(const vis_winding& w) {
+    vector4 sum;
+    for (int i = 2; i < w.nPoints; i++) {
+        sum = sum + cross(w.aPoints[i - 1] - w.aPoints[0], w.aPoints[i] - w.aPoints[0]);
+    }
+    return 0.5f * sqrtf(sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2]);
+}
+
+// A square on the plane that covers the box
+static void BaseWinding(vis_winding* pOut, const vector4& eq, const float* aflMins, const float* aflMaxs) {
+    int iMajor = 0;
+    float flSize = 0;
+    vector4 N(eq[0], eq[1], eq[2], 0);
+    vector4 vUp, vRight, vOrigin;
+
+    for (int i = 0; i < 3; i++) {
+        if (fabsf(N[i]) > fabsf(N[iMajor])) {
+            iMajor = i;
+        }
+        flSize += aflMaxs[i] - aflMins[i];
+    }
+    if (iMajor == 2) {
+        vUp = vector4(1, 0, 0, 0);
+    } else {
+        vUp = vector4(0, 0, 1, 0);
+    }
+    vUp = normalize(vUp - N * (vUp[0] * N[0] + vUp[1] * N[1] + vUp[2] * N[2]));
+    vRight = cross(vUp, N);
+    vOrigin = N * -eq[3];
+    vUp = vUp * flSize;
+    vRight = vRight * flSize;
+
+    pOut->nPoints = 4;
+    pOut->aPoints[0] = vOrigin - vRight + vUp;
+    pOut->aPoints[1] = vOrigin + vRight + vUp;
+    pOut->aPoints[2] = vOrigin + vRight - vUp;
+    pOut->aPoints[3] = vOrigin - vRight - vUp;
+}
+
+struct portal_piece {
+    int iLeaf;
+    vis_winding w;
+};
+
+// A winding left to cut into the subtree of iChild
+struct filter_item {
+    int32_t iChild;
+    vis_winding w;
+};
+
+// Cuts a winding into the pieces lying in the empty leaves of a subtree.
+// side is the plane the winding lies on, facing into the subtree; it picks
+// the child of nodes that have the winding on their plane. The subtrees
+// are visited front first from an explicit stack.
+static void FilterPortal(std::vector<portal_piece>* pPieces, const bsp_compiled* pTree, int32_t iChild, const vis_winding& w, const vector4& side) {
+    static thread_local std::vector<filter_item> aStack;
+
+    aStack.clear();
+    aStack.push_back({ iChild, w });
+    while (aStack.size() > 0) {
+        auto item = aStack.back();
+        aStack.pop_back();
+        if (item.iChild >= 0) {
+            auto& node = pTree->pNodes[item.iChild];
+            auto eq = pTree->PlaneEquation(node.hPlane);
+            filter_item front, back;
+            bool bFront = ClipWinding(&front.w, item.w, eq);
+            if (ClipWinding(&back.w, item.w, FlipPlane(eq))) {
+                back.iChild = node.children[1];
+                aStack.push_back(back);
+            } else if (!bFront) {
+                float flDot = eq[0] * side[0] + eq[1] * side[1] + eq[2] * side[2];
+                aStack.push_back({ node.children[(flDot > 0) ? 0 : 1], item.w });
+            }
+            if (bFront) {
+                front.iChild = node.children[0];
+                aStack.push_back(front);
+            }
+        } else if (item.iChild != BSP_NO_CHILD) {
+            int iLeaf = BSP_CHILD_LEAF(item.iChild);
+            if (pTree->pLeaves[iLeaf].contents == BSP_CONTENTS_EMPTY) {
+                pPieces->push_back({ iLeaf, item.w });
+            }
+        }
+    }
+}
+
+static void AddPortal(vis_graph* pGraph, int iFrontLeaf, int iBackLeaf, const vector4& eq, const vis_winding& w) {
+    vis_portal portal;
+
+    portal.w = w;
+
+    portal.iLeafFrom = iFrontLeaf;
+    portal.iLeafTo = iBackLeaf;
+    portal.plane = FlipPlane(eq);
+    pGraph->aLeafPortals[iFrontLeaf].push_back((int)pGraph->aPortals.size());
+    pGraph->aPortals.push_back(portal);
+
+    portal.iLeafFrom = iBackLeaf;
+    portal.iLeafTo = iFrontLeaf;
+    portal.plane = eq;
+    pGraph->aLeafPortals[iBackLeaf].push_back((int)pGraph->aPortals.size());
+    pGraph->aPortals.push_back(portal);
+}
+
+// A node whose cell is bounded by the front sides of the first nClip
+// planes of the clip list; the last of them is clip
+struct portal_item {
+    int32_t iNode;
+    size_t nClip;
+    vector4 clip;
+};
+
+// Makes the portals on the plane of every node, walking the tree depth
+// first from an explicit stack
+static void MakeNodePortals(vis_graph* pGraph, std::vector<vector4>* pClip) {
+    auto pTree = pGraph->pTree;
+    std::vector<portal_item> aStack;
+    std::vector<portal_piece> aFront, aBack;
+
+    aStack.push_back({ 0, pClip->size(), pClip->back() });
+    while (aStack.size() > 0) {
+        auto item = aStack.back();
+        aStack.pop_back();
+
+        auto& node = pTree->pNodes[item.iNode];
+        auto eq = pTree->PlaneEquation(node.hPlane);
+        vis_winding w;
+        bool bValid = true;
+
+        pClip->resize(item.nClip - 1);
+        pClip->push_back(item.clip);
+
+        BaseWinding(&w, eq, pTree->pNodes[0].aflMins, pTree->pNodes[0].aflMaxs);
+        for (size_t i = 0; i < pClip->size() && bValid; i++) {
+            bValid = ClipWinding(&w, w, (*pClip)[i]);
+        }
+
+        if (bValid) {
+            aFront.clear();
+            FilterPortal(&aFront, pTree, node.children[0], w, eq);
+            for (auto& front : aFront) {
+                aBack.clear();
+                FilterPortal(&aBack, pTree, node.children[1], front.w, FlipPlane(eq));
+                for (auto& back : aBack) {
+                    if (WindingArea(back.w) >= VIS_MIN_PORTAL_AREA) {
+                        AddPortal(pGraph, front.iLeaf, back.iLeaf, eq, back.w);
+                    }
+                }
+            }
+        }
+
+        // Popped front first
+        for (int iChild = 1; iChild >= 0; iChild--) {
+            if (node.children[iChild] >= 0) {
+                aStack.push_back({ node.children[iChild], item.nClip + 1, (iChild == 0) ? eq : FlipPlane(eq) });
+            }
+        }
+    }
+}
+
+static void MakePortals(vis_graph* pGraph) {
+    std::vector<vector4> aClip;
+    auto& root = pGraph->pTree->pNodes[0];
+
+    // The box around the world
+    for (int i = 0; i < 3; i++) {
+        vector4 N;
+        N.v[i] = 1;
+        N.v[3] = -(root.aflMins[i] - VIS_WORLD_MARGIN);
+        aClip.push_back(N);
+        N.v[i] = -1;
+        N.v[3] = root.aflMaxs[i] + VIS_WORLD_MARGIN;
+        aClip.push_back(N);
+    }
+
+    MakeNodePortals(pGraph, &aClip);
+}
+
+// Whether q may be seen through p: q has a point in front of p and p has
+// a point behind q
+static bool PortalInFront(const vis_portal& p, const vis_portal& q) {
+    bool bFront = false, bBack = false;
+
+    for (int i = 0; i < q.w.nPoints && !bFront; i++) {
+        bFront = PlaneDistance(p.plane, q.w.aPoints[i]) > VIS_EPSILON;
+    }
+    for (int i = 0; i < p.w.nPoints && bFront && !bBack; i++) {
+        bBack = PlaneDistance(q.plane, p.w.aPoints[i]) < -VIS_EPSILON;
+    }
+
+    return bFront && bBack;
+}
+
+// Floods the leaves reachable from portal iPortal through portals that
+// pass the plane tests
+static void BasePortalVis(vis_graph* pGraph, int iPortal, std::vector<int>* pStack) {
+    auto& p = pGraph->aPortals[iPortal];
+    auto pMight = &pGraph->aMightSee[(size_t)iPortal * pGraph->nWords];
+
+    pStack->clear();
+    pStack->push_back(p.iLeafTo);
+    SetBit(pMight, p.iLeafTo);
+    while (pStack->size() > 0) {
+        int iLeaf = pStack->back();
+        pStack->pop_back();
+        for (int iOther : pGraph->aLeafPortals[iLeaf]) {
+            auto& q = pGraph->aPortals[iOther];
+            if (!TestBit(pMight, q.iLeafTo) && PortalInFront(p, q)) {
+                SetBit(pMight, q.iLeafTo);
+                pStack->push_back(q.iLeafTo);
+            }
+        }
+    }
+}
+
+// Clips target to the planes through an edge of source and a point of
+// pass that have source and pass on different sides
+static bool ClipToSeparators(const vis_winding& source, const vis_winding& pass, vis_winding* pTarget, bool bFlipClip) {
+    bool ret = true;
+
+    for (int i = 0; i < source.nPoints && ret; i++) {
+        int l = (i + 1) % source.nPoints;
+        vector4 v1 = source.aPoints[l] - source.aPoints[i];
+
+        for (int j = 0; j < pass.nPoints && ret; j++) {
+            vector4 N = cross(v1, pass.aPoints[j] - source.aPoints[i]);
+            float flLength = N[0] * N[0] + N[1] * N[1] + N[2] * N[2];
+            vector4 eq;
+            bool bFlip = false;
+            int k, nFront = 0;
+
+            if (flLength < VIS_EPSILON) {
+                continue;
+            }
+            N = N * (1 / sqrtf(flLength));
+            eq = vector4(N[0], N[1], N[2], -(N[0] * pass.aPoints[j][0] + N[1] * pass.aPoints[j][1] + N[2] * pass.aPoints[j][2]));
+
+            // Which side has the source
+            for (k = 0; k < source.nPoints; k++) {
+                if (k != i && k != l) {
+                    float d = PlaneDistance(eq, source.aPoints[k]);
+                    if (d < -VIS_EPSILON) {
+                        break;
+                    } else if (d > VIS_EPSILON) {
+                        bFlip = true;
+                        break;
+                    }
+                }
+            }
+            if (k == source.nPoints) {
+                // On the plane of the source
+                continue;
+            }
+            if (bFlip) {
+                eq = FlipPlane(eq);
+            }
+
+            // It separates if pass is entirely in front
+            for (k = 0; k < pass.nPoints; k++) {
+                if (k != j) {
+                    float d = PlaneDistance(eq, pass.aPoints[k]);
+                    if (d < -VIS_EPSILON) {
+                        break;
+                    } else if (d > VIS_EPSILON) {
+                        nFront++;
+                    }
+                }
+            }
+            if (k != pass.nPoints || nFront == 0) {
+                continue;
+            }
+
+            if (bFlipClip) {
+                eq = FlipPlane(eq);
+            }
+            ret = ClipWinding(pTarget, *pTarget, eq);
+        }
+    }
+
+    return ret;
+}
+
+struct vis_flow {
+    vis_graph* pGraph;
+    const vis_portal* pBase;
+    uint64_t* pVis;
+    std::deque<vis_frame>* pFrames;
+};
+
+static void RecursiveLeafFlow(vis_flow* pFlow, int iLeaf, size_t iPrev) {
+    auto pGraph = pFlow->pGraph;
+    int nWords = pGraph->nWords;
+
+    SetBit(pFlow->pVis, iLeaf);
+
+    if (pFlow->pFrames->size() <= iPrev + 1) {
+        pFlow->pFrames->emplace_back();
+        pFlow->pFrames->back().aMightSee.resize(nWords);
+    }
+    auto& prev = (*pFlow->pFrames)[iPrev];
+    auto& cur = (*pFlow->pFrames)[iPrev + 1];
+
+    for (int iPortal : pGraph->aLeafPortals[iLeaf]) {
+        auto& q = pGraph->aPortals[iPortal];
+        auto pMight = pGraph->aDone[iPortal] ?
+            &pGraph->aVis[(size_t)iPortal * nWords] :
+            &pGraph->aMightSee[(size_t)iPortal * nWords];
+        uint64_t uMore = 0;
+        vector4 backPlane = FlipPlane(q.plane);
+
+        if (!TestBit(prev.aMightSee.data(), q.iLeafTo)) {
+            continue;
+        }
+        // Only go on if something new may be seen
+        for (int i = 0; i < nWords; i++) {
+            cur.aMightSee[i] = prev.aMightSee[i] & pMight[i];
+            uMore |= cur.aMightSee[i] & ~pFlow->pVis[i];
+        }
+        if (!uMore) {
+            continue;
+        }
+        // Can't go out through a face coplanar with the one we came in
+        if (fabsf(prev.portalPlane[0] - backPlane[0]) < VIS_EPSILON &&
+            fabsf(prev.portalPlane[1] - backPlane[1]) < VIS_EPSILON &&
+            fabsf(prev.portalPlane[2] - backPlane[2]) < VIS_EPSILON) {
+            continue;
+        }
+
+        cur.portalPlane = q.plane;
+        if (!ClipWinding(&cur.pass, q.w, pFlow->pBase->plane)) {
+            continue;
+        }
+        if (!prev.bPass) {
+            // The first portal after the base can only be hidden by being
+            // behind it
+            cur.source = prev.source;
+            cur.bPass = true;
+            RecursiveLeafFlow(pFlow, q.iLeafTo, iPrev + 1);
+            continue;
+        }
+
+        if (!ClipWinding(&cur.pass, cur.pass, prev.portalPlane) ||
+            !ClipWinding(&cur.source, prev.source, backPlane) ||
+            !ClipToSeparators(cur.source, prev.pass, &cur.pass, false) ||
+            !ClipToSeparators(prev.pass, cur.source, &cur.pass, true)) {
+            continue;
+        }
+        cur.bPass = true;
+        RecursiveLeafFlow(pFlow, q.iLeafTo, iPrev + 1);
+    }
+}
+
+static void PortalFlow(vis_graph* pGraph, int iPortal, std::deque<vis_frame>* pFrames) {
+    vis_flow flow;
+    auto& p = pGraph->aPortals[iPortal];
+    int nWords = pGraph->nWords;
+
+    if (pFrames->size() == 0) {
+        pFrames->emplace_back();
+    }
+    auto& head = pFrames->front();
+    head.source = p.w;
+    head.bPass = false;
+    head.portalPlane = p.plane;
+    head.aMightSee.assign(
+        pGraph->aMightSee.begin() + (size_t)iPortal * nWords,
+        pGraph->aMightSee.begin() + (size_t)(iPortal + 1) * nWords);
+
+    flow.pGraph = pGraph;
+    flow.pBase = &p;
+    flow.pVis = &pGraph->aVis[(size_t)iPortal * nWords];
+    flow.pFrames = pFrames;
+    RecursiveLeafFlow(&flow, p.iLeafTo, 0);
+}
+
+static int CountBits(const uint64_t* pBits, int nWords) {
+    int ret = 0;
+
+    for (int i = 0; i < nWords; i++) {
+        for (uint64_t u = pBits[i]; u; u &= u - 1) {
+            ret++;
+        }
+    }
+
+    return ret;
+}
+
+// Runs fn(iPortal, iThread) for every portal
+template<typename F>
+static void ForEachPortal(CTaskPool* pPool, int nPortals, F fn) {
+    if (pPool) {
+        CTaskPool::task_group group;
+        for (int iBegin = 0; iBegin < nPortals; iBegin += VIS_FLOW_GRAIN) {
+            int iEnd = (iBegin + VIS_FLOW_GRAIN < nPortals) ? iBegin + VIS_FLOW_GRAIN : nPortals;
+            pPool->Run(&group, [=, &fn]() {
+                for (int i = iBegin; i < iEnd; i++) {
+                    fn(i, pPool->CurrentThread());
+                }
+            });
+        }
+        pPool->Wait(&group);
+    } else {
+        for (int i = 0; i < nPortals; i++) {
+            fn(i, 0);
+        }
+    }
+}
+
+// Appends a row of bytes to pOut with runs of zeros compressed
+static void CompressRow(std::vector<uint8_t>* pOut, const uint8_t* pRow, int nBytes) {
+    for (int i = 0; i < nBytes; i++) {
+        pOut->push_back(pRow[i]);
+        if (pRow[i] == 0) {
+            int nRun = 1;
+            while (i + 1 < nBytes && pRow[i + 1] == 0 && nRun < 255) {
+                nRun++;
+                i++;
+            }
+            pOut->push_back((uint8_t)nRun);
+        }
+    }
+}
+
+void DefaultBSPVisParams(bsp_vis_params* pParams) {
+    assert(pParams);
+    pParams->nThreads = 0;
+}
+
+bool ComputeBSPVisibility(bsp_compiled* pTree, const bsp_vis_params* pParams, bsp_vis_stats* pStats) {
+    bool ret = false;
+    bsp_vis_params params;
+    bsp_vis_stats stats = {};
+    vis_graph graph;
+    CTaskPool* pPool = NULL;
+    int nRowBytes;
+    long long nVisible = 0;
+    std::vector<uint8_t> aRow;
+
+    assert(pTree);
+    // The leaves are changed in place, so they must be owned by the tree
+    assert(pTree->pLeaves == pTree->m_aLeaves.data());
+
+    if (pParams) {
+        params = *pParams;
+    } else {
+        DefaultBSPVisParams(&params);
+    }
+
+    if (pTree->nLeaves > 0 && pTree->nNodes > 0) {
+        auto t0 = std::chrono::high_resolution_clock::now();
+
+        graph.pTree = pTree;
+        graph.aLeafPortals.resize(pTree->nLeaves);
+        graph.nWords = (pTree->nLeaves + 63) / 64;
+        MakePortals(&graph);
+
+        auto t1 = std::chrono::high_resolution_clock::now();
+
+        if (params.nThreads != 1) {
+            pPool = new CTaskPool(params.nThreads);
+            if (pPool->ThreadCount() == 1) {
+                delete pPool;
+                pPool = NULL;
+            }
+        }
+
+        int nPortals = (int)graph.aPortals.size();
+        int nThreads = pPool ? pPool->ThreadCount() : 1;
+        std::vector<std::vector<int>> aStacks(nThreads);
+        std::vector<std::deque<vis_frame>> aFrames(nThreads);
+        std::vector<int> aOrder(nPortals), aMightCount(nPortals);
+
+        graph.aMightSee.assign((size_t)nPortals * graph.nWords, 0);
+        graph.aVis.assign((size_t)nPortals * graph.nWords, 0);
+        graph.aDone.assign(nPortals, 0);
+        ForEachPortal(pPool, nPortals, [&](int iPortal, int iThread) {
+            BasePortalVis(&graph, iPortal, &aStacks[iThread]);
+            aMightCount[iPortal] = CountBits(&graph.aMightSee[(size_t)iPortal * graph.nWords], graph.nWords);
+        });
+
+        // Portals that might see little are cheap to flow; flowing them
+        // first lets their vis cut down the flows through them. Without
+        // this the flow grows exponentially with the number of portals a
+        // line of sight can pass, which open maps like city blocks hit.
+        for (int i = 0; i < nPortals; i++) {
+            aOrder[i] = i;
+        }
+        std::stable_sort(aOrder.begin(), aOrder.end(), [&](int a, int b) {
+            return aMightCount[a] < aMightCount[b];
+        });
+        for (int iWave = 0; iWave < nPortals; iWave += VIS_FLOW_WAVE) {
+            int nWave = (nPortals - iWave < VIS_FLOW_WAVE) ? nPortals - iWave : VIS_FLOW_WAVE;
+            ForEachPortal(pPool, nWave, [&](int i, int iThread) {
+                PortalFlow(&graph, aOrder[iWave + i], &aFrames[iThread]);
+            });
+            for (int i = 0; i < nWave; i++) {
+                graph.aDone[aOrder[iWave + i]] = 1;
+            }
+        }
+
+        delete pPool;
+
+        // A leaf sees itself and everything seen through its portals
+        nRowBytes = (pTree->nLeaves + 7) / 8;
+        aRow.resize(nRowBytes);
+        pTree->m_aVisData.clear();
+        for (int iLeaf = 0; iLeaf < pTree->nLeaves; iLeaf++) {
+            auto& leaf = pTree->m_aLeaves[iLeaf];
+            if (leaf.contents == BSP_CONTENTS_EMPTY) {
+                std::vector<uint64_t> aBits(graph.nWords, 0);
+                SetBit(aBits.data(), iLeaf);
+                for (int iPortal : graph.aLeafPortals[iLeaf]) {
+                    auto pVis = &graph.aVis[(size_t)iPortal * graph.nWords];
+                    for (int i = 0; i < graph.nWords; i++) {
+                        aBits[i] |= pVis[i];
+                    }
+                }
+                for (int i = 0; i < nRowBytes; i++) {
+                    aRow[i] = (uint8_t)(aBits[i >> 3] >> ((i & 7) * 8));
+                }
+                for (int i = 0; i < pTree->nLeaves; i++) {
+                    nVisible += TestBit(aBits.data(), i);
+                }
+                leaf.iVisOffset = (int32_t)pTree->m_aVisData.size();
+                CompressRow(&pTree->m_aVisData, aRow.data(), nRowBytes);
+                stats.nEmptyLeaves++;
+            } else {
+                leaf.iVisOffset = -1;
+            }
+        }
+        pTree->pVisData = pTree->m_aVisData.data();
+        pTree->nVisData = (int)pTree->m_aVisData.size();
+
+        auto t2 = std::chrono::high_resolution_clock::now();
+
+        stats.nPortals = nPortals / 2;
+        if (stats.nEmptyLeaves > 0) {
+            stats.flAvgVisible = (float)(nVisible / (double)stats.nEmptyLeaves);
+        }
+        stats.nVisBytes = pTree->m_aVisData.size();
+        stats.nUncompressedBytes = (size_t)stats.nEmptyLeaves * nRowBytes;
+        stats.flPortalMs = std::chrono::duration<double, std::milli>(t1 - t0).count();
+        stats.flFlowMs = std::chrono::duration<double, std::milli>(t2 - t1).count();
+        ret = true;
+    }
+
+    if (pStats) {
+        *pStats = stats;
+    }
+
+    return ret;
+}
+
+void PrintBSPVisReport(FILE* hFile, const bsp_vis_stats* pStats) {
+    assert(hFile && pStats);
+
+    fprintf(hFile, "BSP vis: %d portals, %.1f of %d empty leaves visible on average, %zu bytes (%zu uncompressed)\n",
+        pStats->nPortals, pStats->flAvgVisible, pStats->nEmptyLeaves, pStats->nVisBytes, pStats->nUncompressedBytes);
+    fprintf(hFile, "BSP vis: portals in %.2f ms, flow in %.2f ms\n", pStats->flPortalMs, pStats->flFlowMs);
+}
+
+void BSPLeafPVS(bsp_pvs* pOut, const bsp_compiled* pTree, int iLeaf) {
+    int nRowBytes;
+
+    assert(pOut && pTree);
+
+    pOut->iLeaf = -1;
+    if (iLeaf >= 0 && iLeaf < pTree->nLeaves && pTree->pLeaves[iLeaf].iVisOffset >= 0) {
+        auto pIn = pTree->pVisData + pTree->pLeaves[iLeaf].iVisOffset;
+        auto pEnd = pTree->pVisData + pTree->nVisData;
+        int iOut = 0;
+
+        nRowBytes = (pTree->nLeaves + 7) / 8;
+        pOut->aLeafBits.resize(nRowBytes);
+        while (iOut < nRowBytes && pIn < pEnd) {
+            if (pIn[0] != 0) {
+                pOut->aLeafBits[iOut++] = *pIn++;
+            } else if (pIn + 1 < pEnd) {
+                for (int n = pIn[1]; n > 0 && iOut < nRowBytes; n--) {
+                    pOut->aLeafBits[iOut++] = 0;
+                }
+                pIn += 2;
+            } else {
+                break;
+            }
+        }
+        while (iOut < nRowBytes) {
+            pOut->aLeafBits[iOut++] = 0;
+        }
+
+        pOut->aVisibleBefore.resize(pTree->nLeaves + 1);
+        pOut->aPolygonVisible.resize(pTree->nPolygons);
+        memset(pOut->aPolygonVisible.data(), 0, pOut->aPolygonVisible.size());
+        pOut->aVisibleBefore[0] = 0;
+        for (int i = 0; i < pTree->nLeaves; i++) {
+            bool bVisible = (pOut->aLeafBits[i >> 3] >> (i & 7)) & 1;
+            pOut->aVisibleBefore[i + 1] = pOut->aVisibleBefore[i] + (bVisible ? 1 : 0);
+            if (bVisible) {
+                auto& leaf = pTree->pLeaves[i];
+                for (uint32_t iFace = 0; iFace < leaf.nFaces; iFace++) {
+                    uint32_t iPoly = pTree->pLeafFaces[leaf.iFirstFace + iFace];
+                    if (iPoly < (uint32_t)pTree->nPolygons) {
+                        pOut->aPolygonVisible[iPoly] = 1;
+                    }
+                }
+            }
+        }
+        pOut->iLeaf = iLeaf;
+    }
+}
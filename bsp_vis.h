@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include "bsp_compiled.h"
+
+// Potentially visible sets.
+// The portals between the empty leaves of a leaf tree are found by cutting
+// every node's plane down to the cell of the node and filtering the pieces
+// into the leaves on its two sides. A portal flow then finds which leaves
+// can be seen through every portal, following the vis tool of Quake: a
+// leaf is reached if there is a line through the portals on the way to
+// it. Portals are flowed in order of how many leaves they might see, and
+// the finished ones stand in for their might-see in later flows, which
+// cuts most paths short. On one thread a 500 wall city map takes about
+// 0.2 s and a 3000 wall one about 5 s. The visible set of every empty
+// leaf is stored as a bit per leaf, with runs of zero bytes compressed to
+// a zero byte and a count.
+
+struct bsp_vis_params {
+    // Threads of the portal flow; 0 uses every hardware thread. The
+    // result doesn't depend on this.
+    int nThreads;
+};
+
+struct bsp_vis_stats {
+    int nEmptyLeaves;
+    int nPortals;
+    // Leaves visible from an empty leaf, on average
+    float flAvgVisible;
+    // Size of the compressed and the uncompressed sets
+    size_t nVisBytes;
+    size_t nUncompressedBytes;
+    double flPortalMs;
+    double flFlowMs;
+};
+
+void DefaultBSPVisParams(bsp_vis_params* pParams);
+// Computes the visible sets of a tree made by CompileBSPTree with leaves.
+// Returns false if the tree has no leaves.
+bool ComputeBSPVisibility(bsp_compiled* pTree, const bsp_vis_params* pParams, bsp_vis_stats* pStats);
+void PrintBSPVisReport(FILE* hFile, const bsp_vis_stats* pStats);
+
+// Decompressed visible set of a leaf
+struct bsp_pvs {
+    // Leaf of the set; -1 if everything is visible
+    int iLeaf;
+    // A bit for every leaf
+    std::vector<uint8_t> aLeafBits;
+    // Number of visible leaves before every leaf, and the total in the
+    // last element, so that ranges of leaves are tested in constant time
+    std::vector<int> aVisibleBefore;
+    // A byte for every polygon of the tree; set if a visible leaf has it in
+    // its face list
+    std::vector<uint8_t> aPolygonVisible;
+
+    bsp_pvs() : iLeaf(-1) {
+    }
+
+    bool AnyVisible(uint32_t iFirstLeaf, uint32_t nLeaves) const {
+        return iLeaf < 0 || aVisibleBefore[iFirstLeaf + nLeaves] > aVisibleBefore[iFirstLeaf];
+    }
+
+    bool PolygonVisible(uint32_t iPoly) const {
+        return iLeaf < 0 || aPolygonVisible[iPoly];
+    }
+};
+
+// Fills pOut with the visible set of a leaf. If iLeaf is -1 or the leaf
+// has no set, everything is visible. Doesn't allocate once pOut has been
+// used with the same tree.
+void BSPLeafPVS(bsp_pvs* pOut, const bsp_compiled* pTree, int iLeaf);
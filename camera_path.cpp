@@ -0,0 +1,99 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include "camera_path.h"
+
+struct camera_path_header {
+    char szMagic[4];
+    uint32_t uVersion;
+};
+
+bool WriteCameraPathHeader(FILE* hFile) {
+    camera_path_header hdr = { { 'B', 'S', 'P', 'P' }, CAMPATH_VERSION };
+
+    assert(hFile);
+
+    return fwrite(&hdr, sizeof(hdr), 1, hFile) == 1;
+}
+
+bool WriteCameraKey(FILE* hFile, const camera_key* pKey) {
+    assert(hFile && pKey);
+
+    return fwrite(pKey, sizeof(*pKey), 1, hFile) == 1;
+}
+
+bool ReadCameraPath(FILE* hFile, std::vector<camera_key>* pKeys) {
+    bool ret = false;
+    camera_path_header hdr;
+    camera_key key;
+
+    assert(hFile && pKeys);
+
+    pKeys->clear();
+    if (fread(&hdr, sizeof(hdr), 1, hFile) == 1 &&
+        memcmp(hdr.szMagic, "BSPP", 4) == 0 && hdr.uVersion == CAMPATH_VERSION) {
+        while (fread(&key, sizeof(key), 1, hFile) == 1) {
+            pKeys->push_back(key);
+        }
+        // A key cut short by the end of the file is dropped
+        ret = ferror(hFile) == 0;
+    }
+
+    return ret;
+}
+
+// Difference of two angles in [-pi, pi]
+static float AngleDelta(float flFrom, float flTo) {
+    const float flTwoPi = 2 * 3.1415926f;
+    float ret = fmodf(flTo - flFrom, flTwoPi);
+
+    if (ret > 0.5f * flTwoPi) {
+        ret -= flTwoPi;
+    } else if (ret < -0.5f * flTwoPi) {
+        ret += flTwoPi;
+    }
+
+    return ret;
+}
+
+void InterpolateCamera(vector4* pPosition, vector4* pRotation,
+    const vector4& vPosition0, const vector4& vRotation0, const vector4& vPosition1, const vector4& vRotation1, float t) {
+    assert(pPosition && pRotation);
+
+    for (int i = 0; i < 3; i++) {
+        (*pPosition)[i] = vPosition0[i] + t * (vPosition1[i] - vPosition0[i]);
+        (*pRotation)[i] = vRotation0[i] + t * AngleDelta(vRotation0[i], vRotation1[i]);
+    }
+    (*pPosition)[3] = 0;
+    (*pRotation)[3] = 0;
+}
+
+void SampleCameraPath(vector4* pPosition, vector4* pRotation, const camera_key* pKeys, int nKeys, float flTime) {
+    assert(pPosition && pRotation && pKeys && nKeys > 0);
+
+    // Last key at or before flTime
+    int iLo = 0, iHi = nKeys - 1;
+    while (iLo < iHi) {
+        int iMid = (iLo + iHi + 1) / 2;
+        if (pKeys[iMid].flTime <= flTime) {
+            iLo = iMid;
+        } else {
+            iHi = iMid - 1;
+        }
+    }
+
+    auto& k0 = pKeys[iLo];
+    auto& k1 = pKeys[iLo + 1 < nKeys ? iLo + 1 : iLo];
+    float t = 0;
+    if (k1.flTime > k0.flTime && flTime > k0.flTime) {
+        t = (flTime - k0.flTime) / (k1.flTime - k0.flTime);
+        t = t > 1 ? 1 : t;
+    }
+
+    InterpolateCamera(pPosition, pRotation,
+        vector4(k0.aflPosition[0], k0.aflPosition[1], k0.aflPosition[2]),
+        vector4(k0.aflRotation[0], k0.aflRotation[1], k0.aflRotation[2]),
+        vector4(k1.aflPosition[0], k1.aflPosition[1], k1.aflPosition[2]),
+        vector4(k1.aflRotation[0], k1.aflRotation[1], k1.aflRotation[2]), t);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdio.h>
+#include <vector>
+#include "util_vector.h"
+
+#define CAMPATH_VERSION (1)
+
+// Camera position and rotation at a point in time of a recorded flight.
+// The position is the one given to IGraphicsEngine::SetCameraPosition,
+// i.e. the negated eye position.
+struct camera_key {
+    float flTime;
+    float aflPosition[3];
+    float aflRotation[3];
+};
+
+// Camera path files are a header followed by keys in order of time, up to
+// the end of the file, all in native byte order. Keys are written as they
+// are recorded, so a path survives the recorder being killed.
+bool WriteCameraPathHeader(FILE* hFile);
+bool WriteCameraKey(FILE* hFile, const camera_key* pKey);
+// Replaces the contents of pKeys with the keys of a path file
+bool ReadCameraPath(FILE* hFile, std::vector<camera_key>* pKeys);
+
+// Camera at t between camera 0 at t = 0 and camera 1 at t = 1; rotations
+// take the short way around
+void InterpolateCamera(vector4* pPosition, vector4* pRotation,
+    const vector4& vPosition0, const vector4& vRotation0, const vector4& vPosition1, const vector4& vRotation1, float t);
+
+// Position and rotation at flTime, interpolated between the keys around
+// it. Times outside the path get the first or the last key.
+void SampleCameraPath(vector4* pPosition, vector4* pRotation, const camera_key* pKeys, int nKeys, float flTime);
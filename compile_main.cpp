@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "bsp.h"
+#include "bsp_compiled.h"
+#include "bsp_file.h"
+#include "bsp_vis.h"
+#include "mapgen.h"
+
+static void Usage(const char* pszProgram) {
+    fprintf(stderr,
+        "usage: %s [-t threads] [-s seed] [-d depth] [-l] [-v] [-r] input.map output.bspc\n"
+        "  -t  build threads, 0 uses every hardware thread (default: 0)\n"
+        "  -s  seed of the splitter selection (default: 0)\n"
+        "  -d  maximum depth of the tree; fails if the tree needs more (default: 0, no limit)\n"
+        "  -l  build a tree with solid and empty leaves\n"
+        "  -v  compute the potentially visible sets of the leaves; needs -l\n"
+        "  -r  print the shape, memory use and build timings of the tree\n",
+        pszProgram);
+}
+
+int main(int argc, char** argv) {
+    bsp_build_params params;
+    bsp_build_stats stats;
+    bsp_tree tree;
+    bsp_compiled compiled;
+    bsp_vis_params visParams;
+    bsp_vis_stats visStats;
+    bool bVis = false;
+    bool bStats = false;
+    PolygonContainer pc;
+    const char* pszInput = NULL;
+    const char* pszOutput = NULL;
+    FILE* hFile;
+
+    DefaultBSPBuildParams(&params);
+    params.nThreads = 0;
+
+    for (int iArg = 1; iArg < argc; iArg++) {
+        if (strcmp(argv[iArg], "-t") == 0 && iArg + 1 < argc) {
+            params.nThreads = atoi(argv[++iArg]);
+        } else if (strcmp(argv[iArg], "-s") == 0 && iArg + 1 < argc) {
+            params.uSeed = (unsigned)strtoul(argv[++iArg], NULL, 0);
+        } else if (strcmp(argv[iArg], "-d") == 0 && iArg + 1 < argc) {
+            params.nMaxDepth = atoi(argv[++iArg]);
+        } else if (strcmp(argv[iArg], "-l") == 0) {
+            params.bLeafTree = true;
+        } else if (strcmp(argv[iArg], "-v") == 0) {
+            bVis = true;
+        } else if (strcmp(argv[iArg], "-r") == 0) {
+            bStats = true;
+        } else if (argv[iArg][0] != '-' && !pszInput) {
+            pszInput = argv[iArg];
+        } else if (argv[iArg][0] != '-' && !pszOutput) {
+            pszOutput = argv[iArg];
+        } else {
+            Usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!pszInput || !pszOutput || (bVis && !params.bLeafTree)) {
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    hFile = fopen(pszInput, "rb");
+    if (!hFile || !ReadMap(hFile, &pc)) {
+        fprintf(stderr, "can't load the map '%s'\n", pszInput);
+        return EXIT_FAILURE;
+    }
+    fclose(hFile);
+
+    auto t0 = std::chrono::high_resolution_clock::now();
+    bool bBuilt = BuildBSPTree(&tree, pc, &params, &stats);
+    if (bBuilt) {
+        CompileBSPTree(&compiled, &tree);
+    }
+    auto t1 = std::chrono::high_resolution_clock::now();
+    PrintBSPBuildReport(stderr, &params, &stats);
+    if (!bBuilt) {
+        fprintf(stderr, "the tree of '%s' needs more than %d levels\n", pszInput, params.nMaxDepth);
+        return EXIT_FAILURE;
+    }
+    if (bStats) {
+        PrintBSPStats(stderr, &stats);
+    }
+
+    if (bVis) {
+        DefaultBSPVisParams(&visParams);
+        visParams.nThreads = params.nThreads;
+        ComputeBSPVisibility(&compiled, &visParams, &visStats);
+        PrintBSPVisReport(stderr, &visStats);
+    }
+
+    if (!SaveCompiledBSP(pszOutput, &compiled)) {
+        fprintf(stderr, "can't write '%s'\n", pszOutput);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "%s: %d nodes, %d leaves, %d polygons, %d triangles, built in %.2f ms\n",
+        pszOutput, compiled.nNodes, compiled.nLeaves, compiled.nPolygons, compiled.nIndices / 3,
+        std::chrono::duration<double, std::milli>(t1 - t0).count());
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,342 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <chrono>
+#include "headless_core.h"
+#include "util_matrix.h"
+
+// Field of view of CSDL2Core
+#define HEADLESS_FOV (3.1415926f / 4.0f)
+
+// MVP matrix, camera position and camera direction of a draw
+#define DRAW_UNIFORM_BYTES (16 * sizeof(float) + 2 * 4 * sizeof(float))
+// MVP matrix and sampler of the skybox
+#define SKYBOX_UNIFORM_BYTES (16 * sizeof(float) + sizeof(int))
+
+static double Now() {
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+}
+
+CHeadlessCore::CHeadlessCore() {
+    frame_pacing_params pacing;
+    auto pszFrames = getenv("BSP_HEADLESS_FRAMES");
+    if (pszFrames) {
+        m_nFrameLimit = atoi(pszFrames);
+    }
+    DefaultFramePacingParams(&pacing);
+    pacing.mode = eFramePacingUncapped;
+    m_scheduler.SetParams(&pacing);
+    // Recording shouldn't show up as allocations of the frames
+    m_aRecords.resize(HEADLESS_RECORD_HISTORY);
+}
+
+void CHeadlessCore::Initialize(int nScreenWidth, int nScreenHeight, bool) {
+    if (m_bShutdown) {
+        math::matrix4 matProjInv;
+        math::perspective(m_matProj, matProjInv, nScreenWidth, nScreenHeight, HEADLESS_FOV, 0.01f, 1000.0f);
+        m_iFrame = 0;
+        m_bShutdown = false;
+    }
+}
+
+void CHeadlessCore::Shutdown() {
+    if (!m_bShutdown) {
+        PrintReport(stderr);
+        m_bShutdown = true;
+    }
+}
+
+void CHeadlessCore::ClearScreen() {
+}
+
+void CHeadlessCore::SwapScreen() {
+    m_scheduler.EndWork();
+    m_scheduler.EndFrame();
+    m_frameArena.Reset();
+    m_iFrame++;
+}
+
+void CHeadlessCore::Record(eDrawCall type, long long nVertices, int nDraws, size_t nUploadBytes, double t0) {
+    draw_call_record record;
+    record.type = type;
+    record.iFrame = m_iFrame;
+    record.nVertices = nVertices;
+    record.nDraws = nDraws;
+    record.nUploadBytes = nUploadBytes;
+    record.flCpuMs = Now() - t0;
+    m_aRecords[m_nRecords % HEADLESS_RECORD_HISTORY] = record;
+    m_nRecords++;
+
+    auto& totals = m_aTotals[type];
+    totals.nCalls++;
+    totals.nVertices += nVertices;
+    totals.nDraws += nDraws;
+    totals.nUploadBytes += nUploadBytes;
+    totals.flCpuMs += record.flCpuMs;
+    if (record.flCpuMs > totals.flMaxCpuMs) {
+        totals.flMaxCpuMs = record.flCpuMs;
+    }
+
+    m_drawCounters.nCalls++;
+    m_drawCounters.nDraws += nDraws;
+    m_drawCounters.nUploadBytes += nUploadBytes;
+}
+
+void CHeadlessCore::DrawPolygonSet(vector4 const* pVertices, PolygonContainer::winding const* pWindings, int nPolygons) {
+    double t0 = Now();
+    long long nTotalVertices = 0;
+    math::matrix4 matViewRotation = MakeRotationZ(m_vCameraRotation[2]) * MakeRotationY(m_vCameraRotation[1]);
+    math::matrix4 matView =
+        math::translate(m_vCameraPosition[0], m_vCameraPosition[1], m_vCameraPosition[2]) * matViewRotation;
+    vector4 vCamViewDir = matViewRotation * vector4(0, 0, -1);
+    size_t nVerticesSize;
+    float* aflPositions;
+    float* aflNormals;
+    int iOffArray;
+
+    // Same fans as CSDL2Core, into the frame arena
+    for (int i = 0; i < nPolygons; i++) {
+        if (pWindings[i].nVertices >= 3) {
+            nTotalVertices += (pWindings[i].nVertices - 2) * 3;
+        }
+    }
+    nVerticesSize = nTotalVertices * 3 * sizeof(float);
+    aflPositions = (float*)m_frameArena.Alloc(nVerticesSize);
+    aflNormals = (float*)m_frameArena.Alloc(nVerticesSize);
+    iOffArray = 0;
+    for (int i = 0; i < nPolygons; i++) {
+        auto pV = pVertices + pWindings[i].iFirstVertex;
+        for (int iVtx = 1; iVtx < pWindings[i].nVertices - 1; iVtx++) {
+            vector4 const* apTriangle[3] = { &pV[0], &pV[iVtx], &pV[iVtx + 1] };
+            auto normal = cross(pV[iVtx] - pV[0], pV[iVtx] - pV[iVtx + 1]);
+            for (int iCorner = 0; iCorner < 3; iCorner++, iOffArray += 3) {
+                auto& point = *apTriangle[iCorner];
+                aflPositions[iOffArray + 0] = point[0];
+                aflPositions[iOffArray + 1] = point[1];
+                aflPositions[iOffArray + 2] = point[2];
+                aflNormals[iOffArray + 0] = normal[0];
+                aflNormals[iOffArray + 1] = normal[1];
+                aflNormals[iOffArray + 2] = normal[2];
+            }
+        }
+    }
+    SubmitTriangles(aflPositions, aflNormals, nTotalVertices, matView * m_matProj, vCamViewDir);
+
+    Record(eDrawCallPolygonSet, nTotalVertices, 1, 2 * nVerticesSize + DRAW_UNIFORM_BYTES, t0);
+}
+
+void CHeadlessCore::UploadLevelMesh(bsp_compiled const* pTree) {
+    m_aflLevelVertices.resize(pTree->nVertices * 6);
+
+    // Position and normal of every vertex, as CSDL2Core uploads them
+    for (int iPoly = 0; iPoly < pTree->nPolygons; iPoly++) {
+        auto& w = pTree->pWindings[iPoly];
+        auto pV = pTree->pVertices + w.iFirstVertex;
+        auto normal = cross(pV[1] - pV[0], pV[1] - pV[2]);
+        for (int iVtx = 0; iVtx < w.nVertices; iVtx++) {
+            auto pfl = &m_aflLevelVertices[(w.iFirstVertex + iVtx) * 6];
+            pfl[0] = pV[iVtx][0];
+            pfl[1] = pV[iVtx][1];
+            pfl[2] = pV[iVtx][2];
+            pfl[3] = normal[0];
+            pfl[4] = normal[1];
+            pfl[5] = normal[2];
+        }
+    }
+
+    BSPResetView(&m_view, pTree);
+
+    m_pLevelTree = pTree;
+    m_pLevelIndices = pTree->pIndices;
+    m_nLevelIndices = pTree->nIndices;
+}
+
+void CHeadlessCore::DrawBSPTree(bsp_compiled const* pTree) {
+    double t0 = Now();
+    long long nVertices = 0;
+    size_t nUploadBytes = 0;
+    math::matrix4 matViewRotation = MakeRotationZ(m_vCameraRotation[2]) * MakeRotationY(m_vCameraRotation[1]);
+    math::matrix4 matView =
+        math::translate(m_vCameraPosition[0], m_vCameraPosition[1], m_vCameraPosition[2]) * matViewRotation;
+    math::matrix4 matMVP = matView * m_matProj;
+    vector4 vCamViewDir = matViewRotation * vector4(0, 0, -1);
+
+    assert(pTree);
+
+    m_view.aRanges.clear();
+    if (pTree->nNodes > 0) {
+        if (pTree != m_pLevelTree || pTree->pIndices != m_pLevelIndices || pTree->nIndices != m_nLevelIndices) {
+            UploadLevelMesh(pTree);
+            nUploadBytes += m_aflLevelVertices.size() * sizeof(float) + pTree->nIndices * sizeof(uint32_t);
+        }
+
+        vector4 vEye(-m_vCameraPosition[0], -m_vCameraPosition[1], -m_vCameraPosition[2], 1);
+        BSPDrawRangesOfView(&m_view, pTree, vEye, matMVP, &m_cullStats);
+        auto& aDrawRanges = m_view.aRanges;
+
+        // The count and offset arrays of glMultiDrawElements
+        auto aDrawCounts = (int*)m_frameArena.Alloc(aDrawRanges.size() * sizeof(int));
+        auto aDrawOffsets = (const void**)m_frameArena.Alloc(aDrawRanges.size() * sizeof(const void*));
+        for (size_t i = 0; i < aDrawRanges.size(); i++) {
+            aDrawCounts[i] = (int)aDrawRanges[i].nIndices;
+            aDrawOffsets[i] = (const void*)(aDrawRanges[i].iFirstIndex * sizeof(uint32_t));
+            nVertices += aDrawRanges[i].nIndices;
+        }
+        nUploadBytes += aDrawRanges.size() * (sizeof(int) + sizeof(const void*)) + DRAW_UNIFORM_BYTES;
+        SubmitRanges(pTree, aDrawRanges.data(), (int)aDrawRanges.size(), matMVP, vCamViewDir);
+    }
+
+    Record(eDrawCallBSPTree, nVertices, (int)m_view.aRanges.size(), nUploadBytes, t0);
+}
+
+void CHeadlessCore::GetCullStats(bsp_cull_stats* pStats) {
+    if (pStats) {
+        *pStats = m_cullStats;
+    }
+}
+
+void CHeadlessCore::GetDrawCounters(draw_counters* pCounters) {
+    if (pCounters) {
+        *pCounters = m_drawCounters;
+    }
+}
+
+void CHeadlessCore::SetCameraPosition(vector4 const* pPos) {
+    if (pPos) {
+        m_vCameraPosition = *pPos;
+    }
+}
+
+void CHeadlessCore::SetCameraRotation(vector4 const* pRot) {
+    if (pRot) {
+        m_vCameraRotation = *pRot;
+    }
+}
+
+void CHeadlessCore::GetCameraPosition(vector4* pPos) {
+    if (pPos) {
+        *pPos = m_vCameraPosition;
+    }
+}
+
+void CHeadlessCore::GetCameraRotation(vector4* pRot) {
+    if (pRot) {
+        *pRot = m_vCameraRotation;
+    }
+}
+
+float CHeadlessCore::GetFrameTime() {
+    return HEADLESS_FRAME_TIME;
+}
+
+void CHeadlessCore::SetFramePacing(const frame_pacing_params* pParams) {
+    // There's no display to wait for
+    frame_pacing_params pacing = *pParams;
+    if (pacing.mode == eFramePacingVSync) {
+        pacing.mode = eFramePacingUncapped;
+    }
+    m_scheduler.SetParams(&pacing);
+}
+
+void CHeadlessCore::ResetFrameTiming() {
+    m_scheduler.Reset();
+}
+
+void CHeadlessCore::GetFrameTelemetry(frame_telemetry* pTelemetry) {
+    m_scheduler.GetTelemetry(pTelemetry);
+}
+
+void CHeadlessCore::RenderWireframe(bool) {
+}
+
+int CHeadlessCore::LoadTexture(HTEXTURE*, char const*) {
+    return 0;
+}
+
+int CHeadlessCore::LoadCubemapTexture(HTEXTURE* pHandle, char const*[6]) {
+    assert(pHandle != NULL);
+    *pHandle = m_nTextures++;
+    return 1;
+}
+
+void CHeadlessCore::DrawSkybox(HTEXTURE) {
+    m_drawCounters.nCalls++;
+    m_drawCounters.nDraws++;
+    m_drawCounters.nUploadBytes += SKYBOX_UNIFORM_BYTES;
+}
+
+void CHeadlessCore::Initialize() {
+}
+
+int CHeadlessCore::GetNextInputAction(eInputAction* pInputAction, int* bRelease) {
+    int ret = 0;
+
+    if (pInputAction && bRelease) {
+        *pInputAction = eInputInvalid;
+        *bRelease = 0;
+    }
+
+    return ret;
+}
+
+int CHeadlessCore::IsPressed(eInputAction eAction) {
+    int ret = 0;
+
+    switch (eAction) {
+    case eInputForward:
+    case eInputTurnLeft:
+        ret = 1;
+        break;
+    case eInputQuitGame:
+        ret = (m_nFrameLimit > 0 && m_iFrame >= m_nFrameLimit) ? 1 : 0;
+        break;
+    default:
+        break;
+    }
+
+    return ret;
+}
+
+void CHeadlessCore::ClearRecords() {
+    m_nRecords = 0;
+    for (auto& totals : m_aTotals) {
+        totals = {};
+    }
+}
+
+void CHeadlessCore::SetFrameLimit(int nFrames) {
+    m_nFrameLimit = nFrames;
+}
+
+void CHeadlessCore::PrintReport(FILE* hFile) const {
+    const char* apszNames[] = { "DrawPolygonSet", "DrawBSPTree" };
+
+    assert(hFile);
+
+    for (int iType = eDrawCallPolygonSet; iType <= eDrawCallBSPTree; iType++) {
+        auto& totals = m_aTotals[iType];
+        if (totals.nCalls > 0) {
+            fprintf(hFile, "%s: %d calls in %d frames, %.1f vertices, %.1f draws, %.0f bytes per call, cpu avg %.3f ms max %.3f ms, %zu bytes in total\n",
+                apszNames[iType], totals.nCalls, m_iFrame, totals.nVertices / (double)totals.nCalls,
+                totals.nDraws / (double)totals.nCalls, totals.nUploadBytes / (double)totals.nCalls,
+                totals.flCpuMs / totals.nCalls, totals.flMaxCpuMs, totals.nUploadBytes);
+        }
+    }
+}
+
+#if defined(BSP_BACKEND_HEADLESS)
+static CHeadlessCore* gpHeadlessCore = NULL;
+
+IGraphicsEngine* GraphicsEngine() {
+    if (!gpHeadlessCore) {
+        gpHeadlessCore = new CHeadlessCore;
+    }
+    return gpHeadlessCore;
+}
+
+IInputHandler* Input() {
+    if (!gpHeadlessCore) {
+        gpHeadlessCore = new CHeadlessCore;
+    }
+    return gpHeadlessCore;
+}
+#endif
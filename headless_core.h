@@ -0,0 +1,152 @@
+#pragma once
+
+#include <stdio.h>
+#include <vector>
+#include "IGraphicsEngine.h"
+#include "IInputHandler.h"
+#include "util_arena.h"
+
+// Frames a headless bsp_main runs before it quits, unless
+// BSP_HEADLESS_FRAMES says otherwise
+#define HEADLESS_DEFAULT_FRAMES (600)
+// Frame time reported to the game, so that runs are repeatable
+#define HEADLESS_FRAME_TIME (1.0f / 60.0f)
+// Draw calls kept in the record; older ones only count in the totals
+#define HEADLESS_RECORD_HISTORY (4096)
+
+enum eDrawCall {
+    eDrawCallPolygonSet,
+    eDrawCallBSPTree,
+};
+
+// One DrawPolygonSet or DrawBSPTree call
+struct draw_call_record {
+    eDrawCall type;
+    int iFrame;
+    long long nVertices;
+    // Draws the call would issue; every range of a tree is one
+    int nDraws;
+    // Vertex, index and uniform data and draw parameters that would be
+    // sent to the GPU
+    size_t nUploadBytes;
+    // CPU time spent in the call
+    double flCpuMs;
+};
+
+// Sums of the records of one type of call
+struct draw_call_totals {
+    int nCalls;
+    long long nVertices;
+    long long nDraws;
+    size_t nUploadBytes;
+    double flCpuMs;
+    double flMaxCpuMs;
+};
+
+// Graphics and input backend without a window or a GPU. Draw calls do the
+// same work on the CPU as CSDL2Core, up to the point where they would call
+// GL, and are recorded. Input holds forward and turn left, so the camera
+// walks in a circle, and asks to quit after a set number of frames.
+class CHeadlessCore : public IGraphicsEngine, public IInputHandler {
+public:
+    CHeadlessCore();
+
+    virtual void Initialize(int nScreenWidth, int nScreenHeight, bool bFullscreen) override;
+    virtual void Shutdown() override;
+
+    virtual void ClearScreen() override;
+    virtual void SwapScreen() override;
+    virtual void DrawPolygonSet(vector4 const* pVertices, PolygonContainer::winding const* pWindings, int nPolygons) override;
+    virtual void DrawBSPTree(bsp_compiled const* pTree) override;
+    virtual void GetCullStats(bsp_cull_stats* pStats) override;
+    virtual void GetDrawCounters(draw_counters* pCounters) override;
+
+    virtual void SetCameraPosition(vector4 const* pPos) override;
+    virtual void SetCameraRotation(vector4 const* pRot) override;
+    virtual void GetCameraPosition(vector4* pPos) override;
+    virtual void GetCameraRotation(vector4* pRot) override;
+
+    virtual float GetFrameTime() override;
+    virtual void SetFramePacing(const frame_pacing_params* pParams) override;
+    virtual void ResetFrameTiming() override;
+    virtual void GetFrameTelemetry(frame_telemetry* pTelemetry) override;
+
+    virtual void RenderWireframe(bool bEnable) override;
+
+    virtual int LoadTexture(HTEXTURE* pHandle, char const* pchPath) override;
+    virtual int LoadCubemapTexture(HTEXTURE* pHandle, char const* pchPathFaces[6]) override;
+
+    virtual void DrawSkybox(HTEXTURE hCubemapTexture) override;
+
+    virtual void Initialize() override;
+    virtual int GetNextInputAction(eInputAction* pInputAction, int* bRelease) override;
+    virtual int IsPressed(eInputAction eAction) override;
+
+    // Quits after nFrames frames; 0 never quits
+    void SetFrameLimit(int nFrames);
+
+    // The last HEADLESS_RECORD_HISTORY calls, iRecord 0 being the oldest
+    int RecordCount() const {
+        return m_nRecords < HEADLESS_RECORD_HISTORY ? (int)m_nRecords : HEADLESS_RECORD_HISTORY;
+    }
+
+    const draw_call_record& GetRecord(int iRecord) const {
+        return m_aRecords[(m_nRecords - RecordCount() + iRecord) % HEADLESS_RECORD_HISTORY];
+    }
+
+    // Of every call since the records were last cleared
+    const draw_call_totals& Totals(eDrawCall type) const {
+        return m_aTotals[type];
+    }
+
+    void ClearRecords();
+
+    int FrameCount() const {
+        return m_iFrame;
+    }
+
+    // Prints the totals and averages of the recorded calls
+    void PrintReport(FILE* hFile) const;
+
+protected:
+    // Called by DrawPolygonSet with the triangles it built, three
+    // positions and three normals per vertex
+    virtual void SubmitTriangles(const float* /* aflPositions */, const float* /* aflNormals */, long long /* nVertices */,
+        const math::matrix4& /* matMVP */, const vector4& /* vCameraDir */) {
+    }
+    // Called by DrawBSPTree with the ranges of the level mesh it would
+    // draw, front to back
+    virtual void SubmitRanges(bsp_compiled const* /* pTree */, const bsp_draw_range* /* pRanges */, int /* nRanges */,
+        const math::matrix4& /* matMVP */, const vector4& /* vCameraDir */) {
+    }
+
+    void UploadLevelMesh(bsp_compiled const* pTree);
+    void Record(eDrawCall type, long long nVertices, int nDraws, size_t nUploadBytes, double t0);
+
+    bool m_bShutdown = true;
+    int m_iFrame = 0;
+    int m_nFrameLimit = HEADLESS_DEFAULT_FRAMES;
+
+    math::matrix4 m_matProj;
+    vector4 m_vCameraPosition, m_vCameraRotation;
+
+    // Mesh of the last tree drawn
+    bsp_compiled const* m_pLevelTree = NULL;
+    const uint32_t* m_pLevelIndices = NULL;
+    int m_nLevelIndices = 0;
+    std::vector<float> m_aflLevelVertices;
+    bsp_view m_view;
+    bsp_cull_stats m_cullStats = { 0, 0, 0, 0 };
+
+    // Transient data of the frame being drawn; reset by SwapScreen
+    CArena m_frameArena;
+    // Uncapped unless told otherwise; GetFrameTime doesn't depend on it
+    CFrameScheduler m_scheduler;
+
+    int m_nTextures = 0;
+    // Ring of the last calls; m_nRecords counts every call
+    std::vector<draw_call_record> m_aRecords;
+    long long m_nRecords = 0;
+    draw_call_totals m_aTotals[eDrawCallBSPTree + 1] = {};
+    draw_counters m_drawCounters = { 0, 0, 0 };
+};
@@ -1,6 +1,16 @@
 #include <cmath>
 #include <assert.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
 #include "bsp.h"
+#include "bsp_compiled.h"
+#include "bsp_file.h"
+#include "bsp_trace.h"
+#include "camera_path.h"
+#include "mapgen.h"
+#include "util_alloccount.h"
+#include "util_framestats.h"
 #include "util_vector.h"
 #include "util_matrix.h"
 
@@ -9,15 +19,58 @@
 
 #define M_PI (3.1415926f)
 
-static bool MoveCamera() {
-    bool ret = false;
-    vector4 ds, dtheta;
+// Frames drawn before the allocation counts are checked; the first frames
+// upload the level and grow the renderer's buffers
+#define ALLOC_WARMUP_FRAMES (16)
+
+// Radius of the sphere the camera collides as
+#define CAMERA_RADIUS (0.1f)
+
+// Time between the frames of a replay
+#define REPLAY_TIMESTEP (1.0f / 60.0f)
+
+// Time the camera is simulated in. A frame runs at most SIM_MAX_TICKS
+// ticks; a longer stall slows the simulation down rather than making the
+// next frames even longer.
+#define SIM_TIMESTEP (1.0f / 60.0f)
+#define SIM_MAX_TICKS (8)
+
+// Simulated state of the camera; the position is the negated eye position
+struct camera_state {
+    vector4 vPosition;
+    vector4 vRotation;
+};
+
+static void Usage(const char* pszProgram) {
+    fprintf(stderr,
+        "usage: %s [-pacing mode] [-record path] [-replay path] [level]\n"
+        "  -pacing  vsync, uncapped or a target frame rate (default: vsync, uncapped with -replay)\n"
+        "  -record  write the camera of every frame to a camera path file\n"
+        "  -replay  fly along a camera path, one frame every %.2f ms of it, and print frame statistics\n"
+        "  level    a tree made by bsp_compile or a map made by bsp_mapgen\n",
+        pszProgram, 1000.0f * REPLAY_TIMESTEP);
+}
+
+static bool WriteCameraFrame(FILE* hFile, float flTime) {
+    camera_key key;
     vector4 campos, camrot;
-    int bRelease;
-    float dt = GraphicsEngine()->GetFrameTime();
 
     GraphicsEngine()->GetCameraPosition(&campos);
     GraphicsEngine()->GetCameraRotation(&camrot);
+    key.flTime = flTime;
+    for (int i = 0; i < 3; i++) {
+        key.aflPosition[i] = campos[i];
+        key.aflRotation[i] = camrot[i];
+    }
+
+    return WriteCameraKey(hFile, &key);
+}
+
+// Advances the camera by one tick of the simulation
+static void MoveCamera(camera_state* pState, const bsp_compiled* pLevel) {
+    vector4 ds, dtheta;
+    vector4 campos = pState->vPosition, camrot = pState->vRotation;
+    float dt = SIM_TIMESTEP;
 
     auto vecFwd = vector4 {
         -sin(camrot[1]),
@@ -49,51 +102,54 @@ static bool MoveCamera() {
     if (Input()->IsPressed(eInputTurnRight)) {
         dtheta = dtheta + vector4{ 0, 2 * -M_PI, 0 };
     }
-    if (Input()->IsPressed(eInputQuitGame)) {
-        ret = true;
-    }
 
     ds = dt * ds;
     dtheta = dt * dtheta;
 
-    campos = campos + ds;
+    // The camera position is the negated eye position; move the eye and
+    // slide it along the walls
+    bsp_hull hull;
+    vector4 eyeStart = -1 * campos, eyeEnd;
+    MakeSphereHull(&hull, CAMERA_RADIUS);
+    SlideMove(&eyeEnd, pLevel, &hull, eyeStart, -1 * ds);
+    campos = -1 * eyeEnd;
     camrot = camrot + dtheta;
 
     camrot[0] = fmod(camrot[0], 2 * M_PI);
     camrot[1] = fmod(camrot[1], 2 * M_PI);
     camrot[2] = fmod(camrot[2], 2 * M_PI);
 
-    GraphicsEngine()->SetCameraPosition(&campos);
-    GraphicsEngine()->SetCameraRotation(&camrot);
-
-    return ret;
-}
-
-PolygonContainer From2D(int nPointPairs, int* pPoints) {
-    PolygonContainer ret;
-
-    for (int i = 0; i < nPointPairs; i++) {
-        Polygon sq;
-        auto p0x = (float)pPoints[i * 4 + 0];
-        auto p0y = (float)pPoints[i * 4 + 1];
-        auto p1x = (float)pPoints[i * 4 + 2];
-        auto p1y = (float)pPoints[i * 4 + 3];
-
-        sq += {p0x, +0.25f, p0y};
-        sq += {p0x, -0.25f, p0y};
-        sq += {p1x, -0.25f, p1y};
-        sq += {p1x, +0.25f, p1y};
-
-        ret += sq;
-    }
-
-    return ret;
+    pState->vPosition = campos;
+    pState->vRotation = camrot;
 }
 
 int main(int argc, char** argv) {
     bool bDone = false;
     PolygonContainer pc;
     HTEXTURE hSkybox;
+    bsp_build_params buildParams;
+    bsp_build_stats buildStats;
+    bsp_tree tree;
+    bsp_compiled level;
+    alloc_counters allocPrev, allocNow;
+    int nFrames = 0, nAllocFrames = 0;
+    size_t nFrameAllocs = 0;
+    bsp_cull_stats cullStats;
+    long long nNodesVisited = 0, nNodesCulled = 0, nNodesPVSCulled = 0;
+    const char* pszLevel = NULL;
+    const char* pszRecord = NULL;
+    const char* pszReplay = NULL;
+    FILE* hRecord = NULL;
+    float flRecordTime = 0;
+    std::vector<camera_key> aReplayKeys;
+    std::vector<float> aflFrameMs;
+    int nReplayFrames = 0;
+    draw_counters drawStart, drawEnd;
+    frame_pacing_params pacing;
+    bool bPacing = false;
+    frame_telemetry telemetry;
+    camera_state camPrev, camNow;
+    float flSimTime = 0;
 
     int asd[] = {
         0, 2, 1, 1,
@@ -103,14 +159,95 @@ int main(int argc, char** argv) {
         3, 4, 0, 4,
         0, 4, 0, 2,
     };
-    pc = From2D(sizeof(asd) / sizeof(int) / 4, asd);
-    auto tree = BuildBSPTree(pc);
+    DefaultFramePacingParams(&pacing);
+    for (int iArg = 1; iArg < argc; iArg++) {
+        if (strcmp(argv[iArg], "-pacing") == 0 && iArg + 1 < argc) {
+            if (!ParseFramePacing(&pacing, argv[++iArg])) {
+                Usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            bPacing = true;
+        } else if (strcmp(argv[iArg], "-record") == 0 && iArg + 1 < argc) {
+            pszRecord = argv[++iArg];
+        } else if (strcmp(argv[iArg], "-replay") == 0 && iArg + 1 < argc) {
+            pszReplay = argv[++iArg];
+        } else if (argv[iArg][0] != '-' && !pszLevel) {
+            pszLevel = argv[iArg];
+        } else {
+            Usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (pszReplay && !bPacing) {
+        // Replays time whole frames; waiting for the display would only
+        // measure its refresh rate
+        pacing.mode = eFramePacingUncapped;
+    }
+    if (pszReplay) {
+        FILE* hFile = fopen(pszReplay, "rb");
+        bool bLoaded = hFile && ReadCameraPath(hFile, &aReplayKeys) && !aReplayKeys.empty();
+        if (hFile) {
+            fclose(hFile);
+        }
+        if (!bLoaded) {
+            fprintf(stderr, "can't load the camera path '%s'\n", pszReplay);
+            return EXIT_FAILURE;
+        }
+        nReplayFrames = (int)(aReplayKeys.back().flTime / REPLAY_TIMESTEP) + 1;
+        aflFrameMs.reserve(nReplayFrames);
+    }
+
+    if (pszLevel && IsCompiledBSPFile(pszLevel)) {
+        // A tree made by bsp_compile; rendered straight from the file
+        if (!LoadCompiledBSP(&level, pszLevel)) {
+            fprintf(stderr, "the compiled tree '%s' is damaged or of another version\n", pszLevel);
+            return EXIT_FAILURE;
+        }
+        fprintf(stderr, "Loaded %s: %d nodes, %d polygons\n", pszLevel, level.nNodes, level.nPolygons);
+    } else {
+        if (pszLevel) {
+            // A map made by bsp_mapgen
+            FILE* hFile = fopen(pszLevel, "rb");
+            bool bLoaded = hFile && ReadMap(hFile, &pc);
+            if (hFile) {
+                fclose(hFile);
+            }
+            if (!bLoaded) {
+                fprintf(stderr, "can't load the map '%s'\n", pszLevel);
+                return EXIT_FAILURE;
+            }
+        } else {
+            pc = From2D(sizeof(asd) / sizeof(int) / 4, asd);
+        }
+        DefaultBSPBuildParams(&buildParams);
+        buildParams.nThreads = 0;
+        BuildBSPTree(&tree, pc, &buildParams, &buildStats);
+        PrintBSPBuildReport(stderr, &buildParams, &buildStats);
+        CompileBSPTree(&level, &tree);
+    }
+
+    // Opened once the level is loaded so that a failed load leaves no
+    // empty recording behind
+    if (pszRecord) {
+        hRecord = fopen(pszRecord, "wb");
+        if (!hRecord || !WriteCameraPathHeader(hRecord)) {
+            fprintf(stderr, "can't write the camera path '%s'\n", pszRecord);
+            if (hRecord) {
+                fclose(hRecord);
+            }
+            return EXIT_FAILURE;
+        }
+    }
 
     GraphicsEngine()->Initialize(800, 600, false);
+    GraphicsEngine()->SetFramePacing(&pacing);
     Input()->Initialize();
     GraphicsEngine()->RenderWireframe(false);
     vector4 posCamInit(-0.883, 0, -1.772);
     GraphicsEngine()->SetCameraPosition(&posCamInit);
+    camNow.vPosition = posCamInit;
+    camPrev = camNow;
 
     // Setup skybox
     char const* aSkybox[6] = {
@@ -123,17 +260,95 @@ int main(int argc, char** argv) {
     };
     GraphicsEngine()->LoadCubemapTexture(&hSkybox, aSkybox);
 
+    if (hRecord) {
+        WriteCameraFrame(hRecord, flRecordTime);
+    }
+
+    GraphicsEngine()->GetDrawCounters(&drawStart);
+    GetAllocationCounters(&allocPrev);
+    GraphicsEngine()->ResetFrameTiming();
     while (!bDone) {
         eInputAction eInput;
         int bRelease;
+        auto tFrameStart = std::chrono::steady_clock::now();
         while (Input()->GetNextInputAction(&eInput, &bRelease));
 
-        bDone = MoveCamera();
+        if (pszReplay) {
+            vector4 campos, camrot;
+            SampleCameraPath(&campos, &camrot, aReplayKeys.data(), (int)aReplayKeys.size(), nFrames * REPLAY_TIMESTEP);
+            GraphicsEngine()->SetCameraPosition(&campos);
+            GraphicsEngine()->SetCameraRotation(&camrot);
+            bDone = Input()->IsPressed(eInputQuitGame) || nFrames + 1 >= nReplayFrames;
+        } else {
+            // Run the ticks that fit into the time since the last frame
+            // and draw the camera between the last two of them
+            float dt = GraphicsEngine()->GetFrameTime();
+            vector4 campos, camrot;
+            flSimTime = fminf(flSimTime + dt, SIM_MAX_TICKS * SIM_TIMESTEP);
+            while (flSimTime >= SIM_TIMESTEP) {
+                camPrev = camNow;
+                MoveCamera(&camNow, &level);
+                flSimTime -= SIM_TIMESTEP;
+            }
+            InterpolateCamera(&campos, &camrot, camPrev.vPosition, camPrev.vRotation,
+                camNow.vPosition, camNow.vRotation, flSimTime / SIM_TIMESTEP);
+            GraphicsEngine()->SetCameraPosition(&campos);
+            GraphicsEngine()->SetCameraRotation(&camrot);
+            bDone = Input()->IsPressed(eInputQuitGame);
+            if (hRecord) {
+                flRecordTime += dt;
+                WriteCameraFrame(hRecord, flRecordTime);
+            }
+        }
 
         GraphicsEngine()->ClearScreen();
-        GraphicsEngine()->DrawBSPTree(tree);
+        GraphicsEngine()->DrawBSPTree(&level);
+        GraphicsEngine()->GetCullStats(&cullStats);
+        nNodesVisited += cullStats.nVisited;
+        nNodesCulled += cullStats.nCulled;
+        nNodesPVSCulled += cullStats.nPVSCulled;
         GraphicsEngine()->DrawSkybox(hSkybox);
         GraphicsEngine()->SwapScreen();
+        if (pszReplay) {
+            aflFrameMs.push_back(std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - tFrameStart).count());
+        }
+
+        // Steady-state frames are expected not to touch the heap
+        GetAllocationCounters(&allocNow);
+        if (nFrames >= ALLOC_WARMUP_FRAMES) {
+            size_t nAllocs = (allocNow.nAllocs - allocPrev.nAllocs) + (allocNow.nFrees - allocPrev.nFrees);
+            if (nAllocs > 0) {
+                nAllocFrames++;
+                nFrameAllocs += nAllocs;
+            }
+        }
+        allocPrev = allocNow;
+        nFrames++;
+    }
+
+    if (nFrames > 0) {
+        fprintf(stderr, "%d nodes, %.1f visited, %.1f culled by the frustum and %.1f by the PVS per frame on average\n",
+            level.nNodes, nNodesVisited / (double)nFrames, nNodesCulled / (double)nFrames,
+            nNodesPVSCulled / (double)nFrames);
+    }
+    if (nFrames > ALLOC_WARMUP_FRAMES) {
+        fprintf(stderr, "%d steady-state frames, %d of them allocated (%zu allocations and frees)\n",
+            nFrames - ALLOC_WARMUP_FRAMES, nAllocFrames, nFrameAllocs);
+    }
+    GraphicsEngine()->GetFrameTelemetry(&telemetry);
+    PrintFrameTelemetry(stderr, &telemetry);
+    if (pszReplay && nFrames > 0) {
+        frame_time_stats frameStats;
+        GraphicsEngine()->GetDrawCounters(&drawEnd);
+        ComputeFrameTimeStats(&frameStats, aflFrameMs.data(), (int)aflFrameMs.size());
+        fprintf(stderr, "Replay of %s, %.2f s of path: ", pszReplay, aReplayKeys.back().flTime);
+        PrintFrameTimeStats(stderr, &frameStats);
+        fprintf(stderr, "%.1f draw calls, %.1f draws, %.0f bytes uploaded per frame\n",
+            (drawEnd.nCalls - drawStart.nCalls) / (double)nFrames, (drawEnd.nDraws - drawStart.nDraws) / (double)nFrames,
+            (drawEnd.nUploadBytes - drawStart.nUploadBytes) / (double)nFrames);
+    }
+    if (hRecord) {
+        fclose(hRecord);
     }
 
     Input()->Shutdown();
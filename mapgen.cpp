@@ -0,0 +1,394 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include "mapgen.h"
+
+#define MAPFILE_VERSION (1)
+
+// Side of a grid room and the width of its doors
+#define ROOM_SIZE (4.0f)
+#define ROOM_DOOR (1.0f)
+// Lots of a city block are LOT_SIZE wide, there are 2x2 lots in a block
+// and STREET_WIDTH between the blocks
+#define LOT_SIZE (10.0f)
+#define STREET_WIDTH (4.0f)
+
+struct map_file_header {
+    char szMagic[4];
+    uint32_t uVersion;
+    uint32_t nPolygons;
+    uint32_t nVertices;
+};
+
+struct mapgen_context {
+    PolygonContainer* pc;
+    const mapgen_params* pParams;
+    unsigned uRandom;
+    int nWalls;
+    // The walls of a group are rotated around its origin
+    float flOriginX, flOriginZ;
+    float flCos, flSin;
+};
+
+static unsigned NextRandom(mapgen_context* pCtx) {
+    // xorshift32
+    unsigned x = pCtx->uRandom;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    pCtx->uRandom = x;
+    return x;
+}
+
+static float RandomFloat(mapgen_context* pCtx, float flMin, float flMax) {
+    return flMin + (flMax - flMin) * (NextRandom(pCtx) & 0xFFFFFF) / (float)0xFFFFFF;
+}
+
+static int RandomInt(mapgen_context* pCtx, int nMax) {
+    return (int)(NextRandom(pCtx) % (unsigned)nMax);
+}
+
+static bool IsFull(const mapgen_context* pCtx) {
+    return pCtx->nWalls >= pCtx->pParams->nWalls;
+}
+
+static void BeginGroup(mapgen_context* pCtx, float flOriginX, float flOriginZ) {
+    pCtx->flOriginX = flOriginX;
+    pCtx->flOriginZ = flOriginZ;
+    if (pCtx->pParams->bAxial) {
+        pCtx->flCos = 1;
+        pCtx->flSin = 0;
+    } else {
+        float flAngle = RandomFloat(pCtx, 0, 2 * 3.1415926f);
+        pCtx->flCos = cosf(flAngle);
+        pCtx->flSin = sinf(flAngle);
+    }
+}
+
+static void AddWall(mapgen_context* pCtx, float x0, float z0, float x1, float z1) {
+    if (!IsFull(pCtx)) {
+        Polygon wall;
+        float flHalfHeight = pCtx->pParams->flWallHeight / 2;
+        float dx0 = x0 - pCtx->flOriginX, dz0 = z0 - pCtx->flOriginZ;
+        float dx1 = x1 - pCtx->flOriginX, dz1 = z1 - pCtx->flOriginZ;
+        float p0x = pCtx->flOriginX + pCtx->flCos * dx0 - pCtx->flSin * dz0;
+        float p0z = pCtx->flOriginZ + pCtx->flSin * dx0 + pCtx->flCos * dz0;
+        float p1x = pCtx->flOriginX + pCtx->flCos * dx1 - pCtx->flSin * dz1;
+        float p1z = pCtx->flOriginZ + pCtx->flSin * dx1 + pCtx->flCos * dz1;
+
+        wall += {p0x, +flHalfHeight, p0z};
+        wall += {p0x, -flHalfHeight, p0z};
+        wall += {p1x, -flHalfHeight, p1z};
+        wall += {p1x, +flHalfHeight, p1z};
+        (*pCtx->pc) += wall;
+        pCtx->nWalls++;
+    }
+}
+
+static void GenerateScatter(mapgen_context* pCtx) {
+    float flSize = 10 * sqrtf((float)pCtx->pParams->nWalls);
+
+    while (!IsFull(pCtx)) {
+        float x = RandomFloat(pCtx, 0, flSize);
+        float z = RandomFloat(pCtx, 0, flSize);
+        float flLength = RandomFloat(pCtx, 1, 8);
+
+        BeginGroup(pCtx, x, z);
+        if (RandomInt(pCtx, 2)) {
+            AddWall(pCtx, x, z, x + flLength, z);
+        } else {
+            AddWall(pCtx, x, z, x, z + flLength);
+        }
+    }
+}
+
+static void GenerateGridRooms(mapgen_context* pCtx) {
+    // Every room adds the two walls on its low X and low Z sides, with a
+    // door in each
+    int nRooms = (int)ceilf(sqrtf(pCtx->pParams->nWalls / 4.0f));
+    float flDoor0 = (ROOM_SIZE - ROOM_DOOR) / 2;
+    float flDoor1 = (ROOM_SIZE + ROOM_DOOR) / 2;
+
+    for (int iRow = 0; iRow < nRooms && !IsFull(pCtx); iRow++) {
+        for (int iCol = 0; iCol < nRooms && !IsFull(pCtx); iCol++) {
+            float x = iCol * ROOM_SIZE;
+            float z = iRow * ROOM_SIZE;
+
+            BeginGroup(pCtx, x + ROOM_SIZE / 2, z + ROOM_SIZE / 2);
+            AddWall(pCtx, x, z, x + flDoor0, z);
+            AddWall(pCtx, x + flDoor1, z, x + ROOM_SIZE, z);
+            AddWall(pCtx, x, z, x, z + flDoor0);
+            AddWall(pCtx, x, z + flDoor1, x, z + ROOM_SIZE);
+        }
+    }
+
+    // Close the far sides of the grid; these aren't rotated
+    pCtx->flCos = 1;
+    pCtx->flSin = 0;
+    for (int i = 0; i < nRooms; i++) {
+        AddWall(pCtx, nRooms * ROOM_SIZE, i * ROOM_SIZE, nRooms * ROOM_SIZE, (i + 1) * ROOM_SIZE);
+        AddWall(pCtx, i * ROOM_SIZE, nRooms * ROOM_SIZE, (i + 1) * ROOM_SIZE, nRooms * ROOM_SIZE);
+    }
+}
+
+static void GenerateMaze(mapgen_context* pCtx) {
+    // A perfect maze on an N*N grid keeps about N*N + 2N of its walls
+    int N = (int)ceilf(sqrtf((float)pCtx->pParams->nWalls));
+    int nCells = N * N;
+    // Bit 0: wall on the +X side, bit 1: wall on the +Z side, bit 2: visited
+    std::vector<unsigned char> aCells(nCells, 3);
+    std::vector<int> aStack;
+
+    // Randomized depth-first search
+    if (nCells > 0) {
+        aStack.push_back(0);
+        aCells[0] |= 4;
+    }
+    while (aStack.size() > 0) {
+        int iCell = aStack.back();
+        int x = iCell % N, z = iCell / N;
+        int aiNext[4];
+        int nNext = 0;
+
+        if (x > 0 && !(aCells[iCell - 1] & 4)) aiNext[nNext++] = iCell - 1;
+        if (x < N - 1 && !(aCells[iCell + 1] & 4)) aiNext[nNext++] = iCell + 1;
+        if (z > 0 && !(aCells[iCell - N] & 4)) aiNext[nNext++] = iCell - N;
+        if (z < N - 1 && !(aCells[iCell + N] & 4)) aiNext[nNext++] = iCell + N;
+
+        if (nNext > 0) {
+            int iNext = aiNext[RandomInt(pCtx, nNext)];
+            if (iNext == iCell - 1) {
+                aCells[iNext] &= ~1;
+            } else if (iNext == iCell + 1) {
+                aCells[iCell] &= ~1;
+            } else if (iNext == iCell - N) {
+                aCells[iNext] &= ~2;
+            } else {
+                aCells[iCell] &= ~2;
+            }
+            aCells[iNext] |= 4;
+            aStack.push_back(iNext);
+        } else {
+            aStack.pop_back();
+        }
+    }
+
+    BeginGroup(pCtx, N / 2.0f, N / 2.0f);
+    for (int i = 0; i < N; i++) {
+        AddWall(pCtx, 0, (float)i, 0, (float)(i + 1));
+        AddWall(pCtx, (float)i, 0, (float)(i + 1), 0);
+    }
+    for (int iCell = 0; iCell < nCells; iCell++) {
+        float x = (float)(iCell % N), z = (float)(iCell / N);
+        if (aCells[iCell] & 1) {
+            AddWall(pCtx, x + 1, z, x + 1, z + 1);
+        }
+        if (aCells[iCell] & 2) {
+            AddWall(pCtx, x, z + 1, x + 1, z + 1);
+        }
+    }
+}
+
+static void GenerateCityBlocks(mapgen_context* pCtx) {
+    // Four buildings of four walls in every block
+    int nBlocks = (int)ceilf(sqrtf(pCtx->pParams->nWalls / 16.0f));
+    float flBlock = 2 * LOT_SIZE + STREET_WIDTH;
+
+    for (int iRow = 0; iRow < nBlocks && !IsFull(pCtx); iRow++) {
+        for (int iCol = 0; iCol < nBlocks && !IsFull(pCtx); iCol++) {
+            for (int iLot = 0; iLot < 4; iLot++) {
+                float x0 = iCol * flBlock + (iLot & 1) * LOT_SIZE;
+                float z0 = iRow * flBlock + (iLot >> 1) * LOT_SIZE;
+                float flWidth = RandomFloat(pCtx, 4, LOT_SIZE - 1);
+                float flDepth = RandomFloat(pCtx, 4, LOT_SIZE - 1);
+                float x = x0 + RandomFloat(pCtx, 0.5f, LOT_SIZE - 0.5f - flWidth);
+                float z = z0 + RandomFloat(pCtx, 0.5f, LOT_SIZE - 0.5f - flDepth);
+
+                // Wound so that the walls face out; a building is a closed
+                // solid for leaf trees
+                BeginGroup(pCtx, x + flWidth / 2, z + flDepth / 2);
+                AddWall(pCtx, x, z, x, z + flDepth);
+                AddWall(pCtx, x, z + flDepth, x + flWidth, z + flDepth);
+                AddWall(pCtx, x + flWidth, z + flDepth, x + flWidth, z);
+                AddWall(pCtx, x + flWidth, z, x, z);
+            }
+        }
+    }
+}
+
+void DefaultMapGenParams(mapgen_params* pParams) {
+    assert(pParams);
+
+    pParams->layout = eMapLayoutMaze;
+    pParams->nWalls = 1000;
+    pParams->uSeed = 1;
+    pParams->bAxial = true;
+    pParams->flWallHeight = 0.5f;
+}
+
+void GenerateMap(PolygonContainer* pc, const mapgen_params* pParams) {
+    mapgen_context ctx;
+
+    assert(pc && pParams);
+
+    ctx.pc = pc;
+    ctx.pParams = pParams;
+    ctx.uRandom = pParams->uSeed ? pParams->uSeed : 0x6D2B79F5u;
+    ctx.nWalls = 0;
+    ctx.flOriginX = ctx.flOriginZ = 0;
+    ctx.flCos = 1;
+    ctx.flSin = 0;
+
+    if (pParams->nWalls <= 0) {
+        return;
+    }
+
+    pc->Reserve(pc->Count() + pParams->nWalls, pc->TotalVertexCount() + 4 * pParams->nWalls);
+
+    switch (pParams->layout) {
+    case eMapLayoutScatter: GenerateScatter(&ctx); break;
+    case eMapLayoutGridRooms: GenerateGridRooms(&ctx); break;
+    case eMapLayoutMaze: GenerateMaze(&ctx); break;
+    case eMapLayoutCityBlocks: GenerateCityBlocks(&ctx); break;
+    default: assert(0); break;
+    }
+}
+
+static const char* s_aszLayoutNames[eMapLayoutMax] = {
+    "scatter", "rooms", "maze", "city",
+};
+
+const char* MapLayoutName(eMapLayout layout) {
+    assert(layout >= 0 && layout < eMapLayoutMax);
+    return s_aszLayoutNames[layout];
+}
+
+eMapLayout MapLayoutFromName(const char* pszName) {
+    int ret = 0;
+    while (ret < eMapLayoutMax && strcmp(s_aszLayoutNames[ret], pszName) != 0) {
+        ret++;
+    }
+    return (eMapLayout)ret;
+}
+
+PolygonContainer From2D(int nPointPairs, int* pPoints) {
+    PolygonContainer ret;
+
+    for (int i = 0; i < nPointPairs; i++) {
+        Polygon sq;
+        auto p0x = (float)pPoints[i * 4 + 0];
+        auto p0y = (float)pPoints[i * 4 + 1];
+        auto p1x = (float)pPoints[i * 4 + 2];
+        auto p1y = (float)pPoints[i * 4 + 3];
+
+        sq += {p0x, +0.25f, p0y};
+        sq += {p0x, -0.25f, p0y};
+        sq += {p1x, -0.25f, p1y};
+        sq += {p1x, +0.25f, p1y};
+
+        ret += sq;
+    }
+
+    return ret;
+}
+
+bool WriteMap(FILE* hFile, const PolygonContainer& pc) {
+    bool ret = true;
+    map_file_header hdr = {};
+
+    assert(hFile);
+
+    memcpy(hdr.szMagic, "BSPM", sizeof(hdr.szMagic));
+    hdr.uVersion = MAPFILE_VERSION;
+    hdr.nPolygons = (uint32_t)pc.Count();
+    hdr.nVertices = (uint32_t)pc.TotalVertexCount();
+    ret = fwrite(&hdr, sizeof(hdr), 1, hFile) == 1;
+
+    for (int iPoly = 0; iPoly < pc.Count() && ret; iPoly++) {
+        uint32_t nVertices = (uint32_t)pc.VertexCount(iPoly);
+        ret = fwrite(&nVertices, sizeof(nVertices), 1, hFile) == 1;
+    }
+    for (int iPoly = 0; iPoly < pc.Count() && ret; iPoly++) {
+        auto pVertices = pc.Vertices(iPoly);
+        for (int iVtx = 0; iVtx < pc.VertexCount(iPoly) && ret; iVtx++) {
+            ret = fwrite(pVertices[iVtx].v, sizeof(float), 3, hFile) == 3;
+        }
+    }
+
+    return ret;
+}
+
+// Bytes between the position of a stream and its end, or -1 if the stream
+// can't seek, like a pipe
+static long RemainingBytes(FILE* hFile) {
+    long ret = -1;
+    long nPos = ftell(hFile);
+
+    if (nPos >= 0 && fseek(hFile, 0, SEEK_END) == 0) {
+        long nEnd = ftell(hFile);
+        if (fseek(hFile, nPos, SEEK_SET) == 0 && nEnd >= nPos) {
+            ret = nEnd - nPos;
+        }
+    }
+
+    return ret;
+}
+
+bool ReadMap(FILE* hFile, PolygonContainer* pc) {
+    bool ret = false;
+    map_file_header hdr;
+
+    assert(hFile && pc);
+
+    if (fread(&hdr, sizeof(hdr), 1, hFile) == 1 &&
+        memcmp(hdr.szMagic, "BSPM", 4) == 0 && hdr.uVersion == MAPFILE_VERSION) {
+        // The counts of the header are only trusted as far as the file has
+        // the data for them. Files get their lists reserved up front; pipes
+        // grow them as the data comes in.
+        uint64_t nSize = (uint64_t)hdr.nPolygons * sizeof(uint32_t) + (uint64_t)hdr.nVertices * 3 * sizeof(float);
+        long nRemaining = RemainingBytes(hFile);
+        std::vector<uint32_t> aCounts;
+        std::vector<vector4> aVertices;
+        PolygonContainer pcRead;
+        uint64_t nTotal = 0;
+
+        ret = nRemaining < 0 || nSize <= (uint64_t)nRemaining;
+        if (ret && nRemaining >= 0) {
+            aCounts.reserve(hdr.nPolygons);
+            pcRead.Reserve(hdr.nPolygons, hdr.nVertices);
+        }
+
+        for (uint32_t i = 0; i < hdr.nPolygons && ret; i++) {
+            uint32_t nCount;
+            ret = fread(&nCount, sizeof(nCount), 1, hFile) == 1 && nCount >= 3;
+            if (ret) {
+                aCounts.push_back(nCount);
+                nTotal += nCount;
+            }
+        }
+        ret = ret && nTotal == hdr.nVertices;
+
+        for (uint32_t i = 0; i < hdr.nPolygons && ret; i++) {
+            aVertices.clear();
+            for (uint32_t iVtx = 0; iVtx < aCounts[i] && ret; iVtx++) {
+                vector4 v;
+                ret = fread(v.v, sizeof(float), 3, hFile) == 3;
+                aVertices.push_back(v);
+            }
+            if (ret) {
+                pcRead.Add(aVertices.data(), (int)aCounts[i], PLANE_NONE);
+            }
+        }
+
+        // Nothing is added to pc unless the whole map was read
+        if (ret && pc->Count() == 0) {
+            std::swap(*pc, pcRead);
+        } else if (ret) {
+            pc->Append(pcRead);
+        }
+    }
+
+    return ret;
+}
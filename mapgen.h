@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdio.h>
+#include "util_geostruct.h"
+
+enum eMapLayout {
+    // Walls of random length and position
+    eMapLayoutScatter,
+    // Square rooms on a grid with a door in the middle of every wall
+    eMapLayoutGridRooms,
+    // A maze on a grid of unit cells, one wall per cell side
+    eMapLayoutMaze,
+    // Rectangular buildings on lots separated by streets; the walls of a
+    // building face out
+    eMapLayoutCityBlocks,
+
+    eMapLayoutMax
+};
+
+struct mapgen_params {
+    eMapLayout layout;
+    // Number of walls to make
+    int nWalls;
+    unsigned uSeed;
+    // If false, every room, building and scattered wall gets a random
+    // rotation; a maze is rotated as a whole
+    bool bAxial;
+    float flWallHeight;
+};
+
+void DefaultMapGenParams(mapgen_params* pParams);
+// Appends the walls of a map to pc as vertical quads; the same parameters
+// always make the same map
+void GenerateMap(PolygonContainer* pc, const mapgen_params* pParams);
+const char* MapLayoutName(eMapLayout layout);
+// Returns eMapLayoutMax if there is no such layout
+eMapLayout MapLayoutFromName(const char* pszName);
+
+// Makes a wall quad for every pair of points (x0, z0, x1, z1)
+PolygonContainer From2D(int nPointPairs, int* pPoints);
+
+// Map files store the polygons of a PolygonContainer: a header, the vertex
+// count of every polygon and then the vertices as three floats each, all
+// in native byte order. They can be written to and read from pipes.
+bool WriteMap(FILE* hFile, const PolygonContainer& pc);
+// Appends the polygons of a map file to pc; leaves pc as it was if the
+// file is not a whole map
+bool ReadMap(FILE* hFile, PolygonContainer* pc);
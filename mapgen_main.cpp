@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mapgen.h"
+
+#if defined(_WIN32)
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+static void Usage(const char* pszProgram) {
+    fprintf(stderr,
+        "usage: %s [-l layout] [-n walls] [-s seed] [-a] [-h height] [-o file]\n"
+        "  -l  scatter, rooms, maze or city (default: maze)\n"
+        "  -n  number of walls (default: 1000)\n"
+        "  -s  random seed (default: 1)\n"
+        "  -a  rotate rooms and buildings by arbitrary angles\n"
+        "  -h  wall height (default: 0.5)\n"
+        "  -o  output file; the map is written to stdout by default\n",
+        pszProgram);
+}
+
+int main(int argc, char** argv) {
+    mapgen_params params;
+    const char* pszOutput = NULL;
+    PolygonContainer pc;
+    FILE* hFile;
+
+    DefaultMapGenParams(&params);
+
+    for (int iArg = 1; iArg < argc; iArg++) {
+        if (strcmp(argv[iArg], "-l") == 0 && iArg + 1 < argc) {
+            params.layout = MapLayoutFromName(argv[++iArg]);
+            if (params.layout == eMapLayoutMax) {
+                fprintf(stderr, "unknown layout '%s'\n", argv[iArg]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[iArg], "-n") == 0 && iArg + 1 < argc) {
+            params.nWalls = atoi(argv[++iArg]);
+            if (params.nWalls < 1) {
+                fprintf(stderr, "the wall count must be at least 1\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[iArg], "-s") == 0 && iArg + 1 < argc) {
+            params.uSeed = (unsigned)strtoul(argv[++iArg], NULL, 0);
+        } else if (strcmp(argv[iArg], "-a") == 0) {
+            params.bAxial = false;
+        } else if (strcmp(argv[iArg], "-h") == 0 && iArg + 1 < argc) {
+            params.flWallHeight = (float)atof(argv[++iArg]);
+        } else if (strcmp(argv[iArg], "-o") == 0 && iArg + 1 < argc) {
+            pszOutput = argv[++iArg];
+        } else {
+            Usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    GenerateMap(&pc, &params);
+
+    if (pszOutput) {
+        hFile = fopen(pszOutput, "wb");
+        if (!hFile) {
+            fprintf(stderr, "can't open '%s'\n", pszOutput);
+            return EXIT_FAILURE;
+        }
+    } else {
+#if defined(_WIN32)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        hFile = stdout;
+    }
+
+    if (!WriteMap(hFile, pc)) {
+        fprintf(stderr, "failed to write the map\n");
+        return EXIT_FAILURE;
+    }
+    if (hFile != stdout) {
+        fclose(hFile);
+    }
+
+    fprintf(stderr, "%s map, seed %u, %s angles: %d walls, %d vertices\n",
+        MapLayoutName(params.layout), params.uSeed, params.bAxial ? "axial" : "arbitrary",
+        pc.Count(), pc.TotalVertexCount());
+
+    return EXIT_SUCCESS;
+}
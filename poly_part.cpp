@@ -4,45 +4,143 @@
 
 #define EPSILON (0.01f)
 
-static void EquationOfPlane(float* A, float* B, float* C, float* D, const Plane& P) {
-    // Graphics Gems 3 - Newell's Method
-    float a = 0, b = 0, c = 0;
-    float d = 0;
-    vector4 avg, N;
-
-    for (int i = 0; i < 3; i++) {
-        a +=
-            (P[i][1] - P[(i + 1) % 3][1]) *
-            (P[i][2] - P[(i + 1) % 3][2]);
-        b +=
-            (P[i][2] - P[(i + 1) % 3][2]) *
-            (P[i][0] - P[(i + 1) % 3][0]);
-        c +=
-            (P[i][0] - P[(i + 1) % 3][0]) *
-            (P[i][1] - P[(i + 1) % 3][1]);
-        avg[0] += P[i][0];
-        avg[1] += P[i][1];
-        avg[2] += P[i][2];
-    }
+static float SignedDistanceFromPlane(const vector4& P, const float aflPlane[4]) {
+    return aflPlane[0] * P[0] + aflPlane[1] * P[1] + aflPlane[2] * P[2] + aflPlane[3];
+}
+
+static void PlaneCoefficients(float aflPlane[4], const Plane& plane) {
+    vector4 N;
+    PlaneEquation(&N, &aflPlane[3], plane);
+    aflPlane[0] = N[0];
+    aflPlane[1] = N[1];
+    aflPlane[2] = N[2];
+}
 
-    N = { a, b, c };
+// Vertices classified by one ClassifyBlock call
+#if defined(__AVX__)
+#define CLASSIFY_BLOCK (8)
+#else
+#define CLASSIFY_BLOCK (4)
+#endif
 
-    avg = avg / 3.0f;
+struct classify_plane {
+#if defined(__AVX__)
+    __m256 A, B, C, D, flEps, flNegEps;
+#else
+    __m128 A, B, C, D, flEps, flNegEps;
+#endif
+};
 
-    d = dot(-1 * avg, N);
-    float lenN = N.length();
+static void ClassifyPlaneSetup(classify_plane* pPlane, const vector4& eq, float flEpsilon) {
+#if defined(__AVX__)
+    pPlane->A = _mm256_set1_ps(eq[0]);
+    pPlane->B = _mm256_set1_ps(eq[1]);
+    pPlane->C = _mm256_set1_ps(eq[2]);
+    pPlane->D = _mm256_set1_ps(eq[3]);
+    pPlane->flEps = _mm256_set1_ps(flEpsilon);
+    pPlane->flNegEps = _mm256_set1_ps(-flEpsilon);
+#else
+    pPlane->A = _mm_set1_ps(eq[0]);
+    pPlane->B = _mm_set1_ps(eq[1]);
+    pPlane->C = _mm_set1_ps(eq[2]);
+    pPlane->D = _mm_set1_ps(eq[3]);
+    pPlane->flEps = _mm_set1_ps(flEpsilon);
+    pPlane->flNegEps = _mm_set1_ps(-flEpsilon);
+#endif
+}
 
-    *A = a / lenN;
-    *B = b / lenN;
-    *C = c / lenN;
-    *D = d / lenN;
+// Sets bit i of *pFront (*pBack) if the i-th vertex of the block is in
+// front of (behind) the plane
+static void ClassifyBlock(unsigned* pFront, unsigned* pBack, const vector4* pVertices, const classify_plane& plane) {
+#if defined(__AVX__)
+    // Vertex i in the low half and i + 4 in the high half of every
+    // register, so the in-lane transpose yields X, Y and Z in vertex order
+    __m256 r0 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(pVertices[0].v)), _mm_load_ps(pVertices[4].v), 1);
+    __m256 r1 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(pVertices[1].v)), _mm_load_ps(pVertices[5].v), 1);
+    __m256 r2 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(pVertices[2].v)), _mm_load_ps(pVertices[6].v), 1);
+    __m256 r3 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(pVertices[3].v)), _mm_load_ps(pVertices[7].v), 1);
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+    __m256 t1 = _mm256_unpacklo_ps(r2, r3);
+    __m256 t2 = _mm256_unpackhi_ps(r0, r1);
+    __m256 t3 = _mm256_unpackhi_ps(r2, r3);
+    __m256 X = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 Y = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 Z = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 flDist = _mm256_add_ps(
+        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(X, plane.A), _mm256_mul_ps(Y, plane.B)), _mm256_mul_ps(Z, plane.C)),
+        plane.D);
+    *pFront = (unsigned)_mm256_movemask_ps(_mm256_cmp_ps(flDist, plane.flEps, _CMP_GT_OQ));
+    *pBack = (unsigned)_mm256_movemask_ps(_mm256_cmp_ps(flDist, plane.flNegEps, _CMP_LT_OQ));
+#else
+    __m128 X = _mm_load_ps(pVertices[0].v);
+    __m128 Y = _mm_load_ps(pVertices[1].v);
+    __m128 Z = _mm_load_ps(pVertices[2].v);
+    __m128 W = _mm_load_ps(pVertices[3].v);
+    _MM_TRANSPOSE4_PS(X, Y, Z, W);
+    __m128 flDist = _mm_add_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(X, plane.A), _mm_mul_ps(Y, plane.B)), _mm_mul_ps(Z, plane.C)),
+        plane.D);
+    *pFront = (unsigned)_mm_movemask_ps(_mm_cmpgt_ps(flDist, plane.flEps));
+    *pBack = (unsigned)_mm_movemask_ps(_mm_cmplt_ps(flDist, plane.flNegEps));
+#endif
 }
 
-static float SignedDistanceFromPlane(const vector4& P, const Plane& J) {
-    const auto Jn = normal(J);
-    const auto Jd = -dot(Jn, J[0]);
+void ClassifyPolygons(
+    unsigned char* pMasks,
+    const vector4* pVertices, const PolygonContainer::winding* pWindings, int nPolygons,
+    const vector4& eq, float flEpsilon) {
+    classify_plane plane;
+    int iPoly = 0;
+    unsigned uMask = 0;
+
+    assert(pMasks && pVertices && pWindings);
+
+    if (nPolygons > 0) {
+        int iBegin = pWindings[0].iFirstVertex;
+        int iEnd = pWindings[nPolygons - 1].iFirstVertex + pWindings[nPolygons - 1].nVertices;
+
+        ClassifyPlaneSetup(&plane, eq, flEpsilon);
 
-    return dot(Jn, P) + Jd;
+        for (int iBlock = iBegin; iBlock < iEnd; iBlock += CLASSIFY_BLOCK) {
+            unsigned uFront, uBack;
+            int nBlock = (iEnd - iBlock < CLASSIFY_BLOCK) ? iEnd - iBlock : CLASSIFY_BLOCK;
+
+            if (nBlock == CLASSIFY_BLOCK) {
+                ClassifyBlock(&uFront, &uBack, pVertices + iBlock, plane);
+            } else {
+                // Don't read past the end of the vertex buffer
+                vector4 aTail[CLASSIFY_BLOCK];
+                for (int iVtx = 0; iVtx < nBlock; iVtx++) {
+                    aTail[iVtx] = pVertices[iBlock + iVtx];
+                }
+                ClassifyBlock(&uFront, &uBack, aTail, plane);
+            }
+
+            // Merge the bits into the masks of the polygons overlapping
+            // the block
+            while (iPoly < nPolygons) {
+                auto& w = pWindings[iPoly];
+                int iLo = ((w.iFirstVertex > iBlock) ? w.iFirstVertex : iBlock) - iBlock;
+                int iHi = ((w.iFirstVertex + w.nVertices < iBlock + nBlock) ? w.iFirstVertex + w.nVertices : iBlock + nBlock) - iBlock;
+                unsigned uBits = ((1u << iHi) - 1) & ~((1u << iLo) - 1);
+
+                if (uFront & uBits) {
+                    uMask |= POLYSIDE_FRONT;
+                }
+                if (uBack & uBits) {
+                    uMask |= POLYSIDE_BACK;
+                }
+                if (w.iFirstVertex + w.nVertices > iBlock + nBlock) {
+                    // Continues in the next block
+                    break;
+                }
+                pMasks[iPoly++] = (unsigned char)uMask;
+                uMask = 0;
+            }
+        }
+    }
+
+    assert(iPoly == nPolygons);
 }
 
 #define DISTSIGN(d) \
@@ -56,19 +154,22 @@ bool PartitionPolygonByPlane(Polygon* pFront, Polygon* pBack, const Polygon& pol
     int xpi = 0;
     LineContainer lc0, lc1;
     Line l0, l1;
+    float co[4];
+
+    PlaneCoefficients(co, plane);
 
     for(auto it = poly.begin(); it != poly.end(); ++it) {
         bool bIntersection = false;
         auto it2 = it;
-        auto& edge = *it;
-        auto& nextEdge = *(++it2);
+        auto edge = *it;
+        auto nextEdge = *(++it2);
         auto& V1 = edge[0];
         auto& V2 = edge[1];
         auto& V3 = nextEdge[1];
 
         assert(V2 != V3);
-        const int dist0 = DISTSIGN(SignedDistanceFromPlane(edge[0], plane));
-        const int dist1 = DISTSIGN(SignedDistanceFromPlane(edge[1], plane));
+        const int dist0 = DISTSIGN(SignedDistanceFromPlane(edge[0], co));
+        const int dist1 = DISTSIGN(SignedDistanceFromPlane(edge[1], co));
 
         // Is there an intersection?
         if (dist0 != dist1) {
@@ -89,7 +190,7 @@ bool PartitionPolygonByPlane(Polygon* pFront, Polygon* pBack, const Polygon& pol
                 lc1 += l1;
             }
             else if (dist1 == 0) {
-                const int dist2 = DISTSIGN(SignedDistanceFromPlane(nextEdge[1], plane));
+                const int dist2 = DISTSIGN(SignedDistanceFromPlane(nextEdge[1], co));
                 if (dist2 != 0) {
                     // Case 8b
                     if (dist0 == 1) {
@@ -136,6 +237,125 @@ bool PartitionPolygonByPlane(Polygon* pFront, Polygon* pBack, const Polygon& pol
 }
 
 bool SplitPolygon2(Polygon* pFront, Polygon* pBack, const Polygon& poly, const Plane& P) {
+    float co[4];
+    PlaneCoefficients(co, P);
+    return SplitPolygon2(pFront, pBack, poly, co);
+}
+
+// Vertices closer to the splitting plane than this are on it; the same as
+// the epsilon the builder classifies polygons with
+#define SPLIT_EPSILON (0.001f)
+
+// Clips a winding against the plane in one walk around it,
+// Sutherland-Hodgman style: vertices on the plane go to both pieces and
+// every edge crossing the plane adds the intersection point to both. The
+// pieces go to reused scratch lists, so the winding may be in a container
+// the caller appends them to.
+static bool ClipWinding(
+    std::vector<vector4>** ppFront, std::vector<vector4>** ppBack,
+    const vector4* pVertices, int nVertices, const float P[4]) {
+    static thread_local std::vector<float> aflDist;
+    static thread_local std::vector<int> aiSide;
+    static thread_local std::vector<vector4> aFront, aBack;
+    bool ret = false;
+    int nFront = 0, nBack = 0;
+
+    aflDist.resize(nVertices);
+    aiSide.resize(nVertices);
+    for (int iVtx = 0; iVtx < nVertices; iVtx++) {
+        aflDist[iVtx] = SignedDistanceFromPlane(pVertices[iVtx], P);
+        if (aflDist[iVtx] > SPLIT_EPSILON) {
+            aiSide[iVtx] = 1;
+            nFront++;
+        } else if (aflDist[iVtx] < -SPLIT_EPSILON) {
+            aiSide[iVtx] = -1;
+            nBack++;
+        } else {
+            aiSide[iVtx] = 0;
+        }
+    }
+
+    if (nFront > 0 && nBack > 0) {
+        aFront.clear();
+        aBack.clear();
+
+        for (int iVtx = 0; iVtx < nVertices; iVtx++) {
+            int iNext = (iVtx + 1) % nVertices;
+            auto P0 = pVertices[iVtx];
+
+            if (aiSide[iVtx] >= 0) {
+                aFront.push_back(P0);
+            }
+            if (aiSide[iVtx] <= 0) {
+                aBack.push_back(P0);
+            }
+
+            if (aiSide[iVtx] * aiSide[iNext] < 0) {
+                auto P1 = pVertices[iNext];
+                float t = aflDist[iVtx] / (aflDist[iVtx] - aflDist[iNext]);
+                auto xp = P0 + t * (P1 - P0);
+                aFront.push_back(xp);
+                aBack.push_back(xp);
+            }
+        }
+
+        // A convex winding gains at most two vertices
+        assert((int)aFront.size() <= nVertices + 2 && (int)aBack.size() <= nVertices + 2);
+        *ppFront = &aFront;
+        *ppBack = &aBack;
+        ret = true;
+    }
+
+    return ret;
+}
+
+bool SplitWinding(
+    PolygonContainer* pcFront, PolygonContainer* pcBack,
+    const vector4* pVertices, int nVertices, HPLANE hPlane, const float P[4]) {
+    bool ret;
+    std::vector<vector4> *pFront, *pBack;
+
+    assert(pcFront && pcBack && pVertices);
+
+    ret = ClipWinding(&pFront, &pBack, pVertices, nVertices, P);
+    if (ret) {
+        pcFront->Add(pFront->data(), (int)pFront->size(), hPlane);
+        pcBack->Add(pBack->data(), (int)pBack->size(), hPlane);
+    }
+
+    return ret;
+}
+
+bool SplitPolygon2(Polygon* pFront, Polygon* pBack, const Polygon& poly, const float P[4]) {
+    bool ret;
+    vector4 aVertices[POLYGON_MAX_POINTS];
+    std::vector<vector4> *pFrontVertices, *pBackVertices;
+
+    assert(pFront && pBack);
+
+    for (int iVtx = 0; iVtx < poly.Count(); iVtx++) {
+        aVertices[iVtx] = poly[iVtx];
+    }
+    ret = ClipWinding(&pFrontVertices, &pBackVertices, aVertices, poly.Count(), P);
+    if (ret) {
+        // Polygon can't hold what doesn't fit; use SplitWinding for those
+        assert(pFrontVertices->size() <= POLYGON_MAX_POINTS && pBackVertices->size() <= POLYGON_MAX_POINTS);
+        *pFront = Polygon();
+        *pBack = Polygon();
+        for (auto& v : *pFrontVertices) {
+            *pFront += v;
+        }
+        for (auto& v : *pBackVertices) {
+            *pBack += v;
+        }
+    }
+
+    return ret;
+}
+
+// The old splitter: collects the edges of both pieces as loose segments
+// and rebuilds the windings with FromLines
+bool SplitPolygonLines(Polygon* pFront, Polygon* pBack, const Polygon& poly, const float P[4]) {
     bool ret = false;
     int iVtx;
     int iVtx0Class;
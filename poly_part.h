@@ -2,4 +2,22 @@
 
 #include "bsp.h"
 
-bool PartitionPolygonByPlane(Polygon* front, Polygon* back, const Polygon& poly, const Plane& plane);
\ No newline at end of file
+bool PartitionPolygonByPlane(Polygon* front, Polygon* back, const Polygon& poly, const Plane& plane);
+// Same as SplitPolygon2, but builds the pieces from line segments through
+// FromLines; kept to compare against in bsp_bench
+bool SplitPolygonLines(Polygon* front, Polygon* back, const Polygon& poly, const float plane[4]);
+
+// Bits of the masks written by ClassifyPolygons; a polygon with neither
+// bit set lies on the plane, one with both spans it
+#define POLYSIDE_FRONT (1)
+#define POLYSIDE_BACK (2)
+#define POLYSIDE_SPANNING (POLYSIDE_FRONT | POLYSIDE_BACK)
+
+// Classifies nPolygons windings against the normalized plane equation eq
+// and writes one POLYSIDE_* mask per polygon into pMasks. Vertices closer
+// to the plane than flEpsilon are on it. The windings must follow each
+// other in pVertices, like those of a PolygonContainer do.
+void ClassifyPolygons(
+    unsigned char* pMasks,
+    const vector4* pVertices, const PolygonContainer::winding* pWindings, int nPolygons,
+    const vector4& eq, float flEpsilon);
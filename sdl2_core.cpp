@@ -10,9 +10,16 @@
 #include "util_matrix.h"
 #include "util_vector.h"
 #include "bsp.h"
+#include "bsp_render.h"
+#include "util_arena.h"
 
 #include "stb_image.h"
 
+// MVP matrix, camera position and camera direction of a draw
+#define DRAW_UNIFORM_BYTES (16 * sizeof(float) + 2 * 4 * sizeof(float))
+// MVP matrix and sampler of the skybox
+#define SKYBOX_UNIFORM_BYTES (16 * sizeof(float) + sizeof(GLint))
+
 static bool ReadEntireFileIntoMemory(char const* pchPath, char** pContents, unsigned* pLen) {
     bool bRet = false;
 
@@ -56,11 +63,13 @@ public:
             SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
             SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1);
             SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 4);
-            SDL_GL_SetSwapInterval(-1);
             //SDL_SetRelativeMouseMode(SDL_TRUE);
 
             m_pGLCTX = SDL_GL_CreateContext(m_pWnd);
             gladLoadGLLoader(SDL_GL_GetProcAddress);
+            // The swap interval belongs to the context, so it can only be
+            // set once there is one
+            SetSwapInterval();
 
             SetupProjection(nScreenWidth, nScreenHeight, M_PI / 4.0f);
             LoadBasicShader();
@@ -73,6 +82,7 @@ public:
             glDepthFunc(GL_LEQUAL);
             glClearDepth(1.0f);
             glViewport(0, 0, nScreenWidth, nScreenHeight);
+            m_bShutdown = false;
         }
     }
 
@@ -91,16 +101,13 @@ public:
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     }
 
-    virtual void DrawPolygonSet(PolygonContainer const* pPolySet) override {
-        unsigned int iVAO;
-        unsigned int aiVBO[2];
+    virtual void DrawPolygonSet(vector4 const* pVertices, PolygonContainer::winding const* pWindings, int nPolygons) override {
         int iMVP, iCamPos, iCamDir;
         long long nTotalVertices = 0;
         math::matrix4 matMVP;
         math::matrix4 matViewRotation = MakeRotationZ(m_vCameraRotation[2]) * MakeRotationY(m_vCameraRotation[1]);
         math::matrix4 matView =
             math::translate(m_vCameraPosition[0], m_vCameraPosition[1], m_vCameraPosition[2]) * matViewRotation;
-        PolygonContainer* aPolyConts;
         unsigned nTotalFloats, nVerticesSize;
         float* aflPositions;
         float* aflNormals;
@@ -121,27 +128,24 @@ public:
         glUniform4fv(iCamPos, 1, m_vCameraPosition.v);
         glUniform4fv(iCamDir, 1, vCamViewDir.v);
 
-        // Triangulate polygons
-        aPolyConts = new PolygonContainer[pPolySet->Count()];
-        for (int i = 0; i < pPolySet->Count(); i++) {
-            aPolyConts[i] = FanTriangulate(pPolySet->GetPolygon(i));
-            for (int j = 0; j < aPolyConts[i].Count(); j++) {
-                nTotalVertices += aPolyConts[i][j].Count();
+        // Triangulate polygons as fans straight into arrays in the frame
+        // arena
+        for (int i = 0; i < nPolygons; i++) {
+            if (pWindings[i].nVertices >= 3) {
+                nTotalVertices += (pWindings[i].nVertices - 2) * 3;
             }
         }
-
-        // Upload triangles into one VAO/VBO
         nTotalFloats = nTotalVertices * 3;
-        aflPositions = new float[nTotalFloats];
-        aflNormals = new float[nTotalFloats];
+        aflPositions = (float*)m_frameArena.Alloc(nTotalFloats * sizeof(float));
+        aflNormals = (float*)m_frameArena.Alloc(nTotalFloats * sizeof(float));
         iOffArray = 0;
-        for (int iPolyContIdx = 0; iPolyContIdx < pPolySet->Count(); iPolyContIdx++) {
-            auto& pc = aPolyConts[iPolyContIdx];
-            for (int iPolyIdx = 0; iPolyIdx < pc.Count(); iPolyIdx++) {
-                auto& poly = pc[iPolyIdx];
-                auto normal = poly.GetNormal();
-                for (int iVtxIdx = 0; iVtxIdx < poly.Count(); iVtxIdx++, iOffArray += 3) {
-                    auto& point = poly[iVtxIdx];
+        for (int i = 0; i < nPolygons; i++) {
+            auto pV = pVertices + pWindings[i].iFirstVertex;
+            for (int iVtx = 1; iVtx < pWindings[i].nVertices - 1; iVtx++) {
+                vector4 const* apTriangle[3] = { &pV[0], &pV[iVtx], &pV[iVtx + 1] };
+                auto normal = cross(pV[iVtx] - pV[0], pV[iVtx] - pV[iVtx + 1]);
+                for (int iCorner = 0; iCorner < 3; iCorner++, iOffArray += 3) {
+                    auto& point = *apTriangle[iCorner];
                     aflPositions[iOffArray + 0] = point[0];
                     aflPositions[iOffArray + 1] = point[1];
                     aflPositions[iOffArray + 2] = point[2];
@@ -152,81 +156,133 @@ public:
             }
         }
 
+        // Upload triangles into the streaming buffers, orphaning last
+        // frame's contents
         nVerticesSize = nTotalVertices * 3 * sizeof(float);
-        glGenVertexArrays(1, &iVAO);
-        glBindVertexArray(iVAO);
-        glGenBuffers(2, aiVBO);
+        if (!m_iStreamVAO) {
+            glGenVertexArrays(1, &m_iStreamVAO);
+            glGenBuffers(2, m_aiStreamVBO);
+        }
+        glBindVertexArray(m_iStreamVAO);
 
-        glBindBuffer(GL_ARRAY_BUFFER, aiVBO[0]);
+        glBindBuffer(GL_ARRAY_BUFFER, m_aiStreamVBO[0]);
         glBufferData(GL_ARRAY_BUFFER, nVerticesSize, aflPositions, GL_STREAM_DRAW);
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), NULL);
         glEnableVertexAttribArray(0);
 
-        glBindBuffer(GL_ARRAY_BUFFER, aiVBO[1]);
+        glBindBuffer(GL_ARRAY_BUFFER, m_aiStreamVBO[1]);
         glBufferData(GL_ARRAY_BUFFER, nVerticesSize, aflNormals, GL_STREAM_DRAW);
         glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), NULL);
         glEnableVertexAttribArray(1);
 
-        delete[] aflPositions;
-        delete[] aflNormals;
-
         // Draw call
 
         glDrawArrays(GL_TRIANGLES, 0, nTotalVertices);
 
-        glDeleteBuffers(2, aiVBO);
-        glDeleteVertexArrays(1, &iVAO);
-
-        delete[] aPolyConts;
-    }
-
-    void DrawBSPNodeBackToFront(bsp_node const* pTree) {
-        if (pTree) {
-            int side = WhichSide(
-                PlaneFromPolygon(pTree->list[0]),
-                m_vCameraPosition);
-            if (side == SIDE_FRONT) {
-                DrawBSPNodeBackToFront(pTree->back);
-                DrawPolygonSet(&(pTree->list));
-                DrawBSPNodeBackToFront(pTree->front);
-            } else if (side == SIDE_BACK) {
-                DrawBSPNodeBackToFront(pTree->front);
-                DrawPolygonSet(&(pTree->list));
-                DrawBSPNodeBackToFront(pTree->back);
-
-            } else if (side == SIDE_ON) {
-                DrawBSPNodeBackToFront(pTree->front);
-                DrawBSPNodeBackToFront(pTree->back);
+        m_drawCounters.nCalls++;
+        m_drawCounters.nDraws++;
+        m_drawCounters.nUploadBytes += 2 * nVerticesSize + DRAW_UNIFORM_BYTES;
+    }
+
+    // Uploads the vertices and triangles of the tree into one vertex and
+    // one index buffer that stay on the GPU until another tree is drawn
+    void UploadLevelMesh(bsp_compiled const* pTree) {
+        std::vector<float> aflVertices(pTree->nVertices * 6);
+
+        if (!m_iLevelVAO) {
+            glGenVertexArrays(1, &m_iLevelVAO);
+            glGenBuffers(1, &m_iLevelVBO);
+            glGenBuffers(1, &m_iLevelIBO);
+        }
+
+        // Position and normal of every vertex; all vertices of a polygon
+        // get the normal of its first triangle
+        for (int iPoly = 0; iPoly < pTree->nPolygons; iPoly++) {
+            auto& w = pTree->pWindings[iPoly];
+            auto pV = pTree->pVertices + w.iFirstVertex;
+            auto normal = cross(pV[1] - pV[0], pV[1] - pV[2]);
+            for (int iVtx = 0; iVtx < w.nVertices; iVtx++) {
+                auto pfl = &aflVertices[(w.iFirstVertex + iVtx) * 6];
+                pfl[0] = pV[iVtx][0];
+                pfl[1] = pV[iVtx][1];
+                pfl[2] = pV[iVtx][2];
+                pfl[3] = normal[0];
+                pfl[4] = normal[1];
+                pfl[5] = normal[2];
             }
         }
+
+        glBindVertexArray(m_iLevelVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, m_iLevelVBO);
+        glBufferData(GL_ARRAY_BUFFER, aflVertices.size() * sizeof(float), aflVertices.data(), GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), NULL);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
+        glEnableVertexAttribArray(1);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_iLevelIBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, pTree->nIndices * sizeof(uint32_t), pTree->pIndices, GL_STATIC_DRAW);
+
+        BSPResetView(&m_view, pTree);
+
+        m_pLevelTree = pTree;
+        m_pLevelIndices = pTree->pIndices;
+        m_nLevelIndices = pTree->nIndices;
     }
 
-    void DrawBSPNodeFrontToBack(bsp_node const* pTree) {
-        int iSide;
-        if (pTree) {
-            iSide = WhichSide(PlaneFromPolygon(pTree->list[0]), m_vCameraPosition);
-
-            switch (iSide) {
-            case SIDE_FRONT:
-                DrawBSPNodeFrontToBack(pTree->front);
-                DrawPolygonSet(&(pTree->list));
-                DrawBSPNodeFrontToBack(pTree->back);
-                break;
-            case SIDE_BACK:
-                DrawBSPNodeFrontToBack(pTree->back);
-                DrawPolygonSet(&(pTree->list));
-                DrawBSPNodeFrontToBack(pTree->front);
-                break;
-            case SIDE_ON:
-                DrawBSPNodeBackToFront(pTree->back);
-                DrawBSPNodeBackToFront(pTree->front);
-                break;
+    virtual void DrawBSPTree(bsp_compiled const* pTree) {
+        int iMVP, iCamPos, iCamDir;
+        math::matrix4 matViewRotation = MakeRotationZ(m_vCameraRotation[2]) * MakeRotationY(m_vCameraRotation[1]);
+        math::matrix4 matView =
+            math::translate(m_vCameraPosition[0], m_vCameraPosition[1], m_vCameraPosition[2]) * matViewRotation;
+        math::matrix4 matMVP = matView * m_matProj;
+        vector4 vCamViewDir = matViewRotation * vector4(0, 0, -1);
+
+        if (pTree->nNodes > 0) {
+            if (pTree != m_pLevelTree || pTree->pIndices != m_pLevelIndices || pTree->nIndices != m_nLevelIndices) {
+                UploadLevelMesh(pTree);
+                m_drawCounters.nUploadBytes += pTree->nVertices * 6 * sizeof(float) + pTree->nIndices * sizeof(uint32_t);
+            }
+
+            // The view matrix moves the world by the camera position, so
+            // the eye is at its negation
+            vector4 vEye(-m_vCameraPosition[0], -m_vCameraPosition[1], -m_vCameraPosition[2], 1);
+            BSPDrawRangesOfView(&m_view, pTree, vEye, matMVP, &m_cullStats);
+            auto& aDrawRanges = m_view.aRanges;
+
+            auto aDrawCounts = (GLsizei*)m_frameArena.Alloc(aDrawRanges.size() * sizeof(GLsizei));
+            auto aDrawOffsets = (const void**)m_frameArena.Alloc(aDrawRanges.size() * sizeof(const void*));
+            for (size_t i = 0; i < aDrawRanges.size(); i++) {
+                aDrawCounts[i] = (GLsizei)aDrawRanges[i].nIndices;
+                aDrawOffsets[i] = (const void*)(aDrawRanges[i].iFirstIndex * sizeof(uint32_t));
             }
+
+            glUseProgram(m_iShaderProgram);
+            iMVP = glGetUniformLocation(m_iShaderProgram, "matMVP");
+            iCamPos = glGetUniformLocation(m_iShaderProgram, "posCamera");
+            iCamDir = glGetUniformLocation(m_iShaderProgram, "dirCamera");
+            glUniformMatrix4fv(iMVP, 1, GL_FALSE, matMVP.ptr());
+            glUniform4fv(iCamPos, 1, m_vCameraPosition.v);
+            glUniform4fv(iCamDir, 1, vCamViewDir.v);
+
+            glBindVertexArray(m_iLevelVAO);
+            glMultiDrawElements(GL_TRIANGLES, aDrawCounts, GL_UNSIGNED_INT, aDrawOffsets, (GLsizei)aDrawRanges.size());
+
+            m_drawCounters.nCalls++;
+            m_drawCounters.nDraws += aDrawRanges.size();
+            m_drawCounters.nUploadBytes += aDrawRanges.size() * (sizeof(GLsizei) + sizeof(const void*)) + DRAW_UNIFORM_BYTES;
         }
     }
 
-    virtual void DrawBSPTree(bsp_node const* pTree) {
-        DrawBSPNodeFrontToBack(pTree);
+    virtual void GetCullStats(bsp_cull_stats* pStats) override {
+        if (pStats) {
+            *pStats = m_cullStats;
+        }
+    }
+
+    virtual void GetDrawCounters(draw_counters* pCounters) override {
+        if (pCounters) {
+            *pCounters = m_drawCounters;
+        }
     }
 
     virtual void SetCameraPosition(vector4 const* pPos) override {
@@ -315,12 +371,41 @@ public:
     }
 
     virtual void SwapScreen() {
-        m_tLast = m_tNow;
-        m_tNow = SDL_GetPerformanceCounter();
-        m_flFrameTime = (float)(((m_tNow - m_tLast)) / (double)SDL_GetPerformanceFrequency());
-
+        m_scheduler.EndWork();
         SDL_GL_SwapWindow(m_pWnd);
-        SDL_Delay(30); // TODO:
+        m_scheduler.EndFrame();
+        m_flFrameTime = m_scheduler.FrameTime();
+
+        m_frameArena.Reset();
+    }
+
+    virtual void SetFramePacing(const frame_pacing_params* pParams) override {
+        m_scheduler.SetParams(pParams);
+        if (!m_bShutdown) {
+            SetSwapInterval();
+        }
+    }
+
+    virtual void ResetFrameTiming() override {
+        m_scheduler.Reset();
+        m_flFrameTime = 0;
+    }
+
+    virtual void GetFrameTelemetry(frame_telemetry* pTelemetry) override {
+        m_scheduler.GetTelemetry(pTelemetry);
+    }
+
+    // Waits for the display only when pacing by vsync; adaptive vsync
+    // where the driver has it, so a late frame tears instead of waiting a
+    // whole refresh
+    void SetSwapInterval() {
+        if (m_scheduler.Params().mode == eFramePacingVSync) {
+            if (SDL_GL_SetSwapInterval(-1) != 0) {
+                SDL_GL_SetSwapInterval(1);
+            }
+        } else {
+            SDL_GL_SetSwapInterval(0);
+        }
     }
 
     void SetupProjection(int nWidth, int nHeight, float flFov) {
@@ -519,6 +604,10 @@ public:
         glUniform1i(iTex, 0);
 
         glDrawArrays(GL_TRIANGLES, 0, 36);
+
+        m_drawCounters.nCalls++;
+        m_drawCounters.nDraws++;
+        m_drawCounters.nUploadBytes += SKYBOX_UNIFORM_BYTES;
     }
 
 private:
@@ -527,8 +616,8 @@ private:
     SDL_Renderer* m_pRenderer;
     bool m_bShutdown = true;
 
-    Uint64 m_tNow, m_tLast;
-    float m_flFrameTime;
+    CFrameScheduler m_scheduler;
+    float m_flFrameTime = 0;
 
     math::matrix4 m_matProj;
     vector4 m_vCameraPosition, m_vCameraRotation;
@@ -537,6 +626,23 @@ private:
     GLuint m_iProgramSkybox;
     GLuint m_iVAOSkybox;
 
+    // Mesh of the last tree drawn
+    bsp_compiled const* m_pLevelTree = NULL;
+    const uint32_t* m_pLevelIndices = NULL;
+    int m_nLevelIndices = 0;
+    GLuint m_iLevelVAO = 0, m_iLevelVBO = 0, m_iLevelIBO = 0;
+    bsp_view m_view;
+    bsp_cull_stats m_cullStats = { 0, 0, 0, 0 };
+
+    draw_counters m_drawCounters = { 0, 0, 0 };
+
+    // Buffers of DrawPolygonSet, refilled on every call
+    GLuint m_iStreamVAO = 0;
+    GLuint m_aiStreamVBO[2] = { 0, 0 };
+
+    // Transient data of the frame being drawn; reset by SwapScreen
+    CArena m_frameArena;
+
     bool m_bActionActive[eInputLast] = { false };
 
     std::vector<GLuint> m_aTextures;
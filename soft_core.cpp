@@ -0,0 +1,242 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <chrono>
+#include "soft_core.h"
+#include "stb_image.h"
+#include "util_matrix.h"
+
+static double Now() {
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+}
+
+// Color basic.frag gives a polygon with the normal n
+static uint32_t ShadePolygon(const vector4& vCameraDir, const float* n) {
+    float flNormalCameraDot = vCameraDir[0] * n[0] + vCameraDir[1] * n[1] + vCameraDir[2] * n[2];
+    if (flNormalCameraDot < 0) {
+        flNormalCameraDot = 0;
+    }
+    return SoftColor(0.5f + 0.5f * flNormalCameraDot, 0.5f, 0.2f, 1.0f);
+}
+
+CSoftwareCore::CSoftwareCore() {
+    m_pszOutput = getenv("BSP_SOFT_OUTPUT");
+}
+
+void CSoftwareCore::Initialize(int nScreenWidth, int nScreenHeight, bool bFullscreen) {
+    if (m_bShutdown) {
+        m_raster.Resize(nScreenWidth, nScreenHeight);
+        if (!m_pPool) {
+            auto pszThreads = getenv("BSP_SOFT_THREADS");
+            m_pPool.reset(new CTaskPool(pszThreads ? atoi(pszThreads) : 0));
+        }
+        m_flRasterMs = 0;
+        m_nRasterFrames = 0;
+    }
+    CHeadlessCore::Initialize(nScreenWidth, nScreenHeight, bFullscreen);
+}
+
+void CSoftwareCore::Shutdown() {
+    if (!m_bShutdown && m_nRasterFrames > 0) {
+        fprintf(stderr, "Software raster: %dx%d, %d threads, %d frames, avg %.3f ms, %.1f fps\n",
+            m_raster.Width(), m_raster.Height(), m_pPool->ThreadCount(), m_nRasterFrames,
+            m_flRasterMs / m_nRasterFrames, 1000.0 * m_nRasterFrames / m_flRasterMs);
+    }
+    CHeadlessCore::Shutdown();
+}
+
+void CSoftwareCore::ClearScreen() {
+    // glClearColor is never set, so the GL backend clears to black
+    m_raster.Clear(SoftColor(0, 0, 0, 0));
+    m_pSky = NULL;
+}
+
+void CSoftwareCore::SwapScreen() {
+    double t0 = Now();
+    m_raster.Flush(m_pPool.get(), m_pSky ? SkyColors : NULL, this);
+    m_flLastRasterMs = Now() - t0;
+    m_flRasterMs += m_flLastRasterMs;
+    m_nRasterFrames++;
+
+    if (m_pszOutput) {
+        char szPath[512];
+        snprintf(szPath, sizeof(szPath), m_pszOutput, FrameCount());
+        if (!WriteFrame(szPath)) {
+            fprintf(stderr, "can't write '%s'\n", szPath);
+        }
+    }
+
+    m_pSky = NULL;
+    CHeadlessCore::SwapScreen();
+}
+
+bool CSoftwareCore::WriteFrame(const char* pszPath) const {
+    return WriteSoftTGA(pszPath, m_raster.Pixels(), m_raster.Width(), m_raster.Height(), m_raster.Stride());
+}
+
+void CSoftwareCore::SubmitTriangles(const float* aflPositions, const float* aflNormals, long long nVertices,
+    const math::matrix4& matMVP, const vector4& vCameraDir) {
+    for (long long iVtx = 0; iVtx + 3 <= nVertices; iVtx += 3) {
+        auto pfl = aflPositions + iVtx * 3;
+        m_raster.AddTriangle(
+            matMVP * vector4(pfl[0], pfl[1], pfl[2], 1),
+            matMVP * vector4(pfl[3], pfl[4], pfl[5], 1),
+            matMVP * vector4(pfl[6], pfl[7], pfl[8], 1),
+            ShadePolygon(vCameraDir, aflNormals + iVtx * 3));
+    }
+}
+
+void CSoftwareCore::SubmitRanges(bsp_compiled const* pTree, const bsp_draw_range* pRanges, int nRanges,
+    const math::matrix4& matMVP, const vector4& vCameraDir) {
+    const float* aflVertices = m_aflLevelVertices.data();
+
+    for (int iRange = 0; iRange < nRanges; iRange++) {
+        auto pIndices = pTree->pIndices + pRanges[iRange].iFirstIndex;
+        for (int i = 0; i + 3 <= (int)pRanges[iRange].nIndices; i += 3) {
+            auto pV0 = aflVertices + pIndices[i + 0] * 6;
+            auto pV1 = aflVertices + pIndices[i + 1] * 6;
+            auto pV2 = aflVertices + pIndices[i + 2] * 6;
+            m_raster.AddTriangle(
+                matMVP * vector4(pV0[0], pV0[1], pV0[2], 1),
+                matMVP * vector4(pV1[0], pV1[1], pV1[2], 1),
+                matMVP * vector4(pV2[0], pV2[1], pV2[2], 1),
+                ShadePolygon(vCameraDir, pV0 + 3));
+        }
+    }
+}
+
+int CSoftwareCore::LoadCubemapTexture(HTEXTURE* pHandle, char const* pchPathFaces[6]) {
+    int ret = 1;
+    int nChannels;
+    soft_cubemap cubemap;
+
+    assert(pHandle != NULL);
+    assert(pchPathFaces != NULL);
+
+    for (int i = 0; i < 6; i++) {
+        assert(pchPathFaces[i] != NULL);
+        cubemap.anWidth[i] = cubemap.anHeight[i] = 0;
+        auto pImage = stbi_load(pchPathFaces[i], &cubemap.anWidth[i], &cubemap.anHeight[i], &nChannels, STBI_rgb);
+        if (pImage) {
+            cubemap.aFaces[i].assign(pImage, pImage + cubemap.anWidth[i] * cubemap.anHeight[i] * 3);
+            stbi_image_free(pImage);
+        } else {
+            cubemap.anWidth[i] = cubemap.anHeight[i] = 0;
+            ret = 0;
+        }
+    }
+
+    *pHandle = m_aCubemaps.size();
+    m_aCubemaps.push_back(std::move(cubemap));
+
+    return ret;
+}
+
+void CSoftwareCore::DrawSkybox(HTEXTURE hCubemapTexture) {
+    assert(hCubemapTexture < m_aCubemaps.size());
+
+    // CSDL2Core draws the unit cube with matViewRotation * m_matProj and
+    // the last element set to 1, so w is 1 - z and the eye sits at z = 1
+    // of the view space rather than at the center of the cube
+    auto matViewRotation = MakeRotationZ(m_vCameraRotation[2]) * MakeRotationY(m_vCameraRotation[1]);
+    auto matInvRotation = math::transposed(matViewRotation);
+    m_vSkyOrigin = matInvRotation * vector4(0, 0, 1, 0);
+    m_vSkyRight = matInvRotation * vector4(1 / m_matProj.idx(0, 0), 0, 0, 0);
+    m_vSkyUp = matInvRotation * vector4(0, 1 / m_matProj.idx(1, 1), 0, 0);
+    m_vSkyForward = matInvRotation * vector4(0, 0, -1, 0);
+    m_pSky = &m_aCubemaps[hCubemapTexture];
+
+    CHeadlessCore::DrawSkybox(hCubemapTexture);
+}
+
+static __m128 Select(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+void CSoftwareCore::SkyColors(void* pContext, int x, int y, int nPixels, uint32_t* pColors) {
+    auto pCore = (const CSoftwareCore*)pContext;
+    auto pSky = pCore->m_pSky;
+    float flStepX = 2.0f / pCore->m_raster.Width();
+    float flX = (x + 0.5f) * flStepX - 1.0f;
+    float flY = 1.0f - (y + 0.5f) * 2.0f / pCore->m_raster.Height();
+    vector4 vDir = flX * pCore->m_vSkyRight + flY * pCore->m_vSkyUp + pCore->m_vSkyForward;
+    vector4 vStep = flStepX * pCore->m_vSkyRight;
+    const __m128 vLanes = _mm_setr_ps(0, 1, 2, 3);
+    const __m128 vSignBit = _mm_set1_ps(-0.0f);
+    const __m128 vOne = _mm_set1_ps(1.0f);
+    const __m128 vHalf = _mm_set1_ps(0.5f);
+    const __m128 vInf = _mm_set1_ps(INFINITY);
+    __m128 aD[3], aStep[3], aO[3];
+
+    // Four pixels at a time
+    for (int iDim = 0; iDim < 3; iDim++) {
+        aD[iDim] = _mm_add_ps(_mm_set1_ps(vDir[iDim]), _mm_mul_ps(vLanes, _mm_set1_ps(vStep[iDim])));
+        aStep[iDim] = _mm_set1_ps(4 * vStep[iDim]);
+        aO[iDim] = _mm_set1_ps(pCore->m_vSkyOrigin[iDim]);
+    }
+
+    for (int i = 0; i < nPixels; i += 4) {
+        __m128 aSign[3], aT[3], aP[3];
+
+        // The fragment is where the ray leaves the cube, on the face of
+        // the axis that gets there first
+        for (int iDim = 0; iDim < 3; iDim++) {
+            aSign[iDim] = _mm_or_ps(_mm_and_ps(aD[iDim], vSignBit), vOne);
+            aT[iDim] = Select(_mm_cmpeq_ps(aD[iDim], _mm_setzero_ps()), vInf,
+                _mm_div_ps(_mm_sub_ps(aSign[iDim], aO[iDim]), aD[iDim]));
+        }
+        __m128 bX = _mm_and_ps(_mm_cmple_ps(aT[0], aT[1]), _mm_cmple_ps(aT[0], aT[2]));
+        __m128 bY = _mm_andnot_ps(bX, _mm_cmple_ps(aT[1], aT[2]));
+        __m128 T = _mm_min_ps(aT[0], _mm_min_ps(aT[1], aT[2]));
+        for (int iDim = 0; iDim < 3; iDim++) {
+            aP[iDim] = _mm_add_ps(aO[iDim], _mm_mul_ps(T, aD[iDim]));
+        }
+
+        // GL cube map coordinates; the major axis is 1 on the exit face
+        __m128 sc = Select(bX, _mm_xor_ps(_mm_mul_ps(aSign[0], aP[2]), vSignBit),
+            Select(bY, aP[0], _mm_mul_ps(aSign[2], aP[0])));
+        __m128 tc = Select(bY, _mm_mul_ps(aSign[1], aP[2]), _mm_xor_ps(aP[1], vSignBit));
+        __m128 vSign = Select(bX, aSign[0], Select(bY, aSign[1], aSign[2]));
+        alignas(16) float aflS[4], aflT[4];
+        _mm_store_ps(aflS, _mm_mul_ps(_mm_add_ps(sc, vOne), vHalf));
+        _mm_store_ps(aflT, _mm_mul_ps(_mm_add_ps(tc, vOne), vHalf));
+        int uX = _mm_movemask_ps(bX), uY = _mm_movemask_ps(bY), uNegative = _mm_movemask_ps(vSign);
+
+        for (int iLane = 0; iLane < 4 && i + iLane < nPixels; iLane++) {
+            int iAxis = ((uX >> iLane) & 1) ? 0 : (((uY >> iLane) & 1) ? 1 : 2);
+            int iFace = 2 * iAxis + ((uNegative >> iLane) & 1);
+            int nWidth = pSky->anWidth[iFace], nHeight = pSky->anHeight[iFace];
+            uint32_t uColor = 0xFF000000u;
+            if (nWidth > 0 && nHeight > 0) {
+                int s = (int)(aflS[iLane] * nWidth);
+                int t = (int)(aflT[iLane] * nHeight);
+                s = s < 0 ? 0 : (s >= nWidth ? nWidth - 1 : s);
+                t = t < 0 ? 0 : (t >= nHeight ? nHeight - 1 : t);
+                auto pTexel = &pSky->aFaces[iFace][(t * nWidth + s) * 3];
+                uColor |= pTexel[0] | (pTexel[1] << 8) | (pTexel[2] << 16);
+            }
+            pColors[i + iLane] = uColor;
+        }
+
+        for (int iDim = 0; iDim < 3; iDim++) {
+            aD[iDim] = _mm_add_ps(aD[iDim], aStep[iDim]);
+        }
+    }
+}
+
+#if defined(BSP_BACKEND_SOFTWARE)
+static CSoftwareCore* gpSoftwareCore = NULL;
+
+IGraphicsEngine* GraphicsEngine() {
+    if (!gpSoftwareCore) {
+        gpSoftwareCore = new CSoftwareCore;
+    }
+    return gpSoftwareCore;
+}
+
+IInputHandler* Input() {
+    if (!gpSoftwareCore) {
+        gpSoftwareCore = new CSoftwareCore;
+    }
+    return gpSoftwareCore;
+}
+#endif
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "headless_core.h"
+#include "soft_raster.h"
+
+// Headless backend that draws the frames on the CPU with CSoftRasterizer.
+// Polygons are shaded like basic.frag and the skybox is sampled along the
+// view ray. If BSP_SOFT_OUTPUT is set, every frame is written to a TGA
+// named by it as a printf pattern of the frame number, e.g. frame%04d.tga.
+// BSP_SOFT_THREADS sets the number of raster threads; 0, the default, uses
+// every hardware thread.
+class CSoftwareCore : public CHeadlessCore {
+public:
+    CSoftwareCore();
+
+    virtual void Initialize(int nScreenWidth, int nScreenHeight, bool bFullscreen) override;
+    virtual void Shutdown() override;
+
+    virtual void ClearScreen() override;
+    virtual void SwapScreen() override;
+
+    virtual int LoadCubemapTexture(HTEXTURE* pHandle, char const* pchPathFaces[6]) override;
+    virtual void DrawSkybox(HTEXTURE hCubemapTexture) override;
+
+    using CHeadlessCore::Initialize;
+
+    const CSoftRasterizer& Raster() const {
+        return m_raster;
+    }
+
+    // Time the last SwapScreen spent rasterizing
+    double LastRasterMs() const {
+        return m_flLastRasterMs;
+    }
+
+    // Writes the last frame drawn
+    bool WriteFrame(const char* pszPath) const;
+
+protected:
+    virtual void SubmitTriangles(const float* aflPositions, const float* aflNormals, long long nVertices,
+        const math::matrix4& matMVP, const vector4& vCameraDir) override;
+    virtual void SubmitRanges(bsp_compiled const* pTree, const bsp_draw_range* pRanges, int nRanges,
+        const math::matrix4& matMVP, const vector4& vCameraDir) override;
+
+private:
+    // Faces in GL order, +X, -X, +Y, -Y, +Z, -Z, as RGB rows from the top
+    struct soft_cubemap {
+        int anWidth[6], anHeight[6];
+        std::vector<uint8_t> aFaces[6];
+    };
+
+    static void SkyColors(void* pContext, int x, int y, int nPixels, uint32_t* pColors);
+
+    CSoftRasterizer m_raster;
+    std::unique_ptr<CTaskPool> m_pPool;
+    const char* m_pszOutput = NULL;
+
+    std::vector<soft_cubemap> m_aCubemaps;
+    // Skybox of the frame being drawn; its view ray through the pixel at
+    // NDC x, y is m_vSkyOrigin + t (x m_vSkyRight + y m_vSkyUp + m_vSkyForward)
+    const soft_cubemap* m_pSky = NULL;
+    vector4 m_vSkyOrigin, m_vSkyRight, m_vSkyUp, m_vSkyForward;
+
+    double m_flLastRasterMs = 0;
+    double m_flRasterMs = 0;
+    int m_nRasterFrames = 0;
+};
@@ -0,0 +1,350 @@
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <atomic>
+#include <algorithm>
+#include "soft_raster.h"
+
+// Pixels of a row shaded by one SIMD block; tiles are a whole number of
+// blocks wide
+#if defined(__AVX__)
+#define SOFT_BLOCK (8)
+typedef __m256 soft_vec;
+#else
+#define SOFT_BLOCK (4)
+typedef __m128 soft_vec;
+#endif
+
+static_assert(SOFT_TILE_SIZE % SOFT_BLOCK == 0, "tiles must be made of whole blocks");
+
+#if defined(__AVX__)
+static soft_vec VSet1(float fl) { return _mm256_set1_ps(fl); }
+static soft_vec VLanes() { return _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f); }
+static soft_vec VAdd(soft_vec a, soft_vec b) { return _mm256_add_ps(a, b); }
+static soft_vec VMul(soft_vec a, soft_vec b) { return _mm256_mul_ps(a, b); }
+static soft_vec VAnd(soft_vec a, soft_vec b) { return _mm256_and_ps(a, b); }
+static soft_vec VGreaterEqual(soft_vec a, soft_vec b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+static soft_vec VLessEqual(soft_vec a, soft_vec b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+static soft_vec VLess(soft_vec a, soft_vec b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static soft_vec VSelect(soft_vec mask, soft_vec a, soft_vec b) { return _mm256_blendv_ps(b, a, mask); }
+static soft_vec VLoad(const void* p) { return _mm256_loadu_ps((const float*)p); }
+static void VStore(void* p, soft_vec a) { _mm256_storeu_ps((float*)p, a); }
+static int VMask(soft_vec a) { return _mm256_movemask_ps(a); }
+static soft_vec VBits(uint32_t u) { return _mm256_castsi256_ps(_mm256_set1_epi32((int)u)); }
+#else
+static soft_vec VSet1(float fl) { return _mm_set1_ps(fl); }
+static soft_vec VLanes() { return _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f); }
+static soft_vec VAdd(soft_vec a, soft_vec b) { return _mm_add_ps(a, b); }
+static soft_vec VMul(soft_vec a, soft_vec b) { return _mm_mul_ps(a, b); }
+static soft_vec VAnd(soft_vec a, soft_vec b) { return _mm_and_ps(a, b); }
+static soft_vec VGreaterEqual(soft_vec a, soft_vec b) { return _mm_cmpge_ps(a, b); }
+static soft_vec VLessEqual(soft_vec a, soft_vec b) { return _mm_cmple_ps(a, b); }
+static soft_vec VLess(soft_vec a, soft_vec b) { return _mm_cmplt_ps(a, b); }
+static soft_vec VSelect(soft_vec mask, soft_vec a, soft_vec b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+static soft_vec VLoad(const void* p) { return _mm_loadu_ps((const float*)p); }
+static void VStore(void* p, soft_vec a) { _mm_storeu_ps((float*)p, a); }
+static int VMask(soft_vec a) { return _mm_movemask_ps(a); }
+static soft_vec VBits(uint32_t u) { return _mm_castsi128_ps(_mm_set1_epi32((int)u)); }
+#endif
+
+// Vertices of a triangle clipped against one plane
+#define SOFT_CLIP_VERTICES (4)
+// Triangles a frame and a tile are expected to hold, so that frames don't
+// have to grow the arrays
+#define SOFT_RESERVE_TRIANGLES (16384)
+#define SOFT_RESERVE_BIN (1024)
+
+CSoftRasterizer::CSoftRasterizer() :
+    m_nWidth(0), m_nHeight(0), m_nStride(0), m_nTilesX(0), m_nTilesY(0),
+    m_uClearColor(0), m_bClearPending(false) {
+}
+
+void CSoftRasterizer::Resize(int nWidth, int nHeight) {
+    assert(nWidth > 0 && nHeight > 0);
+
+    m_nWidth = nWidth;
+    m_nHeight = nHeight;
+    m_nStride = (nWidth + SOFT_BLOCK - 1) / SOFT_BLOCK * SOFT_BLOCK;
+    m_nTilesX = (nWidth + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    m_nTilesY = (nHeight + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    m_aColor.resize((size_t)m_nStride * nHeight);
+    m_aDepth.resize((size_t)m_nStride * nHeight);
+    m_aBins.resize(m_nTilesX * m_nTilesY);
+    for (auto& bin : m_aBins) {
+        bin.clear();
+        bin.reserve(SOFT_RESERVE_BIN);
+    }
+    m_aTriangles.clear();
+    m_aTriangles.reserve(SOFT_RESERVE_TRIANGLES);
+}
+
+void CSoftRasterizer::Clear(uint32_t uColor) {
+    m_uClearColor = uColor;
+    m_bClearPending = true;
+    for (auto& bin : m_aBins) {
+        bin.clear();
+    }
+    m_aTriangles.clear();
+}
+
+void CSoftRasterizer::AddTriangle(const vector4& v0, const vector4& v1, const vector4& v2, uint32_t uColor) {
+    const vector4* apIn[3] = { &v0, &v1, &v2 };
+    vector4 aClipped[SOFT_CLIP_VERTICES];
+    float aflDist[3];
+    int nInside = 0, nClipped = 0;
+
+    // Distances from the near plane, z = -w
+    for (int i = 0; i < 3; i++) {
+        aflDist[i] = (*apIn[i])[2] + (*apIn[i])[3];
+        nInside += aflDist[i] >= 0;
+    }
+
+    if (nInside == 3) {
+        SetupTriangle(v0, v1, v2, uColor);
+    } else if (nInside > 0) {
+        for (int i = 0; i < 3; i++) {
+            int j = (i + 1) % 3;
+            if (aflDist[i] >= 0) {
+                aClipped[nClipped++] = *apIn[i];
+            }
+            if ((aflDist[i] >= 0) != (aflDist[j] >= 0)) {
+                float t = aflDist[i] / (aflDist[i] - aflDist[j]);
+                aClipped[nClipped++] = *apIn[i] + t * (*apIn[j] - *apIn[i]);
+            }
+        }
+        for (int i = 1; i < nClipped - 1; i++) {
+            SetupTriangle(aClipped[0], aClipped[i], aClipped[i + 1], uColor);
+        }
+    }
+}
+
+void CSoftRasterizer::SetupTriangle(const vector4& v0, const vector4& v1, const vector4& v2, uint32_t uColor) {
+    const vector4* apIn[3] = { &v0, &v1, &v2 };
+    float aflX[3], aflY[3], aflZ[3];
+    soft_triangle tri;
+
+    for (int i = 0; i < 3; i++) {
+        auto& v = *apIn[i];
+        float flInvW = 1.0f / v[3];
+        aflX[i] = (v[0] * flInvW * 0.5f + 0.5f) * m_nWidth;
+        aflY[i] = (0.5f - v[1] * flInvW * 0.5f) * m_nHeight;
+        aflZ[i] = v[2] * flInvW * 0.5f + 0.5f;
+    }
+
+    // Counter-clockwise triangles face the camera; y points down here, so
+    // their area is negative
+    float flArea = (aflX[1] - aflX[0]) * (aflY[2] - aflY[0]) - (aflX[2] - aflX[0]) * (aflY[1] - aflY[0]);
+    if (!(flArea < 0)) {
+        return;
+    }
+
+    float flMinX = std::min(aflX[0], std::min(aflX[1], aflX[2]));
+    float flMaxX = std::max(aflX[0], std::max(aflX[1], aflX[2]));
+    float flMinY = std::min(aflY[0], std::min(aflY[1], aflY[2]));
+    float flMaxY = std::max(aflY[0], std::max(aflY[1], aflY[2]));
+    tri.nMinX = (int)floorf(std::max(flMinX, 0.0f));
+    tri.nMinY = (int)floorf(std::max(flMinY, 0.0f));
+    tri.nMaxX = (int)ceilf(std::min(flMaxX, (float)(m_nWidth - 1)));
+    tri.nMaxY = (int)ceilf(std::min(flMaxY, (float)(m_nHeight - 1)));
+    if (tri.nMinX > tri.nMaxX || tri.nMinY > tri.nMaxY) {
+        return;
+    }
+
+    // Edge i runs from vertex i to the next one and is positive inside.
+    // Pixels on an edge belong to the triangle only if it's a left edge or
+    // a horizontal top edge.
+    float flTotal = -flArea;
+    for (int i = 0; i < 3; i++) {
+        int j = (i + 1) % 3;
+        tri.aflA[i] = aflY[j] - aflY[i];
+        tri.aflB[i] = aflX[i] - aflX[j];
+        tri.aflC[i] = -(tri.aflA[i] * aflX[i] + tri.aflB[i] * aflY[i]);
+        bool bTopLeft = tri.aflA[i] > 0 || (tri.aflA[i] == 0 && tri.aflB[i] > 0);
+        tri.aflBias[i] = bTopLeft ? 0.0f : FLT_MIN;
+    }
+
+    // Edge 0 is zero on the edge opposite vertex 2, and so on
+    tri.flZA = (tri.aflA[1] * aflZ[0] + tri.aflA[2] * aflZ[1] + tri.aflA[0] * aflZ[2]) / flTotal;
+    tri.flZB = (tri.aflB[1] * aflZ[0] + tri.aflB[2] * aflZ[1] + tri.aflB[0] * aflZ[2]) / flTotal;
+    tri.flZC = (tri.aflC[1] * aflZ[0] + tri.aflC[2] * aflZ[1] + tri.aflC[0] * aflZ[2]) / flTotal;
+    tri.uColor = uColor;
+
+    int iTri = (int)m_aTriangles.size();
+    m_aTriangles.push_back(tri);
+    for (int ty = tri.nMinY / SOFT_TILE_SIZE; ty <= tri.nMaxY / SOFT_TILE_SIZE; ty++) {
+        for (int tx = tri.nMinX / SOFT_TILE_SIZE; tx <= tri.nMaxX / SOFT_TILE_SIZE; tx++) {
+            m_aBins[ty * m_nTilesX + tx].push_back(iTri);
+        }
+    }
+}
+
+void CSoftRasterizer::RasterizeTile(int iTile, PFNSOFTBACKGROUND pfnBackground, void* pContext) {
+    int nTileX0 = (iTile % m_nTilesX) * SOFT_TILE_SIZE;
+    int nTileY0 = (iTile / m_nTilesX) * SOFT_TILE_SIZE;
+    int nTileX1 = std::min(nTileX0 + SOFT_TILE_SIZE, m_nWidth) - 1;
+    int nTileY1 = std::min(nTileY0 + SOFT_TILE_SIZE, m_nHeight) - 1;
+    auto& bin = m_aBins[iTile];
+    soft_vec vLanes = VLanes();
+
+    if (m_bClearPending) {
+        for (int y = nTileY0; y <= nTileY1; y++) {
+            std::fill_n(&m_aColor[(size_t)y * m_nStride + nTileX0], nTileX1 - nTileX0 + 1, m_uClearColor);
+            std::fill_n(&m_aDepth[(size_t)y * m_nStride + nTileX0], nTileX1 - nTileX0 + 1, 1.0f);
+        }
+    }
+
+    for (int iTri : bin) {
+        auto& tri = m_aTriangles[iTri];
+        int nX0 = std::max(tri.nMinX, nTileX0) / SOFT_BLOCK * SOFT_BLOCK;
+        int nX1 = std::min(tri.nMaxX, nTileX1);
+        int nY0 = std::max(tri.nMinY, nTileY0);
+        int nY1 = std::min(tri.nMaxY, nTileY1);
+        soft_vec A0 = VSet1(tri.aflA[0]), A1 = VSet1(tri.aflA[1]), A2 = VSet1(tri.aflA[2]);
+        soft_vec vBias0 = VSet1(tri.aflBias[0]), vBias1 = VSet1(tri.aflBias[1]), vBias2 = VSet1(tri.aflBias[2]);
+        soft_vec ZA = VSet1(tri.flZA);
+        soft_vec vEnd = VSet1((float)(nX1 + 1));
+        soft_vec vColor = VBits(tri.uColor);
+
+        for (int y = nY0; y <= nY1; y++) {
+            float flY = y + 0.5f;
+            float aflRow[3];
+            float flLeft = (float)nX0, flRight = (float)(nX1 + 1);
+            bool bEmpty = false;
+
+            // Pixel centers of the row inside every edge; the masks below
+            // decide the pixels at the ends exactly
+            for (int i = 0; i < 3; i++) {
+                aflRow[i] = tri.aflB[i] * flY + tri.aflC[i];
+                if (tri.aflA[i] > 0) {
+                    flLeft = std::max(flLeft, -aflRow[i] / tri.aflA[i] - 0.5f);
+                } else if (tri.aflA[i] < 0) {
+                    flRight = std::min(flRight, -aflRow[i] / tri.aflA[i] - 0.5f);
+                } else if (aflRow[i] < tri.aflBias[i]) {
+                    bEmpty = true;
+                }
+            }
+            if (bEmpty || flLeft > flRight + 1) {
+                continue;
+            }
+            int nSpanX0 = (int)floorf(flLeft) / SOFT_BLOCK * SOFT_BLOCK;
+            int nSpanX1 = std::min((int)ceilf(flRight), nX1);
+
+            soft_vec E0 = VSet1(aflRow[0]);
+            soft_vec E1 = VSet1(aflRow[1]);
+            soft_vec E2 = VSet1(aflRow[2]);
+            soft_vec Z = VSet1(tri.flZB * flY + tri.flZC);
+            auto pColorRow = &m_aColor[(size_t)y * m_nStride];
+            auto pDepthRow = &m_aDepth[(size_t)y * m_nStride];
+
+            for (int x = nSpanX0; x <= nSpanX1; x += SOFT_BLOCK) {
+                soft_vec X = VAdd(VSet1((float)x), vLanes);
+                soft_vec vMask = VAnd(
+                    VAnd(VGreaterEqual(VAdd(VMul(A0, X), E0), vBias0), VGreaterEqual(VAdd(VMul(A1, X), E1), vBias1)),
+                    VAnd(VGreaterEqual(VAdd(VMul(A2, X), E2), vBias2), VLess(X, vEnd)));
+                if (VMask(vMask)) {
+                    soft_vec vDepth = VLoad(pDepthRow + x);
+                    soft_vec vZ = VAdd(VMul(ZA, X), Z);
+                    vMask = VAnd(vMask, VLessEqual(vZ, vDepth));
+                    if (VMask(vMask)) {
+                        VStore(pDepthRow + x, VSelect(vMask, vZ, vDepth));
+                        VStore(pColorRow + x, VSelect(vMask, vColor, VLoad(pColorRow + x)));
+                    }
+                }
+            }
+        }
+    }
+    bin.clear();
+
+    if (pfnBackground) {
+        for (int y = nTileY0; y <= nTileY1; y++) {
+            auto pColorRow = &m_aColor[(size_t)y * m_nStride];
+            auto pDepthRow = &m_aDepth[(size_t)y * m_nStride];
+            for (int x = nTileX0; x <= nTileX1; x++) {
+                if (pDepthRow[x] >= 1.0f) {
+                    int nRun = 1;
+                    while (x + nRun <= nTileX1 && pDepthRow[x + nRun] >= 1.0f) {
+                        nRun++;
+                    }
+                    pfnBackground(pContext, x, y, nRun, pColorRow + x);
+                    x += nRun;
+                }
+            }
+        }
+    }
+}
+
+void CSoftRasterizer::Flush(CTaskPool* pPool, PFNSOFTBACKGROUND pfnBackground, void* pContext) {
+    int nTiles = m_nTilesX * m_nTilesY;
+
+    if (pPool && pPool->ThreadCount() > 1) {
+        // One task per thread taking tiles in turn; a task per tile would
+        // cost more than most tiles take to draw
+        struct flush_job {
+            CSoftRasterizer* pRaster;
+            std::atomic<int> iNext;
+            int nTiles;
+            PFNSOFTBACKGROUND pfnBackground;
+            void* pContext;
+        } job;
+        CTaskPool::task_group group;
+        job.pRaster = this;
+        job.iNext = 0;
+        job.nTiles = nTiles;
+        job.pfnBackground = pfnBackground;
+        job.pContext = pContext;
+        auto pJob = &job;
+        for (int i = 0; i < pPool->ThreadCount(); i++) {
+            pPool->Run(&group, [pJob]() {
+                int iTile;
+                while ((iTile = pJob->iNext++) < pJob->nTiles) {
+                    pJob->pRaster->RasterizeTile(iTile, pJob->pfnBackground, pJob->pContext);
+                }
+            });
+        }
+        pPool->Wait(&group);
+    } else {
+        for (int iTile = 0; iTile < nTiles; iTile++) {
+            RasterizeTile(iTile, pfnBackground, pContext);
+        }
+    }
+
+    m_aTriangles.clear();
+    m_bClearPending = false;
+}
+
+bool WriteSoftTGA(const char* pszPath, const uint32_t* pPixels, int nWidth, int nHeight, int nStride) {
+    bool ret = false;
+    uint8_t aHeader[18] = {};
+    FILE* hFile;
+
+    assert(pszPath && pPixels);
+
+    aHeader[2] = 2;
+    aHeader[12] = (uint8_t)(nWidth & 0xFF);
+    aHeader[13] = (uint8_t)(nWidth >> 8);
+    aHeader[14] = (uint8_t)(nHeight & 0xFF);
+    aHeader[15] = (uint8_t)(nHeight >> 8);
+    aHeader[16] = 32;
+    // 8 alpha bits, rows from the top
+    aHeader[17] = 0x28;
+
+    hFile = fopen(pszPath, "wb");
+    if (hFile) {
+        ret = fwrite(aHeader, sizeof(aHeader), 1, hFile) == 1;
+        std::vector<uint8_t> aRow(nWidth * 4);
+        for (int y = 0; y < nHeight && ret; y++) {
+            for (int x = 0; x < nWidth; x++) {
+                uint32_t u = pPixels[(size_t)y * nStride + x];
+                aRow[x * 4 + 0] = (uint8_t)(u >> 16);
+                aRow[x * 4 + 1] = (uint8_t)(u >> 8);
+                aRow[x * 4 + 2] = (uint8_t)u;
+                aRow[x * 4 + 3] = (uint8_t)(u >> 24);
+            }
+            ret = fwrite(aRow.data(), aRow.size(), 1, hFile) == 1;
+        }
+        ret = (fclose(hFile) == 0) && ret;
+    }
+
+    return ret;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "util_vector.h"
+#include "util_taskpool.h"
+
+// Side of the square screen tiles triangles are binned into
+#define SOFT_TILE_SIZE (64)
+
+// Packs a color into the RGBA8 format of the color buffer
+inline uint32_t SoftColor(float r, float g, float b, float a) {
+    float aflColor[4] = { r, g, b, a };
+    uint32_t ret = 0;
+    for (int i = 0; i < 4; i++) {
+        float fl = aflColor[i] < 0 ? 0 : (aflColor[i] > 1 ? 1 : aflColor[i]);
+        ret |= (uint32_t)(fl * 255.0f + 0.5f) << (8 * i);
+    }
+    return ret;
+}
+
+// Colors nPixels pixels of row y from x on that no triangle covered
+typedef void (*PFNSOFTBACKGROUND)(void* pContext, int x, int y, int nPixels, uint32_t* pColors);
+
+// Flat shaded triangle rasterizer with a depth buffer. Triangles are given
+// in OpenGL clip space, clipped against the near plane, culled if they
+// are clockwise on screen and binned into tiles; Flush rasterizes the
+// tiles in parallel with SIMD edge functions and a less-or-equal depth
+// test, in the order the triangles were added.
+class CSoftRasterizer {
+public:
+    CSoftRasterizer();
+
+    // Resizes the buffers; the contents are undefined until Clear
+    void Resize(int nWidth, int nHeight);
+    // Drops the binned triangles; the next Flush fills the color buffer
+    // with uColor and the depth buffer with 1 before rasterizing
+    void Clear(uint32_t uColor);
+    void AddTriangle(const vector4& v0, const vector4& v1, const vector4& v2, uint32_t uColor);
+    // Rasterizes and drops the binned triangles. pPool is optional; the
+    // result doesn't depend on it. If pfnBackground is given, pixels that
+    // are still at depth 1 afterwards are colored by it.
+    void Flush(CTaskPool* pPool, PFNSOFTBACKGROUND pfnBackground = NULL, void* pContext = NULL);
+
+    int Width() const {
+        return m_nWidth;
+    }
+
+    int Height() const {
+        return m_nHeight;
+    }
+
+    // Pixels between two rows of the buffers; the width rounded up to the
+    // SIMD block
+    int Stride() const {
+        return m_nStride;
+    }
+
+    // Rows from the top of the screen down
+    const uint32_t* Pixels() const {
+        return m_aColor.data();
+    }
+
+    const float* Depth() const {
+        return m_aDepth.data();
+    }
+
+    // Triangles binned since the last Flush, after clipping and culling
+    int TriangleCount() const {
+        return (int)m_aTriangles.size();
+    }
+
+private:
+    // Triangle in pixel coordinates. Inside pixels have every edge
+    // function A x + B y + C at their center at or above the bias of the
+    // edge; the bias makes pixels exactly on an edge belong to only one
+    // of two triangles sharing it.
+    struct soft_triangle {
+        float aflA[3], aflB[3], aflC[3], aflBias[3];
+        // Depth at a pixel center is flZA x + flZB y + flZC
+        float flZA, flZB, flZC;
+        uint32_t uColor;
+        int nMinX, nMinY, nMaxX, nMaxY;
+    };
+
+    void SetupTriangle(const vector4& v0, const vector4& v1, const vector4& v2, uint32_t uColor);
+    void RasterizeTile(int iTile, PFNSOFTBACKGROUND pfnBackground, void* pContext);
+
+    int m_nWidth, m_nHeight, m_nStride;
+    int m_nTilesX, m_nTilesY;
+    std::vector<uint32_t> m_aColor;
+    std::vector<float> m_aDepth;
+    uint32_t m_uClearColor;
+    bool m_bClearPending;
+    std::vector<soft_triangle> m_aTriangles;
+    // Indices into m_aTriangles of the triangles overlapping each tile
+    std::vector<std::vector<int>> m_aBins;
+};
+
+// Writes an uncompressed 32-bit TGA with the top row first
+bool WriteSoftTGA(const char* pszPath, const uint32_t* pPixels, int nWidth, int nHeight, int nStride);
@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include "util_alloccount.h"
+
+static std::atomic<size_t> s_nAllocs(0);
+static std::atomic<size_t> s_nFrees(0);
+static std::atomic<size_t> s_nBytes(0);
+
+static void* CountedAlloc(size_t nSize) {
+    void* ret = malloc(nSize ? nSize : 1);
+    if (ret) {
+        s_nAllocs.fetch_add(1, std::memory_order_relaxed);
+        s_nBytes.fetch_add(nSize, std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+static void CountedFree(void* p) {
+    if (p) {
+        s_nFrees.fetch_add(1, std::memory_order_relaxed);
+        free(p);
+    }
+}
+
+void GetAllocationCounters(alloc_counters* pCounters) {
+    pCounters->nAllocs = s_nAllocs.load(std::memory_order_relaxed);
+    pCounters->nFrees = s_nFrees.load(std::memory_order_relaxed);
+    pCounters->nBytes = s_nBytes.load(std::memory_order_relaxed);
+}
+
+void* operator new(size_t nSize) {
+    void* ret = CountedAlloc(nSize);
+    if (!ret) {
+        throw std::bad_alloc();
+    }
+    return ret;
+}
+
+void* operator new[](size_t nSize) {
+    return operator new(nSize);
+}
+
+void* operator new(size_t nSize, const std::nothrow_t&) noexcept {
+    return CountedAlloc(nSize);
+}
+
+void* operator new[](size_t nSize, const std::nothrow_t&) noexcept {
+    return CountedAlloc(nSize);
+}
+
+void operator delete(void* p) noexcept {
+    CountedFree(p);
+}
+
+void operator delete[](void* p) noexcept {
+    CountedFree(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    CountedFree(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    CountedFree(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    CountedFree(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    CountedFree(p);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+
+// Counters of the global operator new and delete. Only programs that link
+// util_alloccount.cpp count, and only C++ allocations are seen, not the
+// malloc calls of C libraries.
+struct alloc_counters {
+    size_t nAllocs;
+    size_t nFrees;
+    size_t nBytes;
+};
+
+void GetAllocationCounters(alloc_counters* pCounters);
@@ -0,0 +1,101 @@
+#include "util_arena.h"
+#include <assert.h>
+#include <new>
+#include <stdint.h>
+
+// Payload starts after the header, aligned to 16 bytes
+#define ARENA_HEADER_SIZE ((sizeof(block) + 15) & ~(size_t)15)
+
+CArena::CArena(size_t nBlockSize)
+    : m_nBlockSize(nBlockSize), m_pFirst(NULL), m_pCurrent(NULL) {
+}
+
+CArena::~CArena() {
+    Release();
+}
+
+CArena::block* CArena::NewBlock(size_t nMinSize) {
+    size_t nSize = (nMinSize > m_nBlockSize) ? nMinSize : m_nBlockSize;
+    // Through operator new so that allocation counters see the blocks
+    auto ret = (block*)::operator new(ARENA_HEADER_SIZE + nSize);
+
+    assert(ret);
+
+    ret->pNext = NULL;
+    ret->nSize = nSize;
+    ret->nUsed = 0;
+
+    return ret;
+}
+
+void* CArena::Alloc(size_t nSize, size_t nAlign) {
+    void* ret = NULL;
+
+    assert(nAlign > 0 && (nAlign & (nAlign - 1)) == 0 && nAlign <= 16);
+
+    while (!ret) {
+        if (m_pCurrent) {
+            size_t nOffset = (m_pCurrent->nUsed + nAlign - 1) & ~(nAlign - 1);
+            if (nOffset + nSize <= m_pCurrent->nSize) {
+                ret = (char*)m_pCurrent + ARENA_HEADER_SIZE + nOffset;
+                m_pCurrent->nUsed = nOffset + nSize;
+                break;
+            }
+        }
+
+        // Move on to the next block, reusing it if it's large enough
+        auto pNext = m_pCurrent ? m_pCurrent->pNext : m_pFirst;
+        if (!pNext || pNext->nSize < nSize) {
+            auto pNew = NewBlock(nSize);
+            pNew->pNext = pNext;
+            if (m_pCurrent) {
+                m_pCurrent->pNext = pNew;
+            } else {
+                m_pFirst = pNew;
+            }
+            pNext = pNew;
+        }
+        pNext->nUsed = 0;
+        m_pCurrent = pNext;
+    }
+
+    return ret;
+}
+
+void CArena::Reset() {
+    m_pCurrent = NULL;
+}
+
+void CArena::Release() {
+    auto pBlock = m_pFirst;
+    while (pBlock) {
+        auto pNext = pBlock->pNext;
+        ::operator delete(pBlock);
+        pBlock = pNext;
+    }
+    m_pFirst = NULL;
+    m_pCurrent = NULL;
+}
+
+size_t CArena::BytesUsed() const {
+    size_t ret = 0;
+
+    if (m_pCurrent) {
+        for (auto pBlock = m_pFirst; pBlock != m_pCurrent; pBlock = pBlock->pNext) {
+            ret += pBlock->nUsed;
+        }
+        ret += m_pCurrent->nUsed;
+    }
+
+    return ret;
+}
+
+size_t CArena::BytesReserved() const {
+    size_t ret = 0;
+
+    for (auto pBlock = m_pFirst; pBlock; pBlock = pBlock->pNext) {
+        ret += ARENA_HEADER_SIZE + pBlock->nSize;
+    }
+
+    return ret;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <new>
+#include <utility>
+
+#define ARENA_DEFAULT_BLOCK_SIZE (1024 * 1024)
+
+// Linear allocator.
+// Memory is handed out from large blocks and is only given back all at
+// once: Reset rewinds the arena in O(1) and keeps the blocks around for
+// reuse, Release frees them. Destructors of the allocated objects are never
+// called.
+class CArena {
+public:
+    explicit CArena(size_t nBlockSize = ARENA_DEFAULT_BLOCK_SIZE);
+    ~CArena();
+
+    CArena(const CArena&) = delete;
+    CArena& operator=(const CArena&) = delete;
+
+    void* Alloc(size_t nSize, size_t nAlign = 16);
+
+    template<typename T, typename... Args>
+    T* New(Args&&... args) {
+        return new (Alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template<typename T>
+    T* NewArray(size_t nCount) {
+        T* ret = (T*)Alloc(sizeof(T) * nCount, alignof(T));
+        for (size_t i = 0; i < nCount; i++) {
+            new (&ret[i]) T;
+        }
+        return ret;
+    }
+
+    void Reset();
+    void Release();
+
+    size_t BytesUsed() const;
+    size_t BytesReserved() const;
+
+private:
+    struct block {
+        block* pNext;
+        size_t nSize;
+        size_t nUsed;
+    };
+
+    block* NewBlock(size_t nMinSize);
+
+    size_t m_nBlockSize;
+    block* m_pFirst;
+    block* m_pCurrent;
+};
@@ -0,0 +1,145 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <algorithm>
+#include "util_framescheduler.h"
+
+static const char* s_aszPacingNames[eFramePacingMax] = {
+    "vsync",
+    "uncapped",
+    "target",
+};
+
+void DefaultFramePacingParams(frame_pacing_params* pParams) {
+    assert(pParams);
+
+    pParams->mode = eFramePacingVSync;
+    pParams->flTargetFps = 60.0f;
+}
+
+const char* FramePacingName(eFramePacing mode) {
+    assert(mode >= 0 && mode < eFramePacingMax);
+    return s_aszPacingNames[mode];
+}
+
+bool ParseFramePacing(frame_pacing_params* pParams, const char* pszText) {
+    bool ret = true;
+    char* pszEnd;
+
+    assert(pParams && pszText);
+
+    if (strcmp(pszText, FramePacingName(eFramePacingVSync)) == 0) {
+        pParams->mode = eFramePacingVSync;
+    } else if (strcmp(pszText, FramePacingName(eFramePacingUncapped)) == 0) {
+        pParams->mode = eFramePacingUncapped;
+    } else {
+        float flFps = strtof(pszText, &pszEnd);
+        ret = pszEnd != pszText && *pszEnd == '\0' && flFps > 0;
+        if (ret) {
+            pParams->mode = eFramePacingTarget;
+            pParams->flTargetFps = flFps;
+        }
+    }
+
+    return ret;
+}
+
+void PrintFrameTelemetry(FILE* hFile, const frame_telemetry* pTelemetry) {
+    assert(hFile && pTelemetry);
+
+    fprintf(hFile, "Frame pacing %s, last %d frames: work p50 %.3f ms p99 %.3f ms, frame p50 %.3f ms p99 %.3f ms, %d deadlines missed, spin %.2f ms\n",
+        FramePacingName(pTelemetry->mode), pTelemetry->frame.nFrames, pTelemetry->work.flP50Ms, pTelemetry->work.flP99Ms,
+        pTelemetry->frame.flP50Ms, pTelemetry->frame.flP99Ms, pTelemetry->nMissed, pTelemetry->flSpinMs);
+}
+
+static float Milliseconds(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<float, std::milli>(d).count();
+}
+
+CFrameScheduler::CFrameScheduler() {
+    DefaultFramePacingParams(&m_params);
+    Reset();
+}
+
+void CFrameScheduler::Reset() {
+    m_tFrameStart = m_tWorkEnd = m_tDeadline = clock::now();
+    m_flFrameTime = 0;
+    m_flWorkMs = m_flSwapMs = m_flWaitMs = 0;
+    m_nFrames = 0;
+    m_nMissed = 0;
+}
+
+void CFrameScheduler::SetParams(const frame_pacing_params* pParams) {
+    assert(pParams && pParams->mode >= 0 && pParams->mode < eFramePacingMax);
+    assert(pParams->mode != eFramePacingTarget || pParams->flTargetFps > 0);
+
+    m_params = *pParams;
+    m_tDeadline = m_tFrameStart;
+    m_nMissed = 0;
+}
+
+void CFrameScheduler::EndWork() {
+    m_tWorkEnd = clock::now();
+}
+
+void CFrameScheduler::WaitUntil(clock::time_point tDeadline) {
+    auto tSleepEnd = tDeadline - std::chrono::duration_cast<clock::duration>(std::chrono::duration<float, std::milli>(m_flSpinMs));
+    auto tNow = clock::now();
+
+    if (tSleepEnd > tNow) {
+        std::this_thread::sleep_until(tSleepEnd);
+        // Keep the spin longer than the sleeps oversleep, and let it shrink
+        // slowly when they get more punctual
+        float flLateMs = Milliseconds(clock::now() - tSleepEnd);
+        m_flSpinMs = std::max(flLateMs * 1.5f, m_flSpinMs * 0.99f);
+        m_flSpinMs = std::min(std::max(m_flSpinMs, FRAME_MIN_SPIN_MS), FRAME_MAX_SPIN_MS);
+    }
+    while (clock::now() < tDeadline) {
+        std::this_thread::yield();
+    }
+}
+
+void CFrameScheduler::EndFrame() {
+    auto tSwapped = clock::now();
+
+    if (m_tWorkEnd < m_tFrameStart) {
+        m_tWorkEnd = tSwapped;
+    }
+
+    if (m_params.mode == eFramePacingTarget) {
+        m_tDeadline += std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / m_params.flTargetFps));
+        if (tSwapped > m_tDeadline) {
+            m_nMissed++;
+            m_tDeadline = tSwapped;
+        } else {
+            WaitUntil(m_tDeadline);
+        }
+    }
+
+    auto tEnd = clock::now();
+    m_flWorkMs = Milliseconds(m_tWorkEnd - m_tFrameStart);
+    m_flSwapMs = Milliseconds(tSwapped - m_tWorkEnd);
+    m_flWaitMs = Milliseconds(tEnd - tSwapped);
+    m_aflWorkMs[m_nFrames % FRAME_HISTORY] = m_flWorkMs;
+    m_aflFrameMs[m_nFrames % FRAME_HISTORY] = Milliseconds(tEnd - m_tFrameStart);
+    m_flFrameTime = std::chrono::duration<float>(tEnd - m_tFrameStart).count();
+    m_nFrames++;
+    m_tFrameStart = tEnd;
+}
+
+void CFrameScheduler::GetTelemetry(frame_telemetry* pTelemetry) const {
+    int nHistory = std::min(m_nFrames, FRAME_HISTORY);
+
+    assert(pTelemetry);
+
+    pTelemetry->mode = m_params.mode;
+    pTelemetry->flWorkMs = m_flWorkMs;
+    pTelemetry->flSwapMs = m_flSwapMs;
+    pTelemetry->flWaitMs = m_flWaitMs;
+    pTelemetry->flFrameMs = 1000.0f * m_flFrameTime;
+    ComputeFrameTimeStats(&pTelemetry->work, m_aflWorkMs, nHistory);
+    ComputeFrameTimeStats(&pTelemetry->frame, m_aflFrameMs, nHistory);
+    pTelemetry->nMissed = m_nMissed;
+    pTelemetry->flSpinMs = m_flSpinMs;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdio.h>
+#include <chrono>
+#include "util_framestats.h"
+
+// Frames the telemetry covers
+#define FRAME_HISTORY (256)
+// Bounds of the time spun before a deadline instead of sleeping
+#define FRAME_MIN_SPIN_MS (0.2f)
+#define FRAME_MAX_SPIN_MS (4.0f)
+
+enum eFramePacing {
+    // The swap waits for the display
+    eFramePacingVSync,
+    // A frame starts as soon as the last one is swapped
+    eFramePacingUncapped,
+    // Frames start at a fixed rate
+    eFramePacingTarget,
+
+    eFramePacingMax
+};
+
+struct frame_pacing_params {
+    eFramePacing mode;
+    // Frame rate of eFramePacingTarget
+    float flTargetFps;
+};
+
+struct frame_telemetry {
+    eFramePacing mode;
+    // Of the last frame: the work up to the swap, the swap, the wait for
+    // the next frame and the whole frame
+    float flWorkMs, flSwapMs, flWaitMs, flFrameMs;
+    // Over the last FRAME_HISTORY frames
+    frame_time_stats work;
+    frame_time_stats frame;
+    // Frames that started after their deadline in eFramePacingTarget
+    int nMissed;
+    // How long before a deadline the scheduler stops sleeping and spins
+    float flSpinMs;
+};
+
+void DefaultFramePacingParams(frame_pacing_params* pParams);
+const char* FramePacingName(eFramePacing mode);
+// Parses "vsync", "uncapped" or a target frame rate
+bool ParseFramePacing(frame_pacing_params* pParams, const char* pszText);
+void PrintFrameTelemetry(FILE* hFile, const frame_telemetry* pTelemetry);
+
+// Paces frames and measures where their time goes. A frame starts when
+// the last one ends; EndWork marks the point where it's ready to be shown
+// and EndFrame the point where it was. With a target rate, EndFrame sleeps
+// until shortly before the start of the next frame and spins the rest of
+// the way, learning how late the sleeps wake up. A frame that misses its
+// deadline starts right away and the ones after it are paced from there.
+class CFrameScheduler {
+public:
+    CFrameScheduler();
+
+    void SetParams(const frame_pacing_params* pParams);
+    // Starts the first frame now and forgets the frames before; loading
+    // between the construction and the first frame doesn't count
+    void Reset();
+
+    const frame_pacing_params& Params() const {
+        return m_params;
+    }
+
+    void EndWork();
+    void EndFrame();
+
+    // Seconds between the starts of the last two frames
+    float FrameTime() const {
+        return m_flFrameTime;
+    }
+
+    void GetTelemetry(frame_telemetry* pTelemetry) const;
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    void WaitUntil(clock::time_point tDeadline);
+
+    frame_pacing_params m_params;
+    clock::time_point m_tFrameStart, m_tWorkEnd, m_tDeadline;
+    float m_flFrameTime = 0;
+    float m_flSpinMs = 1.0f;
+
+    float m_flWorkMs = 0, m_flSwapMs = 0, m_flWaitMs = 0;
+    float m_aflWorkMs[FRAME_HISTORY];
+    float m_aflFrameMs[FRAME_HISTORY];
+    int m_nFrames = 0;
+    int m_nMissed = 0;
+};
@@ -0,0 +1,43 @@
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "util_framestats.h"
+
+static double Percentile(const std::vector<float>& aflSorted, double flPercent) {
+    int iRank = (int)ceil(flPercent / 100.0 * aflSorted.size());
+    iRank = std::max(1, std::min(iRank, (int)aflSorted.size()));
+    return aflSorted[iRank - 1];
+}
+
+void ComputeFrameTimeStats(frame_time_stats* pStats, const float* aflFrameMs, int nFrames) {
+    assert(pStats && (aflFrameMs || nFrames == 0));
+
+    *pStats = {};
+    pStats->nFrames = nFrames;
+    if (nFrames > 0) {
+        // Reused, so that frames can watch their own times without
+        // allocating
+        static thread_local std::vector<float> aflSorted;
+        double flSum = 0;
+        aflSorted.assign(aflFrameMs, aflFrameMs + nFrames);
+        std::sort(aflSorted.begin(), aflSorted.end());
+        for (float fl : aflSorted) {
+            flSum += fl;
+        }
+        pStats->flMinMs = aflSorted.front();
+        pStats->flMaxMs = aflSorted.back();
+        pStats->flMeanMs = flSum / nFrames;
+        pStats->flP50Ms = Percentile(aflSorted, 50);
+        pStats->flP95Ms = Percentile(aflSorted, 95);
+        pStats->flP99Ms = Percentile(aflSorted, 99);
+    }
+}
+
+void PrintFrameTimeStats(FILE* hFile, const frame_time_stats* pStats) {
+    assert(hFile && pStats);
+
+    fprintf(hFile, "%d frames: min %.3f ms, mean %.3f ms, p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+        pStats->nFrames, pStats->flMinMs, pStats->flMeanMs, pStats->flP50Ms, pStats->flP95Ms, pStats->flP99Ms,
+        pStats->flMaxMs);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdio.h>
+
+// Distribution of a run's frame times
+struct frame_time_stats {
+    int nFrames;
+    double flMinMs, flMeanMs, flMaxMs;
+    // Nearest-rank percentiles
+    double flP50Ms, flP95Ms, flP99Ms;
+};
+
+void ComputeFrameTimeStats(frame_time_stats* pStats, const float* aflFrameMs, int nFrames);
+void PrintFrameTimeStats(FILE* hFile, const frame_time_stats* pStats);
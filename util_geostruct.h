@@ -4,10 +4,14 @@
 #include <cstddef>
 #include <iterator>
 #include <assert.h>
+#include <vector>
 
 #define POLYGON_MAX_POINTS (16)
+
+// Handle of a plane in a plane table (see bsp_planes.h)
+using HPLANE = unsigned;
+#define PLANE_NONE ((HPLANE)~0u)
 #define LINECONT_MAX_POINTS (POLYGON_MAX_POINTS * 2 - 1)
-#define POLYCONT_MAX_POLYS ((POLYGON_MAX_POINTS - 2) * 3)
 
 class Plane {
 public:
@@ -107,6 +111,7 @@ public:
     }
 
     Polygon& operator+=(const vector4& point) {
+        assert(cnt < POLYGON_MAX_POINTS);
         if (cnt < POLYGON_MAX_POINTS) {
             points[cnt++] = point;
         }
@@ -178,42 +183,128 @@ private:
 
 };
 
+// Stores polygons as windings in a shared vertex buffer, so every polygon
+// only takes as much memory as many vertices it has
 class PolygonContainer {
 public:
-    PolygonContainer()
-        : cnt(0) {
-    }
+    struct winding {
+        int iFirstVertex;
+        int nVertices;
+        // Plane of the polygon or PLANE_NONE if it hasn't been looked up
+        HPLANE hPlane;
+    };
 
     PolygonContainer& operator+=(const Polygon& poly) {
-        if (cnt < POLYCONT_MAX_POLYS) {
-            polygons[cnt++] = poly;
-        }
+        Add(poly, PLANE_NONE);
         return *this;
     }
 
+    void Add(const Polygon& poly, HPLANE hPlane) {
+        winding w = { (int)m_aVertices.size(), poly.Count(), hPlane };
+        for (int iVtx = 0; iVtx < poly.Count(); iVtx++) {
+            m_aVertices.push_back(poly[iVtx]);
+        }
+        m_aWindings.push_back(w);
+    }
+
+    void Add(const vector4* pVertices, int nVertices, HPLANE hPlane) {
+        winding w = { (int)m_aVertices.size(), nVertices, hPlane };
+        m_aVertices.insert(m_aVertices.end(), pVertices, pVertices + nVertices);
+        m_aWindings.push_back(w);
+    }
+
+    // Copies the iPoly-th polygon of another container
+    void Append(const PolygonContainer& other, int iPoly) {
+        auto pVertices = other.Vertices(iPoly);
+        winding w = { (int)m_aVertices.size(), other.VertexCount(iPoly), other.PlaneHandle(iPoly) };
+        m_aVertices.insert(m_aVertices.end(), pVertices, pVertices + w.nVertices);
+        m_aWindings.push_back(w);
+    }
+
+    // Copies every polygon of another container
+    void Append(const PolygonContainer& other) {
+        int iVertexBase = (int)m_aVertices.size();
+        m_aVertices.insert(m_aVertices.end(), other.m_aVertices.begin(), other.m_aVertices.end());
+        for (auto& w : other.m_aWindings) {
+            m_aWindings.push_back({ iVertexBase + w.iFirstVertex, w.nVertices, w.hPlane });
+        }
+    }
+
     int Count() const {
-        return cnt;
+        return (int)m_aWindings.size();
     }
 
-    const Polygon& operator[](int iIdx) const {
-        return polygons[iIdx];
+    int TotalVertexCount() const {
+        return (int)m_aVertices.size();
     }
 
-    Polygon& operator[](int iIdx) {
-        return polygons[iIdx];
+    Polygon operator[](int iIdx) const {
+        return GetPolygon(iIdx);
+    }
+
+    Polygon GetPolygon(int iIdx) const {
+        Polygon ret;
+        auto& w = m_aWindings[iIdx];
+        // Longer windings would lose vertices; work on them through
+        // Vertices instead
+        assert(w.nVertices <= POLYGON_MAX_POINTS);
+        for (int iVtx = 0; iVtx < w.nVertices; iVtx++) {
+            ret += m_aVertices[w.iFirstVertex + iVtx];
+        }
+        return ret;
     }
 
-    const Polygon& GetPolygon(int iIdx) const {
-        return polygons[iIdx];
+    int VertexCount(int iIdx) const {
+        return m_aWindings[iIdx].nVertices;
     }
 
-    Polygon& GetPolygon(int iIdx) {
-        return polygons[iIdx];
+    const vector4* Vertices(int iIdx) const {
+        return m_aVertices.data() + m_aWindings[iIdx].iFirstVertex;
+    }
+
+    // The windings index into VertexData
+    const winding* Windings() const {
+        return m_aWindings.data();
+    }
+
+    const vector4* VertexData() const {
+        return m_aVertices.data();
+    }
+
+    HPLANE PlaneHandle(int iIdx) const {
+        return m_aWindings[iIdx].hPlane;
+    }
+
+    void SetPlaneHandle(int iIdx, HPLANE hPlane) {
+        m_aWindings[iIdx].hPlane = hPlane;
+    }
+
+    Plane GetPlane(int iIdx) const {
+        auto pVertices = Vertices(iIdx);
+        assert(VertexCount(iIdx) >= 3);
+        return Plane(pVertices[0], pVertices[1], pVertices[2]);
+    }
+
+    // Removes every polygon but keeps the memory
+    void Clear() {
+        m_aVertices.clear();
+        m_aWindings.clear();
+    }
+
+    void Reserve(int nPolygons, int nVertices) {
+        m_aWindings.reserve(nPolygons);
+        m_aVertices.reserve(nVertices);
+    }
+
+    size_t BytesUsed() const {
+        return
+            m_aVertices.capacity() * sizeof(vector4) +
+            m_aWindings.capacity() * sizeof(winding);
     }
 
 private:
-    int cnt = 0;
-    Polygon polygons[POLYCONT_MAX_POLYS];
+    std::vector<vector4> m_aVertices;
+    std::vector<winding> m_aWindings;
 };
 
 inline Plane PlaneFromPolygon(const Polygon& poly) {
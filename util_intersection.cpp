@@ -11,13 +11,13 @@ static void EquationOfPlane(float* A, float* B, float* C, float* D, const Plane&
     for (int i = 0; i < 3; i++) {
         a +=
             (P[i][1] - P[(i + 1) % 3][1]) *
-            (P[i][2] - P[(i + 1) % 3][2]);
+            (P[i][2] + P[(i + 1) % 3][2]);
         b +=
             (P[i][2] - P[(i + 1) % 3][2]) *
-            (P[i][0] - P[(i + 1) % 3][0]);
+            (P[i][0] + P[(i + 1) % 3][0]);
         c +=
             (P[i][0] - P[(i + 1) % 3][0]) *
-            (P[i][1] - P[(i + 1) % 3][1]);
+            (P[i][1] + P[(i + 1) % 3][1]);
         avg[0] += P[i][0];
         avg[1] += P[i][1];
         avg[2] += P[i][2];
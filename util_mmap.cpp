@@ -0,0 +1,85 @@
+#include "util_mmap.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+CMappedFile::CMappedFile() : m_pData(NULL), m_nSize(0) {
+#if defined(_WIN32)
+    m_hFile = INVALID_HANDLE_VALUE;
+    m_hMapping = NULL;
+#endif
+}
+
+CMappedFile::~CMappedFile() {
+    Close();
+}
+
+bool CMappedFile::Open(const char* pszPath) {
+    bool ret = false;
+
+    Close();
+
+#if defined(_WIN32)
+    LARGE_INTEGER nSize;
+    m_hFile = CreateFileA(pszPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_hFile != INVALID_HANDLE_VALUE && GetFileSizeEx(m_hFile, &nSize) && nSize.QuadPart > 0) {
+        m_hMapping = CreateFileMappingA(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (m_hMapping) {
+            m_pData = MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+            if (m_pData) {
+                m_nSize = (size_t)nSize.QuadPart;
+                ret = true;
+            }
+        }
+    }
+#else
+    struct stat st;
+    int fd = open(pszPath, O_RDONLY);
+    if (fd != -1) {
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* pData = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (pData != MAP_FAILED) {
+                m_pData = pData;
+                m_nSize = (size_t)st.st_size;
+                ret = true;
+            }
+        }
+        // The mapping stays valid after the descriptor is closed
+        close(fd);
+    }
+#endif
+
+    if (!ret) {
+        Close();
+    }
+
+    return ret;
+}
+
+void CMappedFile::Close() {
+#if defined(_WIN32)
+    if (m_pData) {
+        UnmapViewOfFile(m_pData);
+    }
+    if (m_hMapping) {
+        CloseHandle(m_hMapping);
+    }
+    if (m_hFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_hFile);
+    }
+    m_hFile = INVALID_HANDLE_VALUE;
+    m_hMapping = NULL;
+#else
+    if (m_pData) {
+        munmap((void*)m_pData, m_nSize);
+    }
+#endif
+    m_pData = NULL;
+    m_nSize = 0;
+}
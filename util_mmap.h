@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+
+// Read-only memory mapping of a whole file
+class CMappedFile {
+public:
+    CMappedFile();
+    ~CMappedFile();
+
+    CMappedFile(const CMappedFile&) = delete;
+    CMappedFile& operator=(const CMappedFile&) = delete;
+
+    bool Open(const char* pszPath);
+    void Close();
+
+    const void* Data() const {
+        return m_pData;
+    }
+
+    size_t Size() const {
+        return m_nSize;
+    }
+
+private:
+    const void* m_pData;
+    size_t m_nSize;
+#if defined(_WIN32)
+    void* m_hFile;
+    void* m_hMapping;
+#endif
+};
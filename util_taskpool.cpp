@@ -0,0 +1,122 @@
+#include "util_taskpool.h"
+#include <assert.h>
+
+// The pool and queue the current thread works on; threads that aren't
+// workers of the pool share queue 0
+static thread_local const CTaskPool* gtpPool = NULL;
+static thread_local int gtiWorker = 0;
+
+CTaskPool::CTaskPool(int nThreads) {
+    if (nThreads <= 0) {
+        nThreads = (int)std::thread::hardware_concurrency();
+        if (nThreads <= 0) {
+            nThreads = 1;
+        }
+    }
+
+    for (int i = 0; i < nThreads; i++) {
+        m_aQueues.push_back(new worker_queue);
+    }
+
+    for (int i = 1; i < nThreads; i++) {
+        m_aThreads.emplace_back(&CTaskPool::WorkerMain, this, i);
+    }
+}
+
+CTaskPool::~CTaskPool() {
+    {
+        std::lock_guard<std::mutex> l(m_lockSleep);
+        m_bShutdown = true;
+    }
+    m_cvSleep.notify_all();
+
+    for (auto& thread : m_aThreads) {
+        thread.join();
+    }
+
+    for (auto pQueue : m_aQueues) {
+        delete pQueue;
+    }
+}
+
+int CTaskPool::CurrentThread() const {
+    return (gtpPool == this) ? gtiWorker : 0;
+}
+
+void CTaskPool::Run(task_group* pGroup, std::function<void()> fnTask) {
+    assert(pGroup);
+
+    auto pQueue = m_aQueues[CurrentThread()];
+
+    pGroup->nPending++;
+    {
+        std::lock_guard<std::mutex> l(pQueue->lock);
+        pQueue->tasks.push_back({ pGroup, std::move(fnTask) });
+    }
+    m_nQueued++;
+
+    if (m_aThreads.size() > 0) {
+        // Taking the lock orders us against a worker that is about to sleep
+        { std::lock_guard<std::mutex> l(m_lockSleep); }
+        m_cvSleep.notify_one();
+    }
+}
+
+bool CTaskPool::TryExecuteOne(int iWorker) {
+    bool ret = false;
+    task t;
+    int nQueues = (int)m_aQueues.size();
+
+    if (m_nQueued.load() == 0) {
+        return false;
+    }
+
+    // Newest task of our own queue first, then the oldest of the others
+    for (int i = 0; i < nQueues && !ret; i++) {
+        int iQueue = (iWorker + i) % nQueues;
+        auto pQueue = m_aQueues[iQueue];
+        std::lock_guard<std::mutex> l(pQueue->lock);
+        if (!pQueue->tasks.empty()) {
+            if (i == 0) {
+                t = std::move(pQueue->tasks.back());
+                pQueue->tasks.pop_back();
+            } else {
+                t = std::move(pQueue->tasks.front());
+                pQueue->tasks.pop_front();
+            }
+            ret = true;
+        }
+    }
+
+    if (ret) {
+        m_nQueued--;
+        t.fnTask();
+        t.pGroup->nPending--;
+    }
+
+    return ret;
+}
+
+void CTaskPool::WorkerMain(int iWorker) {
+    gtpPool = this;
+    gtiWorker = iWorker;
+
+    while (!m_bShutdown) {
+        if (!TryExecuteOne(iWorker)) {
+            std::unique_lock<std::mutex> l(m_lockSleep);
+            m_cvSleep.wait(l, [this]() { return m_bShutdown || m_nQueued.load() > 0; });
+        }
+    }
+}
+
+void CTaskPool::Wait(task_group* pGroup) {
+    assert(pGroup);
+
+    int iWorker = CurrentThread();
+
+    while (pGroup->nPending.load() > 0) {
+        if (!TryExecuteOne(iWorker)) {
+            std::this_thread::yield();
+        }
+    }
+}
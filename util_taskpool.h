@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool.
+// Every worker owns a deque; it pops its own tasks from the back and steals
+// from the front of the others' when it runs dry. Threads that wait for a
+// task group keep executing tasks, so tasks may spawn and wait for subtasks.
+class CTaskPool {
+public:
+    struct task_group {
+        std::atomic<int> nPending{ 0 };
+    };
+
+    // nThreads is the total number of threads working on tasks, including
+    // the one that calls Wait; 0 means one per hardware thread
+    explicit CTaskPool(int nThreads = 0);
+    ~CTaskPool();
+
+    CTaskPool(const CTaskPool&) = delete;
+    CTaskPool& operator=(const CTaskPool&) = delete;
+
+    void Run(task_group* pGroup, std::function<void()> fnTask);
+    void Wait(task_group* pGroup);
+
+    int ThreadCount() const {
+        return (int)m_aQueues.size();
+    }
+
+    // Index of the calling thread in [0, ThreadCount()); threads that
+    // aren't workers of this pool are 0
+    int CurrentThread() const;
+
+private:
+    struct task {
+        task_group* pGroup;
+        std::function<void()> fnTask;
+    };
+
+    struct worker_queue {
+        std::mutex lock;
+        std::deque<task> tasks;
+    };
+
+    void WorkerMain(int iWorker);
+    bool TryExecuteOne(int iWorker);
+
+    std::vector<worker_queue*> m_aQueues;
+    std::vector<std::thread> m_aThreads;
+
+    std::mutex m_lockSleep;
+    std::condition_variable m_cvSleep;
+    std::atomic<int> m_nQueued{ 0 };
+    std::atomic<bool> m_bShutdown{ false };
+};